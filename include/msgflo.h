@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <functional>
+#include <vector>
 
 #include "json11.hpp"
 
@@ -11,10 +13,51 @@ namespace msgflo {
 struct Definition {
 
     struct Port {
+        Port(const std::string &id = "", const std::string &type = "any", const std::string &queue = "")
+            : id(id)
+            , type(type)
+            , queue(queue)
+        {}
+
         std::string id;
         std::string type;
         std::string queue;
 
+        // Encoding of the payload: "json" (the default), "msgpack", "cbor", "raw",
+        // or the matching MIME type. Used by the json11::Json send() and Message::asJson().
+        std::string contentType;
+
+        // Inports only: messages delivered before any is acked, 0 uses EngineConfig::prefetch()
+        int prefetch = 0;
+
+        // MQTT only: quality of service for subscribing to or publishing on the port, 0, 1 or 2
+        int qos = 0;
+
+        // Inports, with EngineConfig::fairScheduling(): messages of a higher
+        // priority are handled first, those of ports with the same priority in
+        // proportion to their weight, counted in payload bytes. Give a
+        // latency-critical port with little traffic a higher priority, a
+        // port that should get a larger share under load a higher weight.
+        int priority = 0;
+        int weight = 1;
+
+        // Outports: compresses payloads of at least compressionThreshold bytes
+        // with "lz4" (fast) or "zstd" (smaller), "" leaves them as they are. A
+        // payload that does not get smaller is sent as it is. Receivers
+        // decompress messages AMQP and inproc mark as compressed transparently.
+        // Inports: any setting but "" and "none" decompresses all compressed
+        // payloads, which MQTT needs as it cannot mark them. Registering a
+        // port with an algorithm this build lacks throws.
+        std::string compression;
+        // lz4: acceleration, higher is faster and larger. zstd: level, 1 to 19.
+        // 0 uses the library's default.
+        int compressionLevel = 0;
+        uint64_t compressionThreshold = 512;
+        // zstd only: contents of a dictionary, e.g. made with `zstd --train`
+        // from typical payloads, which helps most with small ones. Inports
+        // receiving such payloads need the same dictionary set.
+        std::string compressionDictionary;
+
         json11::Json to_json() const {
             return json11::Json::object {
                     {"id",    id},
@@ -67,6 +110,30 @@ public:
     std::vector<Port> outports;
 };
 
+// Non-owning view of a message payload, valid as long as the message it came from
+struct PayloadView {
+    const char *data;
+    uint64_t size;
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+};
+
+// One chunk of a stream sent with Participant::sendStream(), see Message::chunk()
+struct StreamChunk {
+    static const uint64_t unknownSize = UINT64_MAX;
+
+    // Random, the same on every chunk of the stream
+    uint64_t transfer;
+    // Of the chunk's data in the stream
+    uint64_t offset;
+    // Of the whole stream, unknownSize if the sender did not know it
+    uint64_t total;
+    bool last;
+    PayloadView data;
+};
+
 class Message {
 public:
     virtual ~Message() {};
@@ -76,32 +143,327 @@ public:
 
     virtual void data(const char **_data, uint64_t *len) = 0;
 
+    // The payload, without copying it
+    PayloadView view() {
+        PayloadView v;
+        data(&v.data, &v.size);
+        return v;
+    }
+
+    // Returns a message that stays valid after the handler has returned, to be
+    // acked or read later. The payload buffer is taken over if this message
+    // already owns it, otherwise it is copied once. Do not use this message afterwards.
+    virtual std::unique_ptr<Message> retain() = 0;
+
     virtual void ack() = 0;
 
     virtual void nack() = 0;
 
     virtual std::string port() = 0;
+
+    // Returns false for a message that is not a chunk of a stream
+    bool chunk(StreamChunk &chunk);
 };
 
 using MessageHandler = std::function<void(Message *)>;
 
+// Gets a message it owns, which it acks or nacks when done, from any thread.
+// It should return without waiting for that, so the next messages of the
+// inport are delivered meanwhile: up to the inport's prefetch (AMQP) or
+// EngineConfig::maxInflight() (MQTT) messages are in flight, completed in any
+// order. A message destroyed without an ack or nack is nacked.
+using AsyncMessageHandler = std::function<void(std::unique_ptr<Message>)>;
+
+// Completion of a send. Called on the engine's loop thread with true once the
+// broker has taken responsibility for the message (with publisher confirms),
+// or false if it was refused or the connection was lost.
+using SendCallback = std::function<void(bool ok)>;
+
 class Engine;
 
+struct OutPortState;
+
+// An outport looked up once with Participant::outPort(), so sends do not have
+// to find the port by name. Valid as long as the participant it came from.
+class OutPort {
+public:
+    OutPort()
+        : _state(nullptr)
+    {}
+
+    explicit OutPort(const OutPortState *state)
+        : _state(state)
+    {}
+
+    bool valid() const {
+        return _state != nullptr;
+    }
+
+    const OutPortState *state() const {
+        return _state;
+    }
+
+private:
+    const OutPortState *_state;
+};
+
+// Where the data of a stream comes from. Called with the offset of the next
+// piece and the most it may be, it returns the piece, which needs to stay
+// valid until the next call. An empty piece ends the stream.
+using StreamSource = std::function<PayloadView(uint64_t offset, uint64_t max)>;
+
+struct StreamOptions {
+    // Data in each chunk message, a header of 32 bytes is added
+    uint64_t chunkSize = 256 * 1024;
+    // Chunks handed to the engine and not yet completed. With the outbound
+    // queue (EngineConfig::outboundLimit()) this bounds the memory a stream takes.
+    size_t window = 4;
+};
+
 class Participant {
 public:
     virtual ~Participant() = default;
 
-    virtual void send(std::string port, const json11::Json &json) = 0;
+    // Throws std::domain_error for an unknown port
+    virtual OutPort outPort(const std::string &port) = 0;
 
-    virtual void send(std::string port, const std::string &string) = 0;
+    virtual void send(const std::string &port, const json11::Json &json) = 0;
 
-    virtual void send(std::string port, const char *data, uint64_t len) = 0;
+    virtual void send(const std::string &port, const std::string &string) = 0;
+
+    virtual void send(const std::string &port, const char *data, uint64_t len) = 0;
+
+    virtual void send(const std::string &port, const json11::Json &json, const SendCallback &done) = 0;
+
+    virtual void send(const std::string &port, const std::string &string, const SendCallback &done) = 0;
+
+    virtual void send(const std::string &port, const char *data, uint64_t len, const SendCallback &done) = 0;
+
+    virtual void send(const OutPort &port, const json11::Json &json) = 0;
+
+    virtual void send(const OutPort &port, const std::string &string) = 0;
+
+    virtual void send(const OutPort &port, const char *data, uint64_t len) = 0;
+
+    virtual void send(const OutPort &port, const json11::Json &json, const SendCallback &done) = 0;
+
+    virtual void send(const OutPort &port, const std::string &string, const SendCallback &done) = 0;
+
+    virtual void send(const OutPort &port, const char *data, uint64_t len, const SendCallback &done) = 0;
+
+    // Sends several messages on a port with one hand-over to the engine. `done`
+    // is called once, with true if every message was sent.
+    virtual void sendBatch(const std::string &port, const std::vector<PayloadView> &payloads, const SendCallback &done) = 0;
+
+    virtual void sendBatch(const OutPort &port, const std::vector<PayloadView> &payloads, const SendCallback &done) = 0;
+
+    void sendBatch(const std::string &port, const std::vector<PayloadView> &payloads) {
+        sendBatch(port, payloads, SendCallback());
+    }
+
+    void sendBatch(const OutPort &port, const std::vector<PayloadView> &payloads) {
+        sendBatch(port, payloads, SendCallback());
+    }
+
+    // Sends a payload of any size as chunk messages on the port, taking the
+    // next chunk from `source` as earlier ones complete, so the sender never
+    // has all of it in memory and receivers can use the first chunks before
+    // the last is sent. Pass StreamChunk::unknownSize if the size is not known
+    // up front, the stream then ends with an empty chunk. `done` is called
+    // once, with true if every chunk was sent. Receivers read streams with a
+    // StreamReader, which needs the chunks of a stream to go to one consumer.
+    // Returns the transfer id the chunks carry.
+    uint64_t sendStream(const OutPort &port, uint64_t size, const StreamSource &source,
+                        const SendCallback &done = SendCallback(), const StreamOptions &options = StreamOptions());
+
+    // A stream of `len` bytes at `data`, which needs to stay valid until `done` is called
+    uint64_t sendStream(const OutPort &port, const char *data, uint64_t len,
+                        const SendCallback &done = SendCallback(), const StreamOptions &options = StreamOptions());
+
+    // A stream of the file's contents, sent from a read-only memory mapping of
+    // it. Throws std::runtime_error if the file cannot be opened or mapped.
+    uint64_t sendFile(const OutPort &port, const std::string &path,
+                      const SendCallback &done = SendCallback(), const StreamOptions &options = StreamOptions());
 
     virtual void onMessage(const MessageHandler &handler) = 0;
 
+    // Instead of onMessage()
+    virtual void onMessageAsync(const AsyncMessageHandler &handler) = 0;
+
 private:
 };
 
+// Puts streams sent with Participant::sendStream() back together for an
+// inport's handler, which passes every message to read(). The data of each
+// transfer goes to the data handler in order, as its chunks arrive, and each
+// chunk is acked once handed on. Chunks that arrive ahead of a missing one,
+// as they can with handler threads, are retained until their turn.
+//
+// A transfer is given up on, its held chunks nacked and the fail handler
+// called, when more than `maxPending` of its chunks are held or when
+// `maxTransfers` others have been active since its last chunk.
+// Handlers are called one at a time and must not call read().
+class StreamReader {
+public:
+    using DataHandler = std::function<void(uint64_t transfer, const char *data, uint64_t len, bool last)>;
+    using FailHandler = std::function<void(uint64_t transfer)>;
+
+    explicit StreamReader(const DataHandler &data, const FailHandler &failed = FailHandler(),
+                          size_t maxPending = 64, size_t maxTransfers = 16);
+    ~StreamReader();
+
+    StreamReader(const StreamReader &) = delete;
+    StreamReader &operator=(const StreamReader &) = delete;
+
+    // Returns false, leaving the message alone, if it is not a chunk
+    bool read(Message *msg);
+
+    // For an AsyncMessageHandler, takes the message if it is a chunk
+    bool read(std::unique_ptr<Message> &msg);
+
+    // Transfers started and not yet complete
+    size_t activeTransfers() const;
+
+private:
+    class Transfers;
+    std::unique_ptr<Transfers> transfers;
+};
+
+// Distribution of a duration in microseconds. Percentiles are accurate to about 6%.
+struct LatencyStats {
+    uint64_t count = 0;
+    double mean = 0;
+    uint64_t p50 = 0;
+    uint64_t p90 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+
+    json11::Json to_json() const {
+        return json11::Json::object {
+                {"count", static_cast<double>(count)},
+                {"mean",  mean},
+                {"p50",   static_cast<double>(p50)},
+                {"p90",   static_cast<double>(p90)},
+                {"p99",   static_cast<double>(p99)},
+                {"p999",  static_cast<double>(p999)},
+                {"max",   static_cast<double>(max)}
+        };
+    }
+};
+
+struct PortStats {
+    std::string participant;
+    std::string port;
+    std::string queue;
+    bool inport = false;
+    // Sent on an outport, delivered to the handler of an inport
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    // The same payloads as on the broker, fewer bytes where they were compressed
+    uint64_t wireBytes = 0;
+
+    // Inports only
+    uint64_t acks = 0;
+    uint64_t nacks = 0;
+    uint64_t redeliveries = 0;
+    // Delivered and not yet acked or nacked
+    uint64_t inFlight = 0;
+    // Time spent in the message handler, or until the ack or nack with an AsyncMessageHandler
+    LatencyStats handlerDuration;
+    // From send to delivery, for messages carrying their send time (see
+    // EngineConfig::timestampMessages()). Needs synchronized clocks across hosts.
+    LatencyStats latency;
+
+    json11::Json to_json() const {
+        json11::Json::object o {
+                {"participant", participant},
+                {"port",        port},
+                {"queue",       queue},
+                {"inport",      inport},
+                {"messages",    static_cast<double>(messages)},
+                {"bytes",       static_cast<double>(bytes)},
+                {"wireBytes",   static_cast<double>(wireBytes)}
+        };
+        if (inport) {
+            o["acks"] = static_cast<double>(acks);
+            o["nacks"] = static_cast<double>(nacks);
+            o["redeliveries"] = static_cast<double>(redeliveries);
+            o["inFlight"] = static_cast<double>(inFlight);
+            o["handlerDuration"] = handlerDuration.to_json();
+            o["latency"] = latency.to_json();
+        }
+        return o;
+    }
+};
+
+// A pool the engines take received messages or their payloads from when
+// they outlive the client library's callback
+struct PoolStats {
+    uint64_t allocations = 0;
+    // Allocations served from memory freed by earlier messages
+    uint64_t hits = 0;
+    // Handed out now and at most, and held by the pool
+    uint64_t bytesInUse = 0;
+    uint64_t peakBytes = 0;
+    uint64_t reservedBytes = 0;
+
+    double hitRate() const {
+        return allocations > 0 ? static_cast<double>(hits) / allocations : 1.0;
+    }
+
+    json11::Json to_json() const {
+        return json11::Json::object {
+                {"allocations",   static_cast<double>(allocations)},
+                {"hitRate",       hitRate()},
+                {"bytesInUse",    static_cast<double>(bytesInUse)},
+                {"peakBytes",     static_cast<double>(peakBytes)},
+                {"reservedBytes", static_cast<double>(reservedBytes)}
+        };
+    }
+};
+
+struct EngineStats {
+    std::vector<PortStats> ports;
+    // Sends waiting for a broker confirmation or for room in the confirm window
+    uint64_t sendsInFlight = 0;
+    // Sends waiting for the client library, see EngineConfig::outboundLimit()
+    uint64_t outboundMessages = 0;
+    uint64_t outboundBytes = 0;
+    // Sends failed by OverflowPolicy::DropOldest and OverflowPolicy::Fail
+    uint64_t outboundDropped = 0;
+    uint64_t outboundRefused = 0;
+    bool connected = false;
+    uint64_t reconnects = 0;
+    // From losing the broker connection until it is back and the participants'
+    // queues, exchanges and subscriptions have been requested again
+    LatencyStats recovery;
+    // Retained messages, and payload copies for retained messages and handler
+    // threads. Shared by all engines of the same kind in the process.
+    PoolStats messagePool;
+    PoolStats payloadPool;
+
+    json11::Json to_json() const {
+        json11::Json::array p;
+        for (const auto &port : ports) {
+            p.push_back(port.to_json());
+        }
+        return json11::Json::object {
+                {"ports",         p},
+                {"sendsInFlight", static_cast<double>(sendsInFlight)},
+                {"outboundMessages", static_cast<double>(outboundMessages)},
+                {"outboundBytes", static_cast<double>(outboundBytes)},
+                {"outboundDropped", static_cast<double>(outboundDropped)},
+                {"outboundRefused", static_cast<double>(outboundRefused)},
+                {"connected",     connected},
+                {"reconnects",    static_cast<double>(reconnects)},
+                {"recovery",      recovery.to_json()},
+                {"messagePool",   messagePool.to_json()},
+                {"payloadPool",   payloadPool.to_json()}
+        };
+    }
+};
+
 class Engine {
 public:
     virtual Participant *registerParticipant(const Definition &definition) = 0;
@@ -113,14 +475,72 @@ public:
         return p;
     }
 
+    // Stops the participant's consumers or subscriptions and its discovery
+    // messages. Like registerParticipant(), it can be called before or after
+    // launch(), from the loop thread or a handler thread. Messages already
+    // with a handler are completed normally, later ones go back to the broker
+    // where it can redeliver them. The participant must not be used afterwards.
+    // Throws std::invalid_argument for a participant of another engine.
+    virtual void unregisterParticipant(Participant *participant) = 0;
+
+    // Sets the engine up on the libev default loop without running it. Call it
+    // on the thread that is going to run the loop. Engines in a process can
+    // share the loop and its thread: start() all but one, then launch() that
+    // one, which runs them all.
+    virtual void start() = 0;
+
+    // Runs the libev default loop, calling start() first if needed
     virtual void launch() = 0;
+
+    // Counters of every port of the registered participants. Safe to call from any thread.
+    virtual EngineStats stats() = 0;
 protected:
 };
 
+// What a send does when the outbound queue is full
+enum class OverflowPolicy {
+    // Wait for room. Sends from the loop thread, which would wait forever, fail instead.
+    Block,
+    // Fail the send
+    Fail,
+    // Fail the oldest queued sends until it fits
+    DropOldest
+};
+
 class EngineConfig {
 public:
     EngineConfig()
         : _debugOutput(false)
+        , _handlerThreads(0)
+        , _prefetch(1)
+        , _adaptivePrefetch(false)
+        , _maxPrefetch(1000)
+        , _ackBatch(0)
+        , _ackFlushMilliseconds(10)
+        , _publisherConfirms(false)
+        , _confirmWindow(100)
+        , _channelPerInport(false)
+        , _publishChannels(0)
+        , _networkThread(false)
+        , _handoffCapacity(1024)
+        , _fairScheduling(false)
+        , _maxInflight(20)
+        , _timestampMessages(false)
+        , _statsPeriod(10)
+        , _discoveryRate(100)
+        , _discoveryBurst(100)
+        , _discoveryJitter(0.1)
+        , _cork(false)
+        , _corkBudget(64 * 1024)
+        , _outboundMessages(10000)
+        , _outboundBytes(64 * 1024 * 1024)
+        , _overflowPolicy(OverflowPolicy::Block)
+        , _highWatermark(0.8)
+        , _lowWatermark(0.5)
+        , _maxDecompressedSize(64 * 1024 * 1024)
+        , _reconnect(true)
+        , _reconnectDelay(0.1)
+        , _maxReconnectDelay(30)
         , discoveryPeriod(60)
     {
         _debugOutput = std::getenv("MSGFLO_CPP_DEBUG") ? true : false;
@@ -144,9 +564,348 @@ public:
         return _url;
     }
 
+    // Number of threads running message handlers. With 0 (the default) handlers
+    // run on the thread calling Engine::launch().
+    EngineConfig& handlerThreads(int threads) {
+        _handlerThreads = threads;
+        return *this;
+    };
+
+    int handlerThreads() const {
+        return _handlerThreads;
+    }
+
+    // Default number of unacked messages delivered to each inport. Currently used by AMQP.
+    EngineConfig& prefetch(int count) {
+        _prefetch = count;
+        return *this;
+    };
+
+    int prefetch() const {
+        return _prefetch;
+    }
+
+    // Periodically resize the prefetch of each inport from the measured handler
+    // latency and broker round trip time, between 1 and maxPrefetch.
+    EngineConfig& adaptivePrefetch(bool on, int maxPrefetch = 1000) {
+        _adaptivePrefetch = on;
+        _maxPrefetch = maxPrefetch;
+        return *this;
+    };
+
+    bool adaptivePrefetch() const {
+        return _adaptivePrefetch;
+    }
+
+    int maxPrefetch() const {
+        return _maxPrefetch;
+    }
+
+    // Coalesce acks: send one ack covering many deliveries once `count` acks
+    // are pending, or after `flushMilliseconds`. 0 acks every message on its own.
+    // Currently used by AMQP.
+    EngineConfig& ackBatch(int count, int flushMilliseconds = 10) {
+        _ackBatch = count;
+        _ackFlushMilliseconds = flushMilliseconds;
+        return *this;
+    };
+
+    int ackBatch() const {
+        return _ackBatch;
+    }
+
+    int ackFlushMilliseconds() const {
+        return _ackFlushMilliseconds;
+    }
+
+    // Have the broker confirm each sent message: AMQP publisher confirms, MQTT QoS 1, or the port's QoS if higher.
+    // At most `window` messages are unconfirmed at a time, later sends are queued.
+    EngineConfig& publisherConfirms(bool on, int window = 100) {
+        _publisherConfirms = on;
+        _confirmWindow = window;
+        return *this;
+    };
+
+    bool publisherConfirms() const {
+        return _publisherConfirms;
+    }
+
+    int confirmWindow() const {
+        return _confirmWindow;
+    }
+
+    // Consume each inport on an AMQP channel of its own, with its own
+    // prefetch and flow control. A channel error then stops only that inport
+    // until its channel is opened again, instead of the whole connection.
+    // Currently used by AMQP.
+    EngineConfig& channelPerInport(bool on) {
+        _channelPerInport = on;
+        return *this;
+    };
+
+    bool channelPerInport() const {
+        return _channelPerInport;
+    }
+
+    // Publish on `count` AMQP channels of their own instead of the one
+    // consumers share. Each outport always uses the same one, so its messages
+    // stay in order, and a channel error fails only the sends on that channel.
+    // 0 publishes on the shared channel. Currently used by AMQP.
+    EngineConfig& publishChannels(int count) {
+        _publishChannels = count;
+        return *this;
+    };
+
+    int publishChannels() const {
+        return _publishChannels;
+    }
+
+    // Do network I/O on a thread of its own instead of the thread calling
+    // Engine::launch(). Currently used by MQTT, where libmosquitto runs it.
+    EngineConfig& networkThread(bool on) {
+        _networkThread = on;
+        return *this;
+    };
+
+    bool networkThread() const {
+        return _networkThread;
+    }
+
+    // Messages that can wait between the network thread and the handlers
+    // before the network thread stops reading. The loop thread never waits
+    // for the handlers: when it is full, MQTT stops reading until a handler
+    // thread takes a message, and AMQP keeps what the prefetch lets in until then.
+    EngineConfig& handoffCapacity(int messages) {
+        _handoffCapacity = messages;
+        return *this;
+    };
+
+    int handoffCapacity() const {
+        return _handoffCapacity;
+    }
+
+    // Hand received messages to the handlers by Definition::Port::priority and
+    // weight instead of in arrival order, so a flood on one inport does not
+    // hold up the others. Messages wait in a queue per inport, up to
+    // handoffCapacity() in all, and are taken in weighted deficit round-robin
+    // order. Without handler threads they are handled a few per loop
+    // iteration, so messages read meanwhile can overtake those still waiting.
+    EngineConfig& fairScheduling(bool on) {
+        _fairScheduling = on;
+        return *this;
+    };
+
+    bool fairScheduling() const {
+        return _fairScheduling;
+    }
+
+    // QoS 1 and 2 messages in flight per direction. Sends beyond it are queued
+    // by the client library, and reading stops while that many received
+    // messages are not yet acked or nacked. With the network thread, reading
+    // goes on after half the keepalive interval, so the connection stays up.
+    // 0 means no limit. Currently used by MQTT.
+    EngineConfig& maxInflight(int messages) {
+        _maxInflight = messages;
+        return *this;
+    };
+
+    int maxInflight() const {
+        return _maxInflight;
+    }
+
+    // Put the send time on sent messages, so receivers can measure the latency
+    // from send to delivery. Used by AMQP, where it adds a header.
+    EngineConfig& timestampMessages(bool on) {
+        _timestampMessages = on;
+        return *this;
+    };
+
+    bool timestampMessages() const {
+        return _timestampMessages;
+    }
+
+    // Publish Engine::stats() as JSON on `topic` every `periodSeconds`, next to
+    // the discovery messages. Empty (the default) publishes nothing.
+    EngineConfig& statsTopic(const std::string &topic, int periodSeconds = 10) {
+        _statsTopic = topic;
+        _statsPeriod = periodSeconds;
+        return *this;
+    };
+
+    std::string statsTopic() const {
+        return _statsTopic;
+    }
+
+    int statsPeriod() const {
+        return _statsPeriod;
+    }
+
+    // Discovery messages are sent at most `perSecond` per second, in bursts of
+    // up to `burst`. 0 does not limit them.
+    EngineConfig& discoveryRate(double perSecond, int burst = 100) {
+        _discoveryRate = perSecond;
+        _discoveryBurst = burst;
+        return *this;
+    };
+
+    double discoveryRate() const {
+        return _discoveryRate;
+    }
+
+    int discoveryBurst() const {
+        return _discoveryBurst;
+    }
+
+    // Each participant's discovery message is resent a third of discoveryPeriod
+    // after the previous one, give or take `fraction` of that. The first one
+    // is sent within `fraction` of it after connecting.
+    EngineConfig& discoveryJitter(double fraction) {
+        _discoveryJitter = fraction;
+        return *this;
+    };
+
+    double discoveryJitter() const {
+        return _discoveryJitter;
+    }
+
+    // Hold back the sends of one loop iteration, up to `budgetBytes`, and let
+    // them leave the socket together in full TCP segments. Used by AMQP, and
+    // by MQTT without the network thread.
+    EngineConfig& cork(bool on, int budgetBytes = 64 * 1024) {
+        _cork = on;
+        _corkBudget = budgetBytes;
+        return *this;
+    };
+
+    bool cork() const {
+        return _cork;
+    }
+
+    int corkBudget() const {
+        return _corkBudget;
+    }
+
+    // Bound the sends waiting for the client library, which otherwise buffers
+    // without limit while the broker or network is slow, to `messages` and
+    // `bytes`. This is also the outbox holding sends while disconnected, which
+    // go out once the connection is back. 0 does not limit that dimension, both
+    // 0 disables the queue. Failed sends complete with false, as do sends
+    // still queued when the engine is destroyed or the connection is lost
+    // without reconnect(). Defaults to 10000 messages and 64 MiB, and
+    // `bytes` to 64 MiB when only `messages` is given. Used by AMQP and MQTT.
+    EngineConfig& outboundLimit(int messages, int64_t bytes = 64 * 1024 * 1024,
+                                OverflowPolicy policy = OverflowPolicy::Block) {
+        _outboundMessages = messages;
+        _outboundBytes = bytes;
+        _overflowPolicy = policy;
+        return *this;
+    };
+
+    int outboundMessages() const {
+        return _outboundMessages;
+    }
+
+    int64_t outboundBytes() const {
+        return _outboundBytes;
+    }
+
+    OverflowPolicy overflowPolicy() const {
+        return _overflowPolicy;
+    }
+
+    // Called with true when the outbound queue fills past `high` of its limit,
+    // and with false when it is back down to `low`. Called from the thread
+    // making the send or the loop thread, and may send.
+    EngineConfig& outboundWatermarks(double high, double low, std::function<void(bool above)> callback) {
+        _highWatermark = high;
+        _lowWatermark = low;
+        _watermarkCallback = callback;
+        return *this;
+    };
+
+    double highWatermark() const {
+        return _highWatermark;
+    }
+
+    double lowWatermark() const {
+        return _lowWatermark;
+    }
+
+    std::function<void(bool above)> watermarkCallback() const {
+        return _watermarkCallback;
+    }
+
+    // Largest payload a compressed message decompresses to, see
+    // Definition::Port::compression. Reading a message claiming more throws
+    // std::domain_error. Defaults to 64 MiB.
+    EngineConfig& maxDecompressedSize(uint64_t bytes) {
+        _maxDecompressedSize = bytes;
+        return *this;
+    };
+
+    uint64_t maxDecompressedSize() const {
+        return _maxDecompressedSize;
+    }
+
+    // Reconnect after losing the broker connection, waiting from `delaySeconds`
+    // doubling up to `maxDelaySeconds` between attempts, and set up the
+    // participants again. On by default. Without it AMQP stops using the
+    // connection and MQTT without the network thread stops the loop.
+    // With the network thread libmosquitto reconnects, in whole seconds.
+    EngineConfig& reconnect(bool on, double delaySeconds = 0.1, double maxDelaySeconds = 30) {
+        _reconnect = on;
+        _reconnectDelay = delaySeconds;
+        _maxReconnectDelay = maxDelaySeconds;
+        return *this;
+    };
+
+    bool reconnect() const {
+        return _reconnect;
+    }
+
+    double reconnectDelay() const {
+        return _reconnectDelay;
+    }
+
+    double maxReconnectDelay() const {
+        return _maxReconnectDelay;
+    }
+
 public:
     bool _debugOutput;
     std::string _url;
+    int _handlerThreads;
+    int _prefetch;
+    bool _adaptivePrefetch;
+    int _maxPrefetch;
+    int _ackBatch;
+    int _ackFlushMilliseconds;
+    bool _publisherConfirms;
+    int _confirmWindow;
+    bool _channelPerInport;
+    int _publishChannels;
+    bool _networkThread;
+    int _handoffCapacity;
+    bool _fairScheduling;
+    int _maxInflight;
+    bool _timestampMessages;
+    std::string _statsTopic;
+    int _statsPeriod;
+    double _discoveryRate;
+    int _discoveryBurst;
+    double _discoveryJitter;
+    bool _cork;
+    int _corkBudget;
+    int _outboundMessages;
+    int64_t _outboundBytes;
+    OverflowPolicy _overflowPolicy;
+    double _highWatermark;
+    double _lowWatermark;
+    std::function<void(bool above)> _watermarkCallback;
+    uint64_t _maxDecompressedSize;
+    bool _reconnect;
+    double _reconnectDelay;
+    double _maxReconnectDelay;
     int discoveryPeriod; // seconds
 };
 
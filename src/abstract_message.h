@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "msgflo.h"
+#include "codec.h"
+#include "compression.h"
+#include "message_pool.h"
+#include "stats.h"
+
+namespace msgflo {
+
+// What the engines' messages have in common: a payload, either borrowed from
+// the transport or owned in a pooled buffer, and the codec of the port it
+// arrived on. A payload known to be compressed, given a nonzero `maxInflated`,
+// is decompressed when first read, up to that size.
+class AbstractMessage : public Message {
+protected:
+    AbstractMessage(const char *data, const uint64_t len, const std::string &port, const Codec *codec,
+                    uint64_t maxInflated = 0)
+        : _owned(false)
+        , _data(data)
+        , _len(len)
+        , _payloadLen(len)
+        , _maxInflated(maxInflated)
+        , _port(port)
+        , _codec(codec)
+    {
+        checkCompressed();
+    }
+
+    // Takes ownership of the payload, for messages outliving the transport callback
+    AbstractMessage(PayloadBuffer &&storage, const std::string &port, const Codec *codec, uint64_t maxInflated = 0)
+        : _storage(std::move(storage))
+        , _owned(true)
+        , _data(_storage.data())
+        , _len(_storage.size())
+        , _payloadLen(_len)
+        , _maxInflated(maxInflated)
+        , _port(port)
+        , _codec(codec)
+    {
+        checkCompressed();
+    }
+
+    virtual ~AbstractMessage() {};
+
+    // The payload for a retained copy of this message, moved out if owned.
+    // Once decompressed, the copy gets the decompressed payload.
+    PayloadBuffer takePayload() {
+        PayloadBuffer payload = _compressed && _inflated ? std::move(_inflatedStorage)
+                              : _owned ? std::move(_storage) : PayloadBuffer(_data, _len);
+        _owned = false;
+        _data = nullptr;
+        _len = 0;
+        _payloadLen = 0;
+        _compressed = false;
+        _refused = nullptr;
+        return payload;
+    }
+
+    // Whether the payload is decompressed when read, and to what size
+    void checkCompressed() {
+        if (_maxInflated > 0 && isCompressed(_data, _len)) {
+            const uint64_t size = decompressedSize(_data, _len, _maxInflated, _refused);
+            _compressed = size > 0;
+            _payloadLen = _compressed ? size : _len;
+        }
+    }
+
+    // The `maxInflated` for a retained copy, taken before takePayload()
+    uint64_t inflateLimit() const {
+        return _inflated ? 0 : _maxInflated;
+    }
+
+    // The payload as sent, decompressing it if that has not been done yet.
+    // Throws std::domain_error for a compressed payload it cannot decompress.
+    const char *payload() {
+        if (_refused) {
+            throw std::domain_error(std::string("Compressed payload not decompressed: ") + _refused);
+        }
+        if (_compressed && !_inflated) {
+            PayloadBuffer plain(static_cast<size_t>(_payloadLen));
+            decompress(_data, _len, plain.data(), _payloadLen);
+            _inflatedStorage = std::move(plain);
+            _inflated = true;
+        }
+        return _compressed ? _inflatedStorage.data() : _data;
+    }
+
+    PayloadBuffer _storage;
+    bool _owned;
+    // As received, which for a compressed payload is the compressed bytes
+    const char *_data;
+    uint64_t _len;
+    bool _compressed = false;
+    bool _inflated = false;
+    uint64_t _payloadLen;
+    const uint64_t _maxInflated;
+    const char *_refused = nullptr;
+    PayloadBuffer _inflatedStorage;
+    const std::string _port;
+    const Codec *_codec;
+    PortCounters *_counters = nullptr;
+    // When the message was given to an AsyncMessageHandler, 0 for other messages
+    int64_t _handedOver = 0;
+    bool _settled = false;
+
+    // For the engines' ack() and nack()
+    void countSettled(bool acked) {
+        _settled = true;
+        if (!_counters) {
+            return;
+        }
+        (acked ? _counters->acks : _counters->nacks).fetch_add(1, std::memory_order_relaxed);
+        if (_handedOver) {
+            _counters->handlerDuration.record(monotonicMicros() - _handedOver);
+        }
+    }
+
+    // For the engines' destructors: an async handler let go of the message without completing it
+    bool dropped() const {
+        return _handedOver && !_settled;
+    }
+
+public:
+    // The inport counters acks and nacks are counted on, carried over to retained copies
+    void countOn(PortCounters *counters) {
+        _counters = counters;
+    }
+
+    PortCounters *counters() const {
+        return _counters;
+    }
+
+    // Marks a retained message as given to an AsyncMessageHandler
+    void handOver(int64_t now) {
+        _handedOver = now;
+    }
+
+    // Size of the payload as sent, without decompressing it
+    uint64_t payloadSize() const {
+        return _payloadLen;
+    }
+
+    // Size of the payload as received from the broker
+    uint64_t wireSize() const {
+        return _len;
+    }
+
+    virtual void data(const char **data, uint64_t *len) override {
+        *data = payload();
+        *len = _payloadLen;
+    }
+
+    virtual std::string port() override {
+        return _port;
+    }
+
+    virtual std::string asString() override {
+        std::string str(payload(), _payloadLen);
+        return str;
+    }
+
+    virtual json11::Json asJson() override {
+        std::string err;
+        json11::Json x;
+        // As sent, decompressed if need be
+        const char *data = payload();
+        x = _codec->decode(data, _payloadLen, err);
+        if (!err.empty()) {
+            std::cerr << "_len=" << _payloadLen << std::endl;
+            throw std::domain_error("Could not parse " + _codec->contentType() + " body: " + err + ", payload: " + std::string(data, _payloadLen));
+        }
+        return x;
+    }
+};
+
+// Runs an inport's handler, counting the message on the port and timing the
+// handler. sentMicros is the wall clock send time if the message carries it.
+// An async handler gets a retained copy and is timed until it completes it.
+template<typename Registration>
+inline void runHandler(const Registration &r, PortCounters &counters, AbstractMessage &msg, int64_t sentMicros = 0) {
+    counters.count(msg.payloadSize(), msg.wireSize());
+    if (sentMicros > 0) {
+        counters.latency.record(wallclockMicros() - sentMicros);
+    }
+    msg.countOn(&counters);
+
+    const int64_t start = monotonicMicros();
+    if (r.asyncHandler) {
+        // Every engine's retain() makes a message of its own type
+        std::unique_ptr<Message> owned = msg.retain();
+        static_cast<AbstractMessage &>(*owned).handOver(start);
+        r.asyncHandler(std::move(owned));
+        return;
+    }
+    r.handler(&msg);
+    counters.handlerDuration.record(monotonicMicros() - start);
+}
+
+} // namespace msgflo
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace msgflo {
+
+// Tracks settled delivery tags of one AMQP channel so that a run of acks can be
+// sent as a single basic.ack with the "multiple" flag.
+//
+// Delivery tags on a channel start at 1 and increase by one per delivery. A
+// multiple-ack for tag N settles every unsettled delivery up to N, so it may
+// only be sent once all tags up to N are settled, and N itself must still be
+// outstanding on the broker (not rejected or already acked on its own).
+class AckCoalescer {
+public:
+    AckCoalescer()
+        : contiguous(0)
+        , ackable(0)
+        , sent(0)
+        , pending(0)
+    {}
+
+    // Records that the handler acked a delivery. Returns the number of acks not sent yet.
+    size_t ack(uint64_t tag) {
+        settle(tag, Acked);
+        return ++pending;
+    }
+
+    // Records a delivery rejected by the caller, which already told the broker.
+    void rejected(uint64_t tag) {
+        settle(tag, Sent);
+    }
+
+    // Highest tag to send a multiple-ack for, or 0 if the contiguous run has nothing new
+    uint64_t takeMultiple() {
+        if (ackable <= sent) {
+            return 0;
+        }
+        sent = ackable;
+        pending = 0;
+        for (auto s : window) {
+            if (s == Acked) {
+                pending++;
+            }
+        }
+        return sent;
+    }
+
+    // Acked tags after a gap, which cannot be covered by a multiple-ack yet.
+    // The caller acks them one by one, so a slow message does not hold back the
+    // acks of the ones after it and stall the prefetch window.
+    std::vector<uint64_t> takeOutOfOrder() {
+        std::vector<uint64_t> tags;
+        for (size_t i = 0; i < window.size(); i++) {
+            if (window[i] == Acked) {
+                window[i] = Sent;
+                tags.push_back(contiguous + 1 + i);
+            }
+        }
+        pending -= tags.size();
+        return tags;
+    }
+
+    size_t unsent() const {
+        return pending;
+    }
+
+    // Delivery tags restart when the channel is reopened
+    void reset() {
+        window.clear();
+        contiguous = ackable = sent = 0;
+        pending = 0;
+    }
+
+private:
+    enum State : uint8_t {
+        Unsettled,
+        Acked,
+        Sent,
+    };
+
+    void settle(uint64_t tag, State state) {
+        if (tag <= contiguous) {
+            return;
+        }
+        const auto index = static_cast<size_t>(tag - contiguous - 1);
+        if (index >= window.size()) {
+            window.resize(index + 1, Unsettled);
+        }
+        window[index] = state;
+
+        while (!window.empty() && window.front() != Unsettled) {
+            contiguous++;
+            if (window.front() == Acked) {
+                ackable = contiguous;
+            }
+            window.pop_front();
+        }
+    }
+
+    // Tags after `contiguous`, the first one is always unsettled
+    std::deque<State> window;
+    // All tags up to this one are settled
+    uint64_t contiguous;
+    // Highest acked tag up to `contiguous`
+    uint64_t ackable;
+    // Highest tag covered by a multiple-ack sent to the broker
+    uint64_t sent;
+    size_t pending;
+};
+
+} // namespace msgflo
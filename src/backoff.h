@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace msgflo {
+
+// Delays between reconnect attempts in seconds: doubling from `initial` up to
+// `max`, each drawn between half and all of that, so the clients that lost
+// the same broker do not all come back at the same moment.
+class Backoff {
+public:
+    Backoff(double initial, double max, unsigned seed = std::random_device()())
+        : initial(initial > 0 ? initial : 0.1)
+        , max(std::max(max, this->initial))
+        , random(seed)
+    {}
+
+    double next() {
+        const double ceiling = std::min(max, initial * std::pow(2.0, attempt));
+        attempt = std::min(attempt + 1, 62);
+        return std::uniform_real_distribution<double>(ceiling / 2, ceiling)(random);
+    }
+
+    // After a successful connect
+    void reset() {
+        attempt = 0;
+    }
+
+    int attempts() const {
+        return attempt;
+    }
+
+private:
+    const double initial;
+    const double max;
+    std::mt19937 random;
+    int attempt = 0;
+};
+
+} // namespace msgflo
@@ -0,0 +1,670 @@
+#include "codec.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+using json11::Json;
+
+namespace msgflo {
+
+namespace {
+
+// Deeper documents are rejected instead of risking the stack
+const int maxDepth = 256;
+
+// Larger JSON payloads are copied for json11 into a string of their own
+const uint64_t maxParseCopy = 64 * 1024;
+
+bool isInteger(double d) {
+    return std::floor(d) == d
+        && d >= static_cast<double>(std::numeric_limits<int64_t>::min())
+        && d < static_cast<double>(std::numeric_limits<int64_t>::max());
+}
+
+void putBigEndian(string &out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+    }
+}
+
+uint64_t doubleBits(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+double bitsDouble(uint64_t bits) {
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+float bitsFloat(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Bounds checked big endian reading shared by the binary decoders
+class Reader {
+public:
+    Reader(const char *data, uint64_t len, string &err)
+        : p(reinterpret_cast<const uint8_t *>(data))
+        , end(p + len)
+        , err(err)
+    {}
+
+    bool atEnd() const {
+        return p == end;
+    }
+
+    bool failed() const {
+        return !err.empty();
+    }
+
+    void fail(const string &what) {
+        if (err.empty()) {
+            err = what;
+        }
+    }
+
+    uint8_t byte() {
+        if (p == end) {
+            fail("unexpected end of data");
+            return 0;
+        }
+        return *p++;
+    }
+
+    uint8_t peek() {
+        if (p == end) {
+            fail("unexpected end of data");
+            return 0;
+        }
+        return *p;
+    }
+
+    uint64_t bigEndian(int bytes) {
+        if (end - p < bytes) {
+            fail("unexpected end of data");
+            p = end;
+            return 0;
+        }
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; i++) {
+            v = (v << 8) | *p++;
+        }
+        return v;
+    }
+
+    string bytes(uint64_t n) {
+        if (static_cast<uint64_t>(end - p) < n) {
+            fail("unexpected end of data");
+            p = end;
+            return string();
+        }
+        string s(reinterpret_cast<const char *>(p), static_cast<size_t>(n));
+        p += n;
+        return s;
+    }
+
+    // Rejects counts that cannot fit in the rest of the data before allocating for them
+    bool plausibleCount(uint64_t n) {
+        if (n > static_cast<uint64_t>(end - p)) {
+            fail("element count larger than data");
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const uint8_t *p;
+    const uint8_t *end;
+    string &err;
+};
+
+class JsonCodec final : public Codec {
+public:
+    const string &contentType() const override {
+        static const string type = "application/json";
+        return type;
+    }
+
+    void encode(const Json &json, string &out) const override {
+        json.dump(out);
+    }
+
+    // json11 only parses a std::string, which for payloads up to the size
+    // PayloadPool pools is one kept per thread, so parsing does not allocate
+    Json decode(const char *data, uint64_t len, string &err) const override {
+        if (len > maxParseCopy) {
+            return Json::parse(string(data, len), err);
+        }
+        static thread_local string text;
+        text.assign(data, static_cast<size_t>(len));
+        return Json::parse(text, err);
+    }
+};
+
+// Raw bytes in and out of a JSON string value
+class RawCodec final : public Codec {
+public:
+    const string &contentType() const override {
+        static const string type = "application/octet-stream";
+        return type;
+    }
+
+    void encode(const Json &json, string &out) const override {
+        if (!json.is_string()) {
+            throw domain_error("Raw ports can only send strings");
+        }
+        out += json.string_value();
+    }
+
+    Json decode(const char *data, uint64_t len, string &err) const override {
+        return Json(string(data, len));
+    }
+};
+
+// https://github.com/msgpack/msgpack/blob/master/spec.md
+class MsgPackCodec final : public Codec {
+public:
+    const string &contentType() const override {
+        static const string type = "application/msgpack";
+        return type;
+    }
+
+    void encode(const Json &json, string &out) const override {
+        encodeValue(json, out, 0);
+    }
+
+    Json decode(const char *data, uint64_t len, string &err) const override {
+        Reader r(data, len, err);
+        Json json = decodeValue(r, 0);
+        if (!r.failed() && !r.atEnd()) {
+            r.fail("trailing data after MessagePack value");
+        }
+        return r.failed() ? Json() : json;
+    }
+
+private:
+    static void encodeValue(const Json &json, string &out, int depth) {
+        if (depth > maxDepth) {
+            throw domain_error("Value nested too deep for MessagePack encoding");
+        }
+
+        switch (json.type()) {
+        case Json::NUL:
+            out.push_back('\xc0');
+            break;
+        case Json::BOOL:
+            out.push_back(json.bool_value() ? '\xc3' : '\xc2');
+            break;
+        case Json::NUMBER:
+            encodeNumber(json.number_value(), out);
+            break;
+        case Json::STRING:
+            encodeString(json.string_value(), out);
+            break;
+        case Json::ARRAY: {
+            const auto &items = json.array_items();
+            encodeLength(items.size(), 0x90, 16, '\xdc', '\xdd', out);
+            for (const auto &item : items) {
+                encodeValue(item, out, depth + 1);
+            }
+            break;
+        }
+        case Json::OBJECT: {
+            const auto &items = json.object_items();
+            encodeLength(items.size(), 0x80, 16, '\xde', '\xdf', out);
+            for (const auto &item : items) {
+                encodeString(item.first, out);
+                encodeValue(item.second, out, depth + 1);
+            }
+            break;
+        }
+        }
+    }
+
+    static void encodeNumber(double d, string &out) {
+        if (!isInteger(d)) {
+            out.push_back('\xcb');
+            putBigEndian(out, doubleBits(d), 8);
+            return;
+        }
+
+        const auto i = static_cast<int64_t>(d);
+        if (i >= 0) {
+            const auto u = static_cast<uint64_t>(i);
+            if (u < 128) {
+                out.push_back(static_cast<char>(u));
+            } else if (u <= 0xff) {
+                out.push_back('\xcc');
+                putBigEndian(out, u, 1);
+            } else if (u <= 0xffff) {
+                out.push_back('\xcd');
+                putBigEndian(out, u, 2);
+            } else if (u <= 0xffffffff) {
+                out.push_back('\xce');
+                putBigEndian(out, u, 4);
+            } else {
+                out.push_back('\xcf');
+                putBigEndian(out, u, 8);
+            }
+        } else if (i >= -32) {
+            out.push_back(static_cast<char>(i));
+        } else if (i >= std::numeric_limits<int8_t>::min()) {
+            out.push_back('\xd0');
+            putBigEndian(out, static_cast<uint64_t>(i), 1);
+        } else if (i >= std::numeric_limits<int16_t>::min()) {
+            out.push_back('\xd1');
+            putBigEndian(out, static_cast<uint64_t>(i), 2);
+        } else if (i >= std::numeric_limits<int32_t>::min()) {
+            out.push_back('\xd2');
+            putBigEndian(out, static_cast<uint64_t>(i), 4);
+        } else {
+            out.push_back('\xd3');
+            putBigEndian(out, static_cast<uint64_t>(i), 8);
+        }
+    }
+
+    static void encodeString(const string &s, string &out) {
+        const auto n = s.size();
+        if (n < 32) {
+            out.push_back(static_cast<char>(0xa0 | n));
+        } else if (n <= 0xff) {
+            out.push_back('\xd9');
+            putBigEndian(out, n, 1);
+        } else if (n <= 0xffff) {
+            out.push_back('\xda');
+            putBigEndian(out, n, 2);
+        } else {
+            out.push_back('\xdb');
+            putBigEndian(out, n, 4);
+        }
+        out += s;
+    }
+
+    static void encodeLength(size_t n, uint8_t fixPrefix, size_t fixLimit, char prefix16, char prefix32, string &out) {
+        if (n < fixLimit) {
+            out.push_back(static_cast<char>(fixPrefix | n));
+        } else if (n <= 0xffff) {
+            out.push_back(prefix16);
+            putBigEndian(out, n, 2);
+        } else {
+            out.push_back(prefix32);
+            putBigEndian(out, n, 4);
+        }
+    }
+
+    static int64_t signExtend(uint64_t v, int bytes) {
+        const int shift = 64 - bytes * 8;
+        return static_cast<int64_t>(v << shift) >> shift;
+    }
+
+    static Json decodeValue(Reader &r, int depth) {
+        if (depth > maxDepth) {
+            r.fail("MessagePack value nested too deep");
+            return Json();
+        }
+
+        const uint8_t b = r.byte();
+        if (r.failed()) {
+            return Json();
+        }
+
+        if (b < 0x80) {
+            return Json(static_cast<int>(b));
+        }
+        if (b >= 0xe0) {
+            return Json(static_cast<int>(static_cast<int8_t>(b)));
+        }
+        if ((b & 0xe0) == 0xa0) {
+            return Json(r.bytes(b & 0x1f));
+        }
+        if ((b & 0xf0) == 0x90) {
+            return decodeArray(r, b & 0x0f, depth);
+        }
+        if ((b & 0xf0) == 0x80) {
+            return decodeMap(r, b & 0x0f, depth);
+        }
+
+        switch (b) {
+        case 0xc0: return Json();
+        case 0xc2: return Json(false);
+        case 0xc3: return Json(true);
+        case 0xc4: return Json(r.bytes(r.bigEndian(1)));
+        case 0xc5: return Json(r.bytes(r.bigEndian(2)));
+        case 0xc6: return Json(r.bytes(r.bigEndian(4)));
+        case 0xca: return Json(static_cast<double>(bitsFloat(static_cast<uint32_t>(r.bigEndian(4)))));
+        case 0xcb: return Json(bitsDouble(r.bigEndian(8)));
+        case 0xcc: return Json(static_cast<double>(r.bigEndian(1)));
+        case 0xcd: return Json(static_cast<double>(r.bigEndian(2)));
+        case 0xce: return Json(static_cast<double>(r.bigEndian(4)));
+        case 0xcf: return Json(static_cast<double>(r.bigEndian(8)));
+        case 0xd0: return Json(static_cast<double>(signExtend(r.bigEndian(1), 1)));
+        case 0xd1: return Json(static_cast<double>(signExtend(r.bigEndian(2), 2)));
+        case 0xd2: return Json(static_cast<double>(signExtend(r.bigEndian(4), 4)));
+        case 0xd3: return Json(static_cast<double>(signExtend(r.bigEndian(8), 8)));
+        case 0xd9: return Json(r.bytes(r.bigEndian(1)));
+        case 0xda: return Json(r.bytes(r.bigEndian(2)));
+        case 0xdb: return Json(r.bytes(r.bigEndian(4)));
+        case 0xdc: return decodeArray(r, r.bigEndian(2), depth);
+        case 0xdd: return decodeArray(r, r.bigEndian(4), depth);
+        case 0xde: return decodeMap(r, r.bigEndian(2), depth);
+        case 0xdf: return decodeMap(r, r.bigEndian(4), depth);
+        default:
+            r.fail("unsupported MessagePack type " + to_string(b));
+            return Json();
+        }
+    }
+
+    static Json decodeArray(Reader &r, uint64_t n, int depth) {
+        if (r.failed() || !r.plausibleCount(n)) {
+            return Json();
+        }
+        Json::array items;
+        items.reserve(static_cast<size_t>(n));
+        for (uint64_t i = 0; i < n && !r.failed(); i++) {
+            items.push_back(decodeValue(r, depth + 1));
+        }
+        return Json(std::move(items));
+    }
+
+    static Json decodeMap(Reader &r, uint64_t n, int depth) {
+        if (r.failed() || !r.plausibleCount(n)) {
+            return Json();
+        }
+        Json::object items;
+        for (uint64_t i = 0; i < n && !r.failed(); i++) {
+            Json key = decodeValue(r, depth + 1);
+            if (!key.is_string()) {
+                r.fail("MessagePack map key is not a string");
+                break;
+            }
+            items[key.string_value()] = decodeValue(r, depth + 1);
+        }
+        return Json(std::move(items));
+    }
+};
+
+// https://tools.ietf.org/html/rfc7049
+class CborCodec final : public Codec {
+public:
+    const string &contentType() const override {
+        static const string type = "application/cbor";
+        return type;
+    }
+
+    void encode(const Json &json, string &out) const override {
+        encodeValue(json, out, 0);
+    }
+
+    Json decode(const char *data, uint64_t len, string &err) const override {
+        Reader r(data, len, err);
+        Json json = decodeValue(r, 0);
+        if (!r.failed() && !r.atEnd()) {
+            r.fail("trailing data after CBOR value");
+        }
+        return r.failed() ? Json() : json;
+    }
+
+private:
+    enum Major : uint8_t {
+        Unsigned = 0,
+        Negative = 1,
+        Bytes = 2,
+        Text = 3,
+        Array = 4,
+        Map = 5,
+        Tag = 6,
+        Simple = 7,
+    };
+
+    static const uint8_t indefinite = 31;
+    static const uint8_t breakByte = 0xff;
+
+    static void encodeHead(Major major, uint64_t v, string &out) {
+        const auto m = static_cast<uint8_t>(major << 5);
+        if (v < 24) {
+            out.push_back(static_cast<char>(m | v));
+        } else if (v <= 0xff) {
+            out.push_back(static_cast<char>(m | 24));
+            putBigEndian(out, v, 1);
+        } else if (v <= 0xffff) {
+            out.push_back(static_cast<char>(m | 25));
+            putBigEndian(out, v, 2);
+        } else if (v <= 0xffffffff) {
+            out.push_back(static_cast<char>(m | 26));
+            putBigEndian(out, v, 4);
+        } else {
+            out.push_back(static_cast<char>(m | 27));
+            putBigEndian(out, v, 8);
+        }
+    }
+
+    static void encodeValue(const Json &json, string &out, int depth) {
+        if (depth > maxDepth) {
+            throw domain_error("Value nested too deep for CBOR encoding");
+        }
+
+        switch (json.type()) {
+        case Json::NUL:
+            out.push_back('\xf6');
+            break;
+        case Json::BOOL:
+            out.push_back(json.bool_value() ? '\xf5' : '\xf4');
+            break;
+        case Json::NUMBER: {
+            const double d = json.number_value();
+            if (!isInteger(d)) {
+                out.push_back('\xfb');
+                putBigEndian(out, doubleBits(d), 8);
+            } else if (d >= 0) {
+                encodeHead(Unsigned, static_cast<uint64_t>(d), out);
+            } else {
+                encodeHead(Negative, static_cast<uint64_t>(-1 - static_cast<int64_t>(d)), out);
+            }
+            break;
+        }
+        case Json::STRING:
+            encodeHead(Text, json.string_value().size(), out);
+            out += json.string_value();
+            break;
+        case Json::ARRAY:
+            encodeHead(Array, json.array_items().size(), out);
+            for (const auto &item : json.array_items()) {
+                encodeValue(item, out, depth + 1);
+            }
+            break;
+        case Json::OBJECT:
+            encodeHead(Map, json.object_items().size(), out);
+            for (const auto &item : json.object_items()) {
+                encodeHead(Text, item.first.size(), out);
+                out += item.first;
+                encodeValue(item.second, out, depth + 1);
+            }
+            break;
+        }
+    }
+
+    static double halfToDouble(uint16_t half) {
+        const int exp = (half >> 10) & 0x1f;
+        const int mant = half & 0x3ff;
+        double val;
+        if (exp == 0) {
+            val = std::ldexp(mant, -24);
+        } else if (exp != 31) {
+            val = std::ldexp(mant + 1024, exp - 25);
+        } else {
+            val = mant == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+        }
+        return half & 0x8000 ? -val : val;
+    }
+
+    static Json decodeValue(Reader &r, int depth) {
+        if (depth > maxDepth) {
+            r.fail("CBOR value nested too deep");
+            return Json();
+        }
+
+        const uint8_t initial = r.byte();
+        if (r.failed()) {
+            return Json();
+        }
+        const auto major = static_cast<Major>(initial >> 5);
+        const uint8_t info = initial & 0x1f;
+
+        if (major == Simple) {
+            switch (info) {
+            case 20: return Json(false);
+            case 21: return Json(true);
+            case 22: return Json();
+            case 23: return Json();
+            case 25: return Json(halfToDouble(static_cast<uint16_t>(r.bigEndian(2))));
+            case 26: return Json(static_cast<double>(bitsFloat(static_cast<uint32_t>(r.bigEndian(4)))));
+            case 27: return Json(bitsDouble(r.bigEndian(8)));
+            default:
+                r.fail("unsupported CBOR simple value " + to_string(info));
+                return Json();
+            }
+        }
+
+        if (info == indefinite) {
+            switch (major) {
+            case Bytes:
+            case Text:
+                return decodeIndefiniteString(r, major);
+            case Array:
+                return decodeArray(r, 0, true, depth);
+            case Map:
+                return decodeMap(r, 0, true, depth);
+            default:
+                r.fail("invalid indefinite length CBOR item");
+                return Json();
+            }
+        }
+
+        const uint64_t v = argument(r, info);
+        if (r.failed()) {
+            return Json();
+        }
+
+        switch (major) {
+        case Unsigned:
+            return Json(static_cast<double>(v));
+        case Negative:
+            return Json(-1.0 - static_cast<double>(v));
+        case Bytes:
+        case Text:
+            return Json(r.bytes(v));
+        case Array:
+            return decodeArray(r, v, false, depth);
+        case Map:
+            return decodeMap(r, v, false, depth);
+        case Tag:
+            // Tags carry semantics JSON has no room for, use the tagged value as is
+            return decodeValue(r, depth + 1);
+        default:
+            return Json();
+        }
+    }
+
+    static uint64_t argument(Reader &r, uint8_t info) {
+        if (info < 24) {
+            return info;
+        }
+        switch (info) {
+        case 24: return r.bigEndian(1);
+        case 25: return r.bigEndian(2);
+        case 26: return r.bigEndian(4);
+        case 27: return r.bigEndian(8);
+        default:
+            r.fail("invalid CBOR length " + to_string(info));
+            return 0;
+        }
+    }
+
+    static bool atBreak(Reader &r) {
+        if (r.peek() == breakByte && !r.failed()) {
+            r.byte();
+            return true;
+        }
+        return false;
+    }
+
+    static Json decodeIndefiniteString(Reader &r, Major major) {
+        string s;
+        while (!r.failed() && !atBreak(r)) {
+            const uint8_t initial = r.byte();
+            if ((initial >> 5) != major || (initial & 0x1f) == indefinite) {
+                r.fail("invalid chunk in indefinite length CBOR string");
+                break;
+            }
+            s += r.bytes(argument(r, initial & 0x1f));
+        }
+        return Json(std::move(s));
+    }
+
+    static Json decodeArray(Reader &r, uint64_t n, bool indefinite, int depth) {
+        if (!indefinite && !r.plausibleCount(n)) {
+            return Json();
+        }
+        Json::array items;
+        if (!indefinite) {
+            items.reserve(static_cast<size_t>(n));
+        }
+        for (uint64_t i = 0; !r.failed() && (indefinite ? !atBreak(r) : i < n); i++) {
+            items.push_back(decodeValue(r, depth + 1));
+        }
+        return Json(std::move(items));
+    }
+
+    static Json decodeMap(Reader &r, uint64_t n, bool indefinite, int depth) {
+        if (!indefinite && !r.plausibleCount(n)) {
+            return Json();
+        }
+        Json::object items;
+        for (uint64_t i = 0; !r.failed() && (indefinite ? !atBreak(r) : i < n); i++) {
+            Json key = decodeValue(r, depth + 1);
+            if (!key.is_string()) {
+                r.fail("CBOR map key is not a string");
+                break;
+            }
+            items[key.string_value()] = decodeValue(r, depth + 1);
+        }
+        return Json(std::move(items));
+    }
+};
+
+const JsonCodec json;
+const RawCodec raw;
+const MsgPackCodec msgpack;
+const CborCodec cbor;
+
+} // namespace
+
+const Codec *findCodec(const std::string &contentType) {
+    if (contentType.empty() || contentType == "json" || contentType == json.contentType()) {
+        return &json;
+    }
+    if (contentType == "msgpack" || contentType == msgpack.contentType() || contentType == "application/x-msgpack") {
+        return &msgpack;
+    }
+    if (contentType == "cbor" || contentType == cbor.contentType()) {
+        return &cbor;
+    }
+    if (contentType == "raw" || contentType == raw.contentType()) {
+        return &raw;
+    }
+    return nullptr;
+}
+
+const Codec &jsonCodec() {
+    return json;
+}
+
+} // namespace msgflo
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "json11.hpp"
+
+namespace msgflo {
+
+// Converts between json11::Json and the bytes sent on a port
+class Codec {
+public:
+    virtual ~Codec() = default;
+
+    virtual const std::string &contentType() const = 0;
+
+    // Appends the encoding of json to out
+    virtual void encode(const json11::Json &json, std::string &out) const = 0;
+
+    // Sets err and returns null if the data is not valid
+    virtual json11::Json decode(const char *data, uint64_t len, std::string &err) const = 0;
+};
+
+// The codec for a content type or one of the short names "json", "msgpack",
+// "cbor" and "raw". An empty content type is JSON. Returns nullptr if unknown.
+const Codec *findCodec(const std::string &contentType);
+
+const Codec &jsonCodec();
+
+} // namespace msgflo
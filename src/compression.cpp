@@ -0,0 +1,305 @@
+#include "compression.h"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef MSGFLO_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef MSGFLO_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace msgflo {
+
+namespace {
+
+// The header in front of a compressed payload, 24 bytes in network byte order:
+//
+//   0  magic "\0mfc"
+//   4  algorithm
+//   5  reserved, 0
+//   8  dictionary id, 0 for none
+//  12  reserved, 0
+//  16  size before compression
+//
+// The leading NUL keeps it from being mistaken for JSON or text payloads.
+const size_t headerSize = 24;
+const uint8_t lz4Algorithm = 1;
+const uint8_t zstdAlgorithm = 2;
+
+void put(char *out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = static_cast<char>(v & 0xff);
+        v >>= 8;
+    }
+}
+
+uint64_t get(const char *in, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v = (v << 8) | static_cast<uint8_t>(in[i]);
+    }
+    return v;
+}
+
+#ifdef MSGFLO_WITH_LZ4
+class Lz4Compressor : public Compressor {
+public:
+    explicit Lz4Compressor(int acceleration)
+        : Compressor(lz4Algorithm, 0)
+        , acceleration(acceleration > 0 ? acceleration : 1)
+    {}
+
+protected:
+    size_t bound(size_t len) const override {
+        return len > LZ4_MAX_INPUT_SIZE ? 0 : static_cast<size_t>(LZ4_compressBound(static_cast<int>(len)));
+    }
+
+    size_t compressInto(const char *data, size_t len, char *out, size_t capacity) const override {
+        const int n = LZ4_compress_fast(data, out, static_cast<int>(len), static_cast<int>(capacity), acceleration);
+        return n > 0 ? static_cast<size_t>(n) : 0;
+    }
+
+private:
+    const int acceleration;
+};
+#endif
+
+#ifdef MSGFLO_WITH_ZSTD
+// zstd's contexts keep their memory between uses, one per thread and direction
+ZSTD_CCtx *compressContext() {
+    static thread_local unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    return ctx.get();
+}
+
+ZSTD_DCtx *decompressContext() {
+    static thread_local unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    return ctx.get();
+}
+
+// zstd's own id for a trained dictionary, a hash of the contents for others
+uint32_t dictionaryId(const string &dictionary) {
+    const unsigned id = ZSTD_getDictID_fromDict(dictionary.data(), dictionary.size());
+    if (id != 0) {
+        return id;
+    }
+    uint32_t h = 2166136261u;
+    for (char c : dictionary) {
+        h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return h != 0 ? h : 1;
+}
+
+// Dictionaries of the ports registered in the process, by id
+struct Dictionaries {
+    mutex lock;
+    map<uint32_t, shared_ptr<ZSTD_DDict>> byId;
+
+    static Dictionaries &instance() {
+        static Dictionaries *d = new Dictionaries();
+        return *d;
+    }
+
+    void add(const string &dictionary) {
+        const uint32_t id = dictionaryId(dictionary);
+        lock_guard<mutex> l(lock);
+        if (byId.count(id) == 0) {
+            byId[id] = shared_ptr<ZSTD_DDict>(ZSTD_createDDict(dictionary.data(), dictionary.size()), ZSTD_freeDDict);
+        }
+    }
+
+    shared_ptr<ZSTD_DDict> find(uint32_t id) {
+        lock_guard<mutex> l(lock);
+        auto d = byId.find(id);
+        return d == byId.end() ? nullptr : d->second;
+    }
+};
+
+class ZstdCompressor : public Compressor {
+public:
+    ZstdCompressor(int level, const string &dictionary)
+        : Compressor(zstdAlgorithm, dictionary.empty() ? 0 : dictionaryId(dictionary))
+        , level(level > 0 ? level : ZSTD_CLEVEL_DEFAULT)
+        , cdict(dictionary.empty() ? nullptr : ZSTD_createCDict(dictionary.data(), dictionary.size(), this->level),
+                ZSTD_freeCDict)
+    {}
+
+protected:
+    size_t bound(size_t len) const override {
+        return ZSTD_compressBound(len);
+    }
+
+    size_t compressInto(const char *data, size_t len, char *out, size_t capacity) const override {
+        const size_t n = cdict ? ZSTD_compress_usingCDict(compressContext(), out, capacity, data, len, cdict.get())
+                               : ZSTD_compressCCtx(compressContext(), out, capacity, data, len, level);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+
+private:
+    const int level;
+    const unique_ptr<ZSTD_CDict, size_t (*)(ZSTD_CDict *)> cdict;
+};
+#endif
+
+} // namespace
+
+bool Compressor::compress(const char *data, uint64_t len, string &out) const {
+    const size_t capacity = bound(static_cast<size_t>(len));
+    if (capacity == 0) {
+        return false;
+    }
+    out.resize(headerSize + capacity);
+    char *header = &out[0];
+    memset(header, 0, headerSize);
+    memcpy(header, "\0mfc", 4);
+    header[4] = static_cast<char>(algorithm);
+    put(header + 8, dictionary, 4);
+    put(header + 16, len, 8);
+
+    const size_t n = compressInto(data, static_cast<size_t>(len), header + headerSize, capacity);
+    if (n == 0 || headerSize + n >= len) {
+        return false;
+    }
+    out.resize(headerSize + n);
+    return true;
+}
+
+shared_ptr<const Compressor> makeCompressor(const Definition::Port &port) {
+    if (port.compression.empty() || port.compression == "none") {
+        return nullptr;
+    }
+#ifdef MSGFLO_WITH_LZ4
+    if (port.compression == "lz4") {
+        return make_shared<Lz4Compressor>(port.compressionLevel);
+    }
+#endif
+#ifdef MSGFLO_WITH_ZSTD
+    if (port.compression == "zstd") {
+        registerDictionary(port);
+        return make_shared<ZstdCompressor>(port.compressionLevel, port.compressionDictionary);
+    }
+#endif
+    throw invalid_argument("Compression " + port.compression + " of port " + port.id + " is not available");
+}
+
+void registerDictionary(const Definition::Port &port) {
+#ifdef MSGFLO_WITH_ZSTD
+    if (!port.compressionDictionary.empty()) {
+        Dictionaries::instance().add(port.compressionDictionary);
+    }
+#endif
+}
+
+bool expectsCompressed(const Definition::Port &port) {
+    return !port.compression.empty() && port.compression != "none";
+}
+
+void checkDecompression(const Definition::Port &port) {
+    if (expectsCompressed(port) && !compressionAvailable(port.compression)) {
+        throw invalid_argument("Compression " + port.compression + " of port " + port.id + " is not available");
+    }
+}
+
+bool isCompressed(const char *data, uint64_t len) {
+    return len >= headerSize && data[0] == '\0' && data[1] == 'm' && data[2] == 'f' && data[3] == 'c';
+}
+
+uint64_t decompressedSize(const char *data, uint64_t len, uint64_t maxSize, const char *&refused) {
+    refused = nullptr;
+    if (!isCompressed(data, len)) {
+        refused = "not compressed";
+        return 0;
+    }
+    const uint64_t size = get(data + 16, 8);
+    if (size == 0 || size > maxSize) {
+        refused = "size empty or over the limit, see EngineConfig::maxDecompressedSize()";
+        return 0;
+    }
+#if defined(MSGFLO_WITH_LZ4) || defined(MSGFLO_WITH_ZSTD)
+    const uint8_t algorithm = static_cast<uint8_t>(data[4]);
+    const uint64_t inLen = len - headerSize;
+#endif
+#ifdef MSGFLO_WITH_LZ4
+    if (algorithm == lz4Algorithm) {
+        // An lz4 match expands by at most 255 bytes per input byte
+        if (size / 255 > inLen) {
+            refused = "size more than lz4 can expand the payload to";
+            return 0;
+        }
+        return size;
+    }
+#endif
+#ifdef MSGFLO_WITH_ZSTD
+    if (algorithm == zstdAlgorithm) {
+        // The frame records its size too, and zstd checks the data against it
+        if (ZSTD_getFrameContentSize(data + headerSize, inLen) != size) {
+            refused = "size differs from the zstd frame's";
+            return 0;
+        }
+        return size;
+    }
+#endif
+    refused = "compressed with an unknown or unavailable algorithm";
+    return 0;
+}
+
+void decompress(const char *data, uint64_t len, char *out, uint64_t size) {
+    if (!isCompressed(data, len)) {
+        throw domain_error("Payload is not compressed");
+    }
+    const uint8_t algorithm = static_cast<uint8_t>(data[4]);
+#if defined(MSGFLO_WITH_LZ4) || defined(MSGFLO_WITH_ZSTD)
+    const char *in = data + headerSize;
+    const uint64_t inLen = len - headerSize;
+#endif
+#ifdef MSGFLO_WITH_LZ4
+    if (algorithm == lz4Algorithm) {
+        if (size <= LZ4_MAX_INPUT_SIZE && inLen <= LZ4_MAX_INPUT_SIZE &&
+                LZ4_decompress_safe(in, out, static_cast<int>(inLen), static_cast<int>(size)) == static_cast<int>(size)) {
+            return;
+        }
+        throw domain_error("Could not decompress lz4 payload");
+    }
+#endif
+#ifdef MSGFLO_WITH_ZSTD
+    if (algorithm == zstdAlgorithm) {
+        const uint32_t id = static_cast<uint32_t>(get(data + 8, 4));
+        size_t n;
+        if (id == 0) {
+            n = ZSTD_decompressDCtx(decompressContext(), out, size, in, inLen);
+        } else {
+            auto dictionary = Dictionaries::instance().find(id);
+            if (!dictionary) {
+                throw domain_error("No zstd dictionary " + to_string(id) + " for payload, see Definition::Port::compressionDictionary");
+            }
+            n = ZSTD_decompress_usingDDict(decompressContext(), out, size, in, inLen, dictionary.get());
+        }
+        if (ZSTD_isError(n) || n != size) {
+            throw domain_error(string("Could not decompress zstd payload: ") + (ZSTD_isError(n) ? ZSTD_getErrorName(n) : "wrong size"));
+        }
+        return;
+    }
+#endif
+    throw domain_error("Payload compressed with unknown or unavailable algorithm " + to_string(algorithm));
+}
+
+bool compressionAvailable(const string &algorithm) {
+#ifdef MSGFLO_WITH_LZ4
+    if (algorithm == "lz4") {
+        return true;
+    }
+#endif
+#ifdef MSGFLO_WITH_ZSTD
+    if (algorithm == "zstd") {
+        return true;
+    }
+#endif
+    return false;
+}
+
+} // namespace msgflo
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "msgflo.h"
+
+namespace msgflo {
+
+// Compresses the payloads sent on an outport, see Definition::Port::compression.
+// Safe to use from any thread.
+class Compressor {
+public:
+    virtual ~Compressor() = default;
+
+    // Puts the payload, compressed and behind the header receivers recognize
+    // it by, into `out`. Returns false if that would not be smaller.
+    bool compress(const char *data, uint64_t len, std::string &out) const;
+
+protected:
+    Compressor(uint8_t algorithm, uint32_t dictionary)
+        : algorithm(algorithm)
+        , dictionary(dictionary)
+    {}
+
+    virtual size_t bound(size_t len) const = 0;
+
+    // Returns the compressed size, 0 if it failed
+    virtual size_t compressInto(const char *data, size_t len, char *out, size_t capacity) const = 0;
+
+private:
+    const uint8_t algorithm;
+    const uint32_t dictionary;
+};
+
+// The compressor for an outport, nullptr if it is not compressed. Throws
+// std::invalid_argument for an algorithm that is unknown or not built in.
+std::shared_ptr<const Compressor> makeCompressor(const Definition::Port &port);
+
+// Makes the port's zstd dictionary, if any, known to decompress()
+void registerDictionary(const Definition::Port &port);
+
+// Whether an inport decompresses payloads that were not marked as compressed
+bool expectsCompressed(const Definition::Port &port);
+
+// Throws std::invalid_argument for an inport expecting payloads compressed
+// with an algorithm that is unknown or not built in
+void checkDecompression(const Definition::Port &port);
+
+// Whether the payload starts with the header of a Compressor. An uncompressed
+// payload can too, so only trust it for messages known to be compressed.
+bool isCompressed(const char *data, uint64_t len);
+
+// The size a compressed payload had before, or 0 to leave it compressed, with
+// `refused` set to why: the size is over `maxSize`, more than the algorithm
+// can make of `len` bytes, or the algorithm is unknown or not built in.
+uint64_t decompressedSize(const char *data, uint64_t len, uint64_t maxSize, const char *&refused);
+
+// Fills `out` with the `size` bytes the payload was compressed from.
+// Throws std::domain_error if that fails.
+void decompress(const char *data, uint64_t len, char *out, uint64_t size);
+
+// Whether the library was built with "lz4" or "zstd"
+bool compressionAvailable(const std::string &algorithm);
+
+} // namespace msgflo
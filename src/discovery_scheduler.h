@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace msgflo {
+
+// Decides when each participant's discovery message is sent. Instead of
+// sending every participant at once each period, a participant is resent
+// `period` after its previous send, give or take `jitter` of the period, so
+// the sends of a process drift apart and spread over the period. A token
+// bucket caps the sends at `rate` per second with bursts of up to `burst`,
+// which bounds the load on the fbp queue however many participants there
+// are; when the participants need more than the rate, every period gets
+// longer instead.
+//
+// Times are in seconds, as from ev_now(). Only used from the loop thread.
+class DiscoveryScheduler {
+public:
+    DiscoveryScheduler(double period, double rate, size_t burst, double jitter, unsigned seed = std::random_device()())
+        : period(period > 0 ? period : 1)
+        , rate(rate)
+        , burst(static_cast<double>(std::max<size_t>(burst, 1)))
+        , jitter(std::min(std::max(jitter, 0.0), 1.0))
+        , tokens(this->burst)
+        , refilled(0)
+        , random(seed)
+    {}
+
+    // Schedules the first send of a participant within the startup spread
+    void add(size_t id, double now) {
+        const uint64_t generation = ++lastGeneration;
+        generations[id] = generation;
+        queue.push(Entry{now + startupDelay(), id, generation});
+    }
+
+    // Pending sends of the participant are dropped
+    void remove(size_t id) {
+        generations.erase(id);
+    }
+
+    size_t size() const {
+        return generations.size();
+    }
+
+    // Schedules every participant's next send within the startup spread, as after (re)connecting
+    void restart(double now) {
+        queue = Queue();
+        for (auto &g : generations) {
+            g.second = ++lastGeneration;
+            queue.push(Entry{now + startupDelay(), g.first, g.second});
+        }
+    }
+
+    // Calls send(id) for the participants that are due, as far as the token
+    // budget allows. Returns the seconds until it should be called again, or
+    // a negative number when nothing is scheduled.
+    template<typename F>
+    double run(double now, F send) {
+        refill(now);
+        while (!queue.empty()) {
+            const Entry e = queue.top();
+            if (!current(e)) {
+                queue.pop();
+                continue;
+            }
+            if (e.due > now) {
+                return e.due - now;
+            }
+            if (rate > 0 && tokens < 1) {
+                return (1 - tokens) / rate;
+            }
+            queue.pop();
+            tokens -= 1;
+            queue.push(Entry{now + nextDelay(), e.id, e.generation});
+            send(e.id);
+        }
+        return -1;
+    }
+
+private:
+    struct Entry {
+        double due;
+        size_t id;
+        uint64_t generation;
+
+        bool operator>(const Entry &other) const {
+            return due > other.due;
+        }
+    };
+    using Queue = std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>>;
+
+    bool current(const Entry &e) const {
+        auto it = generations.find(e.id);
+        return it != generations.end() && it->second == e.generation;
+    }
+
+    void refill(double now) {
+        if (rate > 0 && now > refilled) {
+            tokens = std::min(burst, tokens + (now - refilled) * rate);
+        }
+        refilled = std::max(refilled, now);
+    }
+
+    // Processes started together do not send their first messages together
+    double startupDelay() {
+        return std::uniform_real_distribution<double>(0, jitter * period)(random);
+    }
+
+    double nextDelay() {
+        return period * std::uniform_real_distribution<double>(1 - jitter, 1 + jitter)(random);
+    }
+
+    const double period;
+    const double rate;
+    const double burst;
+    const double jitter;
+    double tokens;
+    double refilled;
+    std::mt19937 random;
+    Queue queue;
+    // Replaced on add() and restart() and dropped on remove(), so the entries queued before are skipped
+    std::unordered_map<size_t, uint64_t> generations;
+    uint64_t lastGeneration = 0;
+};
+
+} // namespace msgflo
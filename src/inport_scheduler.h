@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mpmc_ring.h"
+
+namespace msgflo {
+
+// Where a delivery waits in an InportScheduler: a queue per inport, with the
+// inport's Definition::Port::priority and weight
+struct InportShare {
+    const void *port;
+    int priority;
+    int weight;
+    // Payload bytes
+    uint64_t cost;
+};
+
+// Deliveries waiting for their handlers, one FIFO queue per inport, taken in
+// deficit round-robin order (Shreedhar and Varghese): each round, a port may
+// take up to `quantum` times its weight in payload bytes, and what it does
+// not use carries over while it has deliveries waiting. Ports of a higher
+// priority go first, so a flood on them starves those below. Not thread safe.
+template<typename T>
+class InportScheduler {
+public:
+    // Bytes a port of weight 1 may take per round
+    static const uint64_t quantum = 4096;
+    // Counted for every delivery on top of its payload, so small ones are not free
+    static const uint64_t overhead = 64;
+
+    InportScheduler() = default;
+    InportScheduler(const InportScheduler &) = delete;
+    InportScheduler &operator=(const InportScheduler &) = delete;
+
+    void push(const InportShare &share, T &&item) {
+        Flow &flow = flows[share.port];
+        if (flow.items.empty()) {
+            // Idle ports start the next round with nothing saved up
+            flow.port = share.port;
+            flow.quantum = quantum * static_cast<uint64_t>(std::max(share.weight, 1));
+            flow.deficit = 0;
+            flow.credited = false;
+            levels[share.priority].push_back(&flow);
+        }
+        flow.items.push_back(Item{std::move(item), share.cost + overhead});
+        waiting++;
+    }
+
+    // Returns false if nothing is waiting
+    bool pop(T &item) {
+        while (!levels.empty()) {
+            const auto level = levels.begin();
+            std::deque<Flow *> &active = level->second;
+            if (active.empty()) {
+                levels.erase(level);
+                continue;
+            }
+            Flow &flow = *active.front();
+            Item &head = flow.items.front();
+            if (flow.deficit >= head.cost) {
+                flow.deficit -= head.cost;
+                item = std::move(head.item);
+                flow.items.pop_front();
+                waiting--;
+                if (flow.items.empty()) {
+                    // Nothing carries over for an idle port, and it may have been unregistered
+                    active.pop_front();
+                    flows.erase(flow.port);
+                }
+                return true;
+            }
+            if (flow.credited) {
+                // Used up its share of this round
+                flow.credited = false;
+                active.pop_front();
+                active.push_back(&flow);
+            } else {
+                flow.deficit += flow.quantum;
+                flow.credited = true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() const {
+        return waiting;
+    }
+
+    bool empty() const {
+        return waiting == 0;
+    }
+
+    // Ports with deliveries waiting
+    size_t ports() const {
+        return flows.size();
+    }
+
+private:
+    struct Item {
+        T item;
+        uint64_t cost;
+    };
+
+    struct Flow {
+        const void *port = nullptr;
+        std::deque<Item> items;
+        uint64_t quantum = 0;
+        uint64_t deficit = 0;
+        // Got its quantum for the current visit
+        bool credited = false;
+    };
+
+    // Ports with deliveries waiting, elements of an unordered_map do not move
+    std::unordered_map<const void *, Flow> flows;
+    // Ports with deliveries waiting, by priority, highest first
+    std::map<int, std::deque<Flow *>, std::greater<int>> levels;
+    size_t waiting = 0;
+};
+
+// Threads taking items in the order of an InportScheduler and passing them
+// to a function. Used by the engines instead of RingWorkers with
+// EngineConfig::fairScheduling().
+template<typename T>
+class ScheduledWorkers final : public Workers<T> {
+public:
+    using Consumer = std::function<void (T &)>;
+    using Share = std::function<InportShare (const T &)>;
+
+    ScheduledWorkers(size_t capacity, size_t threads, Share share, Consumer consumer)
+        : capacity(std::max<size_t>(capacity, 1))
+        , share(std::move(share))
+        , consumer(std::move(consumer))
+    {
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~ScheduledWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    ScheduledWorkers(const ScheduledWorkers &) = delete;
+    ScheduledWorkers &operator=(const ScheduledWorkers &) = delete;
+
+    void push(T &&item) override {
+        const InportShare s = share(item);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            room.wait(lock, [this]() { return scheduler.size() < capacity; });
+            scheduler.push(s, std::move(item));
+        }
+        ready.notify_one();
+    }
+
+    bool tryPush(T &&item) override {
+        const InportShare s = share(item);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (scheduler.size() >= capacity) {
+                refused = true;
+                return false;
+            }
+            scheduler.push(s, std::move(item));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    size_t size() const override {
+        return workers.size();
+    }
+
+private:
+    void run() {
+        T item;
+        while (true) {
+            bool wasRefused;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stopping || !scheduler.empty(); });
+                if (!scheduler.pop(item)) {
+                    return;
+                }
+                wasRefused = refused;
+                refused = false;
+            }
+            room.notify_one();
+            if (wasRefused) {
+                this->notifyRoom();
+            }
+
+            try {
+                consumer(item);
+            } catch (std::exception &e) {
+                std::cerr << "Exception in message handler: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    const size_t capacity;
+    const Share share;
+    const Consumer consumer;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable room;
+    InportScheduler<T> scheduler;
+    // A tryPush() found the scheduler full
+    bool refused = false;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+} // namespace msgflo
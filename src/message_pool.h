@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include "msgflo.h"
+#include "object_pool.h"
+
+namespace msgflo {
+
+// Statistics of a BlockPool, such as the one of a PoolAllocated message type
+inline PoolStats blockPoolStats(const BlockPool &pool) {
+    const BlockPool::Counters c = pool.counters();
+    PoolStats s;
+    s.allocations = c.allocations;
+    s.hits = c.hits;
+    s.bytesInUse = c.inUse * pool.size();
+    s.peakBytes = c.peakInUse * pool.size();
+    s.reservedBytes = c.capacity * pool.size();
+    return s;
+}
+
+// Buffers for received payloads that outlive the client library's callback.
+// Sizes up to 64 KiB come from power of two size classes, each a BlockPool,
+// so once a few messages have been acked the next ones reuse their buffers.
+// Larger payloads go to the global allocator and count as misses.
+// Shared by the whole process and never destroyed, safe to use from any thread.
+class PayloadPool {
+public:
+    static const size_t minSize = 64;
+    static const int classes = 11;
+    // Blocks of a size class are made this many bytes at a time
+    static const size_t chunkBytes = 64 * 1024;
+
+    static PayloadPool &instance() {
+        static PayloadPool *pool = new PayloadPool();
+        return *pool;
+    }
+
+    // Returns the size class the buffer was taken from, -1 for the global allocator
+    char *allocate(size_t size, int &sizeClass) {
+        sizeClass = classFor(size);
+        char *p;
+        size_t bytes;
+        if (sizeClass < 0) {
+            oversized.fetch_add(1, std::memory_order_relaxed);
+            p = static_cast<char *>(::operator new(size));
+            bytes = size;
+        } else {
+            p = static_cast<char *>(pools[sizeClass]->allocate());
+            bytes = pools[sizeClass]->size();
+        }
+        const uint64_t now = inUse.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        uint64_t seen = peak.load(std::memory_order_relaxed);
+        while (now > seen && !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {
+        }
+        return p;
+    }
+
+    void deallocate(char *p, size_t size, int sizeClass) {
+        if (sizeClass < 0) {
+            ::operator delete(p);
+            inUse.fetch_sub(size, std::memory_order_relaxed);
+            return;
+        }
+        pools[sizeClass]->deallocate(p);
+        inUse.fetch_sub(pools[sizeClass]->size(), std::memory_order_relaxed);
+    }
+
+    PoolStats stats() const {
+        PoolStats s;
+        s.allocations = oversized.load(std::memory_order_relaxed);
+        for (const auto &pool : pools) {
+            const BlockPool::Counters c = pool->counters();
+            s.allocations += c.allocations;
+            s.hits += c.hits;
+            s.reservedBytes += c.capacity * pool->size();
+        }
+        s.bytesInUse = inUse.load(std::memory_order_relaxed);
+        s.peakBytes = peak.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    static int classFor(size_t size) {
+        size_t block = minSize;
+        for (int c = 0; c < classes; c++, block *= 2) {
+            if (size <= block) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+private:
+    PayloadPool() {
+        for (int c = 0; c < classes; c++) {
+            const size_t block = minSize << c;
+            pools[c].reset(new BlockPool(block, std::max<size_t>(chunkBytes / block, 1)));
+        }
+    }
+
+    std::unique_ptr<BlockPool> pools[classes];
+    std::atomic<uint64_t> oversized{0};
+    std::atomic<uint64_t> inUse{0};
+    std::atomic<uint64_t> peak{0};
+};
+
+// A copy of a payload in a PayloadPool buffer, given back when destroyed.
+// Moves like a std::string, but cannot be copied.
+class PayloadBuffer {
+public:
+    PayloadBuffer() = default;
+
+    PayloadBuffer(const char *data, size_t size)
+        : _size(size)
+    {
+        if (size == 0) {
+            return;
+        }
+        _data = PayloadPool::instance().allocate(size, sizeClass);
+        std::memcpy(_data, data, size);
+    }
+
+    // Uninitialized, to be filled through data()
+    explicit PayloadBuffer(size_t size)
+        : _size(size)
+    {
+        if (size > 0) {
+            _data = PayloadPool::instance().allocate(size, sizeClass);
+        }
+    }
+
+    PayloadBuffer(PayloadBuffer &&other) noexcept
+        : _data(other._data)
+        , _size(other._size)
+        , sizeClass(other.sizeClass)
+    {
+        other._data = nullptr;
+        other._size = 0;
+    }
+
+    PayloadBuffer &operator=(PayloadBuffer &&other) noexcept {
+        if (this != &other) {
+            release();
+            _data = other._data;
+            _size = other._size;
+            sizeClass = other.sizeClass;
+            other._data = nullptr;
+            other._size = 0;
+        }
+        return *this;
+    }
+
+    PayloadBuffer(const PayloadBuffer &) = delete;
+    PayloadBuffer &operator=(const PayloadBuffer &) = delete;
+
+    ~PayloadBuffer() {
+        release();
+    }
+
+    const char *data() const {
+        return _data;
+    }
+
+    char *data() {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+private:
+    void release() {
+        if (_data) {
+            PayloadPool::instance().deallocate(_data, _size, sizeClass);
+            _data = nullptr;
+        }
+        _size = 0;
+    }
+
+    char *_data = nullptr;
+    size_t _size = 0;
+    int sizeClass = -1;
+};
+
+} // namespace msgflo
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace msgflo {
+
+// Bounded multi-producer multi-consumer queue without locks, after Dmitry
+// Vyukov's design. Each slot has a sequence number saying whose turn it is, so
+// a push or pop is one compare-and-swap on the shared position and one write
+// of the slot. The capacity is rounded up to a power of two.
+template<typename T>
+class MpmcRing {
+public:
+    explicit MpmcRing(size_t capacity)
+        : mask(roundUp(capacity) - 1)
+        , slots(new Slot[mask + 1])
+    {
+        for (size_t i = 0; i <= mask; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueuePos.store(0, std::memory_order_relaxed);
+        dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    MpmcRing(const MpmcRing &) = delete;
+    MpmcRing &operator=(const MpmcRing &) = delete;
+
+    // Returns false, leaving value untouched, if the ring is full
+    bool tryPush(T &&value) {
+        Slot *slot;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            slot = &slots[pos & mask];
+            const size_t seq = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the ring is empty
+    bool tryPop(T &value) {
+        Slot *slot;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            slot = &slots[pos & mask];
+            const size_t seq = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(slot->value);
+        slot->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only a hint while other threads push and pop
+    bool empty() const {
+        const size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        return slots[pos & mask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t roundUp(size_t n) {
+        size_t c = 2;
+        while (c < n) {
+            c <<= 1;
+        }
+        return c;
+    }
+
+    // The positions are kept on cache lines of their own, producers and
+    // consumers would otherwise invalidate each other's line on every operation
+    static const size_t cacheLine = 64;
+
+    const size_t mask;
+    const std::unique_ptr<Slot[]> slots;
+    char pad0[cacheLine];
+    std::atomic<size_t> enqueuePos;
+    char pad1[cacheLine - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeuePos;
+    char pad2[cacheLine - sizeof(std::atomic<size_t>)];
+};
+
+// Handler threads passing the items given to them to a function, see
+// RingWorkers and ScheduledWorkers
+template<typename T>
+class Workers {
+public:
+    virtual ~Workers() = default;
+
+    // Waits while the workers are full, which pushes back on the producer.
+    // Not for the loop thread, see HandoffBacklog.
+    virtual void push(T &&item) = 0;
+
+    // Returns false, leaving the item as it was, while the workers are full.
+    // The function given to onRoom() is then called once there is room again.
+    virtual bool tryPush(T &&item) = 0;
+
+    virtual size_t size() const = 0;
+
+    // Called on a worker thread when it takes an item after a refused
+    // tryPush(). Set before pushing.
+    void onRoom(std::function<void ()> f) {
+        roomAvailable = std::move(f);
+    }
+
+protected:
+    void notifyRoom() {
+        if (roomAvailable) {
+            roomAvailable();
+        }
+    }
+
+private:
+    std::function<void ()> roomAvailable;
+};
+
+// Hands items to Workers from a thread that must not wait for them, such as
+// the loop thread: a handler waiting on the loop, for a send to go out, could
+// otherwise never make room. What does not fit waits here until drain() is
+// called after the workers' onRoom(). The producer is expected to stop taking
+// more in while backedUp(). Not thread safe.
+template<typename T>
+class HandoffBacklog {
+public:
+    explicit HandoffBacklog(Workers<T> &workers)
+        : workers(workers)
+    {}
+
+    void push(T &&item) {
+        if (items.empty() && workers.tryPush(std::move(item))) {
+            return;
+        }
+        items.push_back(std::move(item));
+    }
+
+    // Hands over what fits, in order. Returns whether everything went.
+    bool drain() {
+        while (!items.empty() && workers.tryPush(std::move(items.front()))) {
+            items.pop_front();
+        }
+        return items.empty();
+    }
+
+    bool backedUp() const {
+        return !items.empty();
+    }
+
+    // For freeing what is left when the producer goes away
+    std::deque<T> &waiting() {
+        return items;
+    }
+
+private:
+    Workers<T> &workers;
+    std::deque<T> items;
+};
+
+// Threads taking items off an MpmcRing and passing them to a function, in
+// the order they were pushed. They sleep while the ring is empty; a producer
+// only takes the mutex to wake one up when a consumer is actually asleep.
+template<typename T>
+class RingWorkers final : public Workers<T> {
+public:
+    using Consumer = std::function<void (T &)>;
+
+    RingWorkers(size_t capacity, size_t threads, Consumer consumer)
+        : ring(capacity)
+        , consumer(std::move(consumer))
+        , sleepers(0)
+        , stopping(false)
+    {
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~RingWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    RingWorkers(const RingWorkers &) = delete;
+    RingWorkers &operator=(const RingWorkers &) = delete;
+
+    void push(T &&item) override {
+        while (!ring.tryPush(std::move(item))) {
+            std::this_thread::yield();
+        }
+        wake();
+    }
+
+    bool tryPush(T &&item) override {
+        if (!ring.tryPush(std::move(item))) {
+            // Pairs with the fence in run(): either a consumer that made room
+            // meanwhile sees the flag, or the second try sees the room
+            refused.store(true, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ring.tryPush(std::move(item))) {
+                return false;
+            }
+        }
+        wake();
+        return true;
+    }
+
+    size_t size() const override {
+        return workers.size();
+    }
+
+private:
+    void run() {
+        T item;
+        while (true) {
+            if (!ring.tryPop(item)) {
+                sleepers.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                bool stop;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [this]() { return stopping || !ring.empty(); });
+                    stop = stopping;
+                }
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+                if (stop && ring.empty()) {
+                    return;
+                }
+                continue;
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (refused.load(std::memory_order_relaxed) && refused.exchange(false)) {
+                this->notifyRoom();
+            }
+
+            try {
+                consumer(item);
+            } catch (std::exception &e) {
+                std::cerr << "Exception in message handler: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    void wake() {
+        // Pairs with the fence in run(): either the sleeper sees the item or we see the sleeper
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+    }
+
+    MpmcRing<T> ring;
+    const Consumer consumer;
+    std::atomic<int> sleepers;
+    // A tryPush() found the ring full
+    std::atomic<bool> refused{false};
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+    std::vector<std::thread> workers;
+};
+
+} // namespace msgflo
@@ -145,13 +145,20 @@ private:
 
 enum mqtt_client_personality {
     threaded,
-    polling
+    polling,
+    // The owner watches socket() and calls loop_read(), loop_write() and loop_misc()
+    evented
 };
 
 class mqtt_event_listener {
 public:
     virtual ~mqtt_event_listener() = default;
 
+    // Lets hot paths skip formatting messages nobody reads
+    virtual bool msg_enabled() const {
+        return true;
+    }
+
     virtual void on_msg(const string &msg) {
         static_cast<void>(msg);
     }
@@ -194,12 +201,13 @@ template<mqtt_client_personality personality>
 class mqtt_client : public waitable, private mqtt_lib {
     using guard = lock_guard<recursive_mutex>;
 
-    template<bool>
+    template<mqtt_client_personality>
     struct personality_tag {
     };
 
     typedef personality_tag<mqtt_client_personality::threaded> threaded_tag;
     typedef personality_tag<mqtt_client_personality::polling> polling_tag;
+    typedef personality_tag<mqtt_client_personality::evented> evented_tag;
     const personality_tag<personality> p_tag{};
 
     mqtt_event_listener *event_listener;
@@ -262,6 +270,9 @@ private:
     void post_construct(polling_tag) {
     }
 
+    void post_construct(evented_tag) {
+    }
+
 public:
 
     virtual ~mqtt_client() {
@@ -282,16 +293,37 @@ private:
     void pre_destruct(polling_tag) {
     }
 
+    void pre_destruct(evented_tag) {
+    }
+
 public:
     int setUsernamePassword(std::string user, std::string pass) {
         return mosquitto_username_pw_set(mosquitto, user.c_str(), pass.c_str());
     }
 
+    // Outgoing QoS 1 and 2 messages in flight at once, 0 for no limit
+    void max_inflight_messages_set(unsigned int max) {
+        int rc = mosquitto_max_inflight_messages_set(mosquitto, max);
+        assert_success("mosquitto_max_inflight_messages_set", rc);
+    }
+
     int unacked_messages() {
         guard lock(this_mutex);
         return unacked_messages_;
     }
 
+    // For the threaded personality, where libmosquitto reconnects on its own
+    void reconnect_delay_set(unsigned int delay, unsigned int delay_max, bool exponential) {
+        int rc = mosquitto_reconnect_delay_set(mosquitto, delay, delay_max, exponential);
+        assert_success("mosquitto_reconnect_delay_set", rc);
+    }
+
+    // For the evented personality: connects again with the settings of connect(), blocking like it
+    int reconnect() {
+        event_listener->on_msg("mosquitto_reconnect");
+        return mosquitto_reconnect(mosquitto);
+    }
+
     bool connected() {
         guard lock(this_mutex);
 
@@ -336,6 +368,10 @@ private:
         assert_success("mosquitto_connect", rc);
     }
 
+    void connect(evented_tag) {
+        connect(polling_tag());
+    }
+
 private:
     void on_connect_wrapper(int rc) {
         guard lock(this_mutex);
@@ -370,7 +406,9 @@ private:
     void on_publish_wrapper(int message_id) {
         guard lock(this_mutex);
 
-        event_listener->on_msg("message ACKed, message id=" + to_string(message_id));
+        if (event_listener->msg_enabled()) {
+            event_listener->on_msg("message ACKed, message id=" + to_string(message_id));
+        }
         unacked_messages_--;
 
         event_listener->on_publish(message_id);
@@ -378,8 +416,8 @@ private:
         cv.notify_all();
     }
 
+    // Touches no client state, so messages are passed on without taking the lock
     void on_message_wrapper(const struct mosquitto_message *message) {
-        guard lock(this_mutex);
         event_listener->on_message(message);
     }
 
@@ -413,16 +451,17 @@ public:
         assert_success("mosquitto_subscribe", rc);
     }
 
-    void publish(int *mid, const string &topic, int qos, bool retain, const string &s) {
-        auto len = s.length();
-
-        static const auto int_max = std::numeric_limits<int>::max();
+    void unsubscribe(int *mid, const string &topic) {
+        int rc = mosquitto_unsubscribe(mosquitto, mid, topic.c_str());
+        assert_success("mosquitto_unsubscribe", rc);
+    }
 
-        if (len > int_max) {
-            len = static_cast<decltype(len)>(int_max);
+    void publish(int *mid, const string &topic, int qos, bool retain, const string &s) {
+        if (s.length() > static_cast<size_t>(std::numeric_limits<int>::max())) {
+            throw mqtt_error("payload too large for mosquitto_publish", MOSQ_ERR_PAYLOAD_SIZE);
         }
 
-        publish(mid, topic, qos, retain, static_cast<int>(len), s.c_str());
+        publish(mid, topic, qos, retain, static_cast<int>(s.length()), s.c_str());
     }
 
     void publish(int *mid, const string &topic, int qos, bool retain, int payload_len, const void *payload) {
@@ -430,7 +469,9 @@ public:
 //            throw mqtt_error("not connected", MOSQ_ERR_NO_CONN);
 //        }
 
-        event_listener->on_msg("Publishing " + to_string(payload_len) + " bytes to " + topic);
+        if (event_listener->msg_enabled()) {
+            event_listener->on_msg("Publishing " + to_string(payload_len) + " bytes to " + topic);
+        }
 
         int rc = mosquitto_publish(mosquitto, mid, topic.c_str(), payload_len, payload, qos, retain);
 
@@ -460,6 +501,32 @@ private:
         assert_success("mosquitto_loop", rc);
     }
 
+    void poll(evented_tag) {
+    }
+
+public:
+    // For the evented personality, -1 when not connected
+    int socket() {
+        return mosquitto_socket(mosquitto);
+    }
+
+    bool want_write() {
+        return mosquitto_want_write(mosquitto);
+    }
+
+    int loop_read() {
+        return mosquitto_loop_read(mosquitto, 1);
+    }
+
+    int loop_write() {
+        return mosquitto_loop_write(mosquitto, 1);
+    }
+
+    // Keepalive pings and retries, call about once a second
+    int loop_misc() {
+        return mosquitto_loop_misc(mosquitto);
+    }
+
 private:
     static void on_connect_cb(struct mosquitto *, void *self, int rc) {
         static_cast<mqtt_client *>(self)->on_connect_wrapper(rc);
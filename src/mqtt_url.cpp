@@ -0,0 +1,98 @@
+#include "mqtt_url.h"
+
+#include <climits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace msgflo {
+
+MqttUrl parseMqttUrl(const std::string &url) {
+    MqttUrl u;
+
+    string s = url.substr(7);
+    auto i_up = s.find('@');
+
+    if (i_up != string::npos) {
+        string up = s.substr(0, i_up);
+        // cout << "up: " << up << endl;
+
+        auto i_u = up.find(':');
+
+        if (i_u != string::npos) {
+            u.username = up.substr(0, i_u);
+            u.password = up.substr(i_u + 1);
+        } else {
+            u.username = up;
+        }
+        // cout << "username: " << username << endl;
+        // cout << "password: " << password << endl;
+
+        s = s.substr(i_up + 1);
+        // cout << "s: " << s << endl;
+    }
+
+    auto i_q = s.find('?');
+
+    if (i_q != string::npos) {
+        u.host = s.substr(0, i_q);
+        s = s.substr(i_q + 1);
+        // cout << "s: " << s << endl;
+
+        while (!s.empty()) {
+            auto i_amp = s.find('&');
+
+            string kv;
+            if (i_amp == string::npos) {
+                kv = s;
+                s = "";
+            } else {
+                kv = s.substr(0, i_amp);
+            }
+            // cout << "kv: " << kv << endl;
+
+            auto i_eq = kv.find('=');
+
+            string key, value;
+            if (i_eq != string::npos) {
+                key = kv.substr(0, i_eq);
+                value = kv.substr(i_eq + 1);
+            } else {
+                key = kv;
+            }
+            // cout << "key: " << key << endl;
+
+            if (key == "keepAlive") {
+                try {
+                    auto v = stoul(value);
+                    if (v > INT_MAX) {
+                        throw invalid_argument("too big");
+                    }
+                    u.keepAlive = static_cast<int>(v);
+                } catch (invalid_argument &e) {
+                    throw invalid_argument("Bad keepAlive argument, must be a number greater than zero.");
+                } catch (out_of_range &e) {
+                    throw invalid_argument("Bad keepAlive argument, must be a number greater than zero.");
+                }
+            } else if (key == "clientId") {
+                u.clientId = value;
+            } else if (key == "cleanSession") {
+                u.cleanSession = !(value == "0" || value == "no" || value == "false");
+            } else {
+                // ignore unknown keys
+            }
+
+            if (i_amp == string::npos) {
+                break;
+            }
+            s = s.substr(i_amp + 1);
+            // cout << "s: " << s << endl;
+        }
+    } else {
+        u.host = s;
+    }
+
+    return u;
+}
+
+} // namespace msgflo
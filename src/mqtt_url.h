@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+namespace msgflo {
+
+// Connection settings from an mqtt://[user[:password]@]host[?key=value&...] URL.
+// Known keys are keepAlive, clientId and cleanSession.
+struct MqttUrl {
+    std::string host;
+    std::string username;
+    std::string password;
+    int port = 1883;
+    int keepAlive = 180;
+    std::string clientId;
+    bool cleanSession = true;
+};
+
+// Throws std::invalid_argument for a bad keepAlive
+MqttUrl parseMqttUrl(const std::string &url);
+
+} // namespace msgflo
@@ -1,10 +1,36 @@
 #include "msgflo.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <sys/ioctl.h>
 #include "amqpcpp.h"
 #include "amqpcpp/libev.h"
+#include "abstract_message.h"
+#include "ack_coalescer.h"
+#include "backoff.h"
+#include "codec.h"
+#include "discovery_scheduler.h"
+#include "inport_scheduler.h"
+#include "mpmc_ring.h"
 #include "mqtt_support.h"
+#include "mqtt_url.h"
+#include "object_pool.h"
+#include "outbound_queue.h"
+#include "participant.h"
+#include "send_window.h"
+#include "socket_cork.h"
+#include "topic_index.h"
 
 using namespace std;
 using namespace trygvis::mqtt_support;
@@ -35,6 +61,13 @@ int64_t millis_monotonic(void)
     return ms;
 }
 
+int64_t micros_monotonic(void)
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (spec.tv_sec*1000000) + spec.tv_nsec/1000;
+}
+
 std::string string_to_upper_copy(const std::string &str) {
     std::string ret;
     ret.resize(str.size());
@@ -48,120 +81,6 @@ bool string_starts_with(const std::string &str, const std::string &prefix) {
     return str.substr(0, prefix.size()) == prefix;
 }
 
-class DiscoveryMessage {
-public:
-    DiscoveryMessage(const Definition &def)
-        : definition(def) {
-    }
-
-    json11::Json to_json() const {
-        using namespace json11;
-
-        return Json::object {
-                {"protocol",  "discovery"},
-                {"command",  "participant"},
-                {"payload", definition.to_json() },
-        };
-    }
-
-private:
-    Definition definition;
-};
-
-void defaultMessageHandler(msgflo::Message *msg) {
-    cout << "Warning: No message handler defined for msgflo::Participant" << endl;
-}
-
-template<typename Engine_t>
-struct ParticipantRegistrationT : public Participant {
-    Engine_t *engine;
-    const std::vector<Definition::Port> inports;
-    const std::vector<Definition::Port> outports;
-    const string id;
-    MessageHandler handler;
-    const DiscoveryMessage discoveryMessage;
-
-    ParticipantRegistrationT(Engine_t *engine, const Definition &definition)
-        : engine(engine)
-        , inports(definition.inports)
-        , outports(definition.outports)
-        , id(generateId(definition))
-        , handler(defaultMessageHandler)
-        , discoveryMessage(definition)
-    {}
-
-    void onMessage(const MessageHandler &h) {
-        handler = h;
-    }
-
-    virtual void send(std::string port, const json11::Json &json) override {
-        send(port, json.dump());
-    }
-
-    virtual void send(std::string port, const std::string &string) override {
-        send(port, string.c_str(), string.size());
-    }
-
-    virtual void send(std::string port, const char *data, uint64_t len) override {
-        engine->send(this, port, data, len);
-    }
-
-    const Definition::Port *findOutPort(const string &id) const {
-        for (auto &p: outports) {
-            if (p.id == id) {
-                return &p;
-            }
-        }
-        return nullptr;
-    }
-
-    static string generateId(const Definition &d) {
-        return d.role + std::to_string(rand());
-    }
-};
-
-class AbstractMessage : public Message {
-protected:
-    AbstractMessage(const char *data, const uint64_t len, const std::string &port)
-        : _data(data)
-        , _len(len)
-        , _port(port)
-    {}
-
-    virtual ~AbstractMessage() {};
-
-    const char *_data;
-    const uint64_t _len;
-    const std::string _port;
-
-public:
-    virtual void data(const char **data, uint64_t *len) override {
-        *data = this->_data;
-        *len = this->_len;
-    }
-
-    virtual std::string port() override {
-        return _port;
-    }
-
-    virtual std::string asString() override {
-        string str(_data, _len);
-        return str;
-    }
-
-    virtual json11::Json asJson() override {
-        string err;
-        string str(_data, _len);
-        auto x = json11::Json::parse(str, err);
-        if (!err.empty()) {
-            cerr << "_data=" << _data << endl;
-            cerr << "_len=" << _len << endl;
-            throw domain_error("Could not parse JSON body: " + err + ", payload: " + str);
-        }
-        return x;
-    }
-};
-
 template<typename EngineType>
 class AbstractEngine {
 protected:
@@ -178,19 +97,87 @@ protected:
             if (port.queue.empty()) {
                 port.queue = generateQueueName(definition, port);
             }
+            validateContentType(port);
+            validateQos(port);
         }
         for (auto &port : d.outports) {
             if (port.queue.empty()) {
                 port.queue = generateQueueName(definition, port);
             }
+            validateContentType(port);
+            validateQos(port);
         }
 
         return d;
     }
 
+    void validateContentType(const Definition::Port &port) {
+        if (findCodec(port.contentType) == nullptr) {
+            throw invalid_argument("Unsupported content type for port " + port.id + ": " + port.contentType);
+        }
+    }
+
+    void validateQos(const Definition::Port &port) {
+        if (port.qos < 0 || port.qos > 2) {
+            throw invalid_argument("Invalid QoS for port " + port.id + ": " + to_string(port.qos));
+        }
+    }
+
     virtual string generateQueueName(const Definition &d, const Definition::Port &) = 0;
 
-    vector<ParticipantRegistration> registrations;
+    using RegistrationPtr = shared_ptr<ParticipantRegistration>;
+
+    RegistrationPtr makeRegistration(EngineType *engine, const Definition &d) {
+        return registrationPool.make(engine, nextRegistrationKey++, d);
+    }
+
+    // Changes are made on the loop thread, or before launch()
+    void addRegistration(const RegistrationPtr &r) {
+        std::lock_guard<std::mutex> lock(registrationsMutex);
+        registrations[r->key] = r;
+    }
+
+    void removeRegistration(size_t key) {
+        std::lock_guard<std::mutex> lock(registrationsMutex);
+        registrations.erase(key);
+    }
+
+    ParticipantRegistration *findRegistration(size_t key) const {
+        auto it = registrations.find(key);
+        return it == registrations.end() ? nullptr : it->second.get();
+    }
+
+    // Marks the participant unregistered, false if it already was.
+    // Throws std::invalid_argument for a participant of another engine.
+    bool unregister(EngineType *engine, Participant *participant) {
+        auto r = dynamic_cast<ParticipantRegistration *>(participant);
+        if (r == nullptr || r->engine != engine) {
+            throw invalid_argument("Participant is not registered with this engine");
+        }
+        return r->registered.exchange(false);
+    }
+
+    // Safe to call from any thread
+    EngineStats collectStats() const {
+        EngineStats s;
+        std::lock_guard<std::mutex> lock(registrationsMutex);
+        for (const auto &r : registrations) {
+            r.second->collectStats(s.ports);
+        }
+        s.payloadPool = PayloadPool::instance().stats();
+        return s;
+    }
+
+    // Pool allocated and shared with the messages on their way to the
+    // handlers, so the pointers handed out by registerParticipant() stay
+    // valid and a participant can be unregistered while messages are in flight.
+    // Keyed by ParticipantRegistration::key, in the order of registration.
+    map<size_t, RegistrationPtr> registrations;
+    mutable std::mutex registrationsMutex;
+
+private:
+    ObjectPool<ParticipantRegistration> registrationPool;
+    std::atomic<size_t> nextRegistrationKey{0};
 };
 
 // C-style subclassing
@@ -209,370 +196,2691 @@ static void timeout_cb(struct ev_loop *loop, ev_timer *timer, int revent) {
     }
 }
 
-class AmqpEngine final : public Engine, protected AbstractEngine<AmqpEngine> {
-
-    struct AmqpMessage final : public AbstractMessage {
-        AmqpMessage(AMQP::Channel &channel, uint64_t deliveryTag, const AMQP::Message &m, const std::string &p)
-            : AbstractMessage(m.body(), m.bodySize(), p)
-            , _deliveryTag(deliveryTag)
-            ,channel(channel)
-        {
-        }
-
-        uint64_t _deliveryTag;
-        AMQP::Channel &channel;
-
-        virtual void ack() override {
-            channel.ack(_deliveryTag);
-        }
-
-        virtual void nack() override {
-            channel.reject(_deliveryTag);
-        }
-    };
+// Sends discovery messages when the DiscoveryScheduler has them due, from a
+// one-shot timer re-armed for the next one. Only used from the loop thread.
+struct EvDiscoveryTimer {
 
 public:
-    AmqpEngine(const string &url, EngineConfig config)
-        : Engine()
-        , loop(EV_DEFAULT)
-        , handler(loop)
-        , connection(&handler, AMQP::Address(url))
-        , channel(&connection)
-        , discoveryPeriod(config.discoveryPeriod/3)
-    {
-        channel.setQos(1); // TODO: is this prefech?
-
-        channel.onReady([&]() {
-            connected = true;
-            for(auto &r: registrations) {
-                for (const auto &port : r.inports) {
-                    setupInPort(r, port);
-                }
-                for (const auto &port : r.outports) {
-                    setupOutPort(port);
-                }
+    explicit EvDiscoveryTimer(const EngineConfig &config)
+        : scheduler(config.discoveryPeriod / 3.0, config.discoveryRate(),
+                    static_cast<size_t>(std::max(config.discoveryBurst(), 1)), config.discoveryJitter())
+    {}
 
-                sendDiscoveryMessage(r);
-            }
-        });
+    void add(size_t id) {
+        scheduler.add(id, loop ? ev_now(loop) : 0);
+        if (running) {
+            run();
+        }
     }
 
-    virtual Participant *registerParticipant(const Definition &definition) override {
-        Definition d = validateDefinitionFromUser(definition);
-        registrations.emplace_back(this, d);
-        return &registrations[registrations.size() - 1];
+    void remove(size_t id) {
+        scheduler.remove(id);
     }
 
-    virtual void launch() override {
-        discoveryTimer.callback = [this]() {
-            if (not connected) {
-                return;
-            }
-            for(auto &r: registrations) {
-                this->sendDiscoveryMessage(r);
-            }
-        };
-        ev_timer_init(&discoveryTimer.timer, timeout_cb, discoveryPeriod, discoveryPeriod);
-        ev_timer_start(loop, &discoveryTimer.timer);
-        ev_run(loop, 0);
+    // Every participant is sent anew, as they are after connecting
+    void start(struct ev_loop *l, std::function<void (size_t)> s) {
+        loop = l;
+        send = std::move(s);
+        if (!running) {
+            wrapper.callback = [this]() {
+                run();
+            };
+            ev_timer_init(&wrapper.timer, timeout_cb, 0, 0);
+            running = true;
+        }
+        scheduler.restart(ev_now(loop));
+        run();
     }
 
-protected:
-    string generateQueueName(const Definition &d, const Definition::Port &port) override {
-        return d.role + "." + string_to_upper_copy(port.id);
+    void stop() {
+        if (running) {
+            ev_timer_stop(loop, &wrapper.timer);
+            running = false;
+        }
     }
 
 private:
-    void sendDiscoveryMessage(const ParticipantRegistration &r) {
-        string data = json11::Json(r.discoveryMessage).dump();
-        AMQP::Envelope env(data);
-        channel.publish("", "fbp", env);
+    void run() {
+        ev_timer_stop(loop, &wrapper.timer);
+        const double next = scheduler.run(ev_now(loop), send);
+        if (next >= 0) {
+            ev_timer_set(&wrapper.timer, next, 0);
+            ev_timer_start(loop, &wrapper.timer);
+        }
     }
 
-    void setupOutPort(const Definition::Port &p) {
-        channel.declareExchange(p.queue, AMQP::fanout);
-    }
+    DiscoveryScheduler scheduler;
+    EvTimerWrapper wrapper;
+    struct ev_loop *loop = nullptr;
+    std::function<void (size_t)> send;
+    bool running = false;
+};
 
-    void setupInPort(const ParticipantRegistration &r, const Definition::Port &port) {
-        channel.declareQueue(port.queue, AMQP::durable);
-        channel.consume(port.queue).onReceived(
-            [r, this, port](const AMQP::Message &message,
-                      uint64_t deliveryTag,
-                      bool redelivered) {
-                AmqpMessage msg(channel, deliveryTag, message, port.id);
-                r.handler(&msg);
-            });
-    }
+struct EvIoWrapper {
 
 public:
+    struct ev_io io;
+    std::function<void (void)> callback;
+};
+
+static void io_cb(struct ev_loop *loop, ev_io *io, int revent) {
+    EvIoWrapper *wrapper = (EvIoWrapper *)io;
+    if (wrapper->callback) {
+        wrapper->callback();
+    }
+}
 
-    void send(const ParticipantRegistration *r, const string &portName, const char *data, uint64_t size) {
-        auto p = r->findOutPort(portName);
+// Called right before the loop waits for events
+struct EvPrepareWrapper {
 
-        if (p == nullptr) {
-            throw domain_error("Unknown out port: " + portName);
-        }
+public:
+    struct ev_prepare prepare;
+    std::function<void (void)> callback;
+};
 
-        AMQP::Envelope env(data, size);
-        cout << " Sending on id=" << p->id << ", queue=" << p->queue << endl;
-        channel.publish(p->queue, "", env);
+static void prepare_cb(struct ev_loop *loop, ev_prepare *prepare, int revent) {
+    EvPrepareWrapper *wrapper = (EvPrepareWrapper *)prepare;
+    if (wrapper->callback) {
+        wrapper->callback();
     }
+}
 
-private:
-    struct ev_loop *loop;
-    AMQP::LibEvHandler handler;
-    AMQP::TcpConnection connection;
-    AMQP::TcpChannel channel;
-    int64_t discoveryPeriod;
-    EvTimerWrapper discoveryTimer;
-    bool connected = false;
-};
+struct EvAsyncWrapper {
 
-using msg_flo_mqtt_client = mqtt_client<trygvis::mqtt_support::mqtt_client_personality::polling>;
+public:
+    struct ev_async async;
+    std::function<void (void)> callback;
+};
 
-class MosquittoEngine final : public Engine, protected mqtt_event_listener, protected AbstractEngine<MosquittoEngine> {
+static void async_cb(struct ev_loop *loop, ev_async *async, int revent) {
+    EvAsyncWrapper *wrapper = (EvAsyncWrapper *)async;
+    if (wrapper->callback) {
+        wrapper->callback();
+    }
+}
 
-    struct MosquittoMessage final : public AbstractMessage {
-        MosquittoMessage(const struct mosquitto_message *m, bool d, const std::string &p)
-            : AbstractMessage(static_cast<char *>(m->payload), static_cast<uint64_t>(m->payloadlen), p)
-            , _mid(m->mid)
-            , _debugOutput(d)
-        {
+// Received messages waiting on the loop thread for their handlers, with
+// EngineConfig::fairScheduling(). A few are handled per loop iteration, so
+// the engine reads in between and messages of other ports can overtake those
+// still waiting. Beyond `capacity` waiting, more are handled to bound the memory.
+template<typename T>
+struct EvScheduledDeliveries {
+    static const size_t budget = 16;
+
+    InportScheduler<T> waiting;
+    EvAsyncWrapper async;
+    std::function<void (T &)> deliver;
+    size_t capacity = 0;
+    struct ev_loop *loop = nullptr;
+
+    void start(struct ev_loop *l, size_t c, std::function<void (T &)> d) {
+        loop = l;
+        capacity = c;
+        deliver = std::move(d);
+        async.callback = [this]() {
+            run();
+        };
+        ev_async_init(&async.async, async_cb);
+        ev_async_start(loop, &async.async);
+    }
 
+    void stop() {
+        if (loop) {
+            ev_async_stop(loop, &async.async);
         }
+    }
 
-        int _mid;
-        bool _debugOutput = false;
+    // Loop thread only
+    void push(const InportShare &share, T &&item) {
+        waiting.push(share, std::move(item));
+        ev_async_send(loop, &async.async);
+    }
 
-        virtual void ack() override {
-            if (_debugOutput) {
-                cerr << "MosquittoMessage.ack() is currently a no-op" << endl;
-            }
+private:
+    void run() {
+        T item;
+        size_t handled = 0;
+        while ((handled < budget || waiting.size() > capacity) && waiting.pop(item)) {
+            handled++;
+            deliver(item);
+        }
+        if (!waiting.empty()) {
+            ev_async_send(loop, &async.async);
         }
+    }
+};
 
-        virtual void nack() override {
-            if (_debugOutput) {
-                cerr << "MosquittoMessage.nack() is currently a no-op" << endl;
+// Received messages going from the loop thread to handler threads without
+// waiting for them, see HandoffBacklog. The workers' onRoom() wakes the loop
+// to hand the backlog over, then `resumed` is called if it all went.
+template<typename T>
+struct EvHandoff {
+    unique_ptr<HandoffBacklog<T>> backlog;
+    EvAsyncWrapper room;
+    struct ev_loop *loop = nullptr;
+
+    void start(struct ev_loop *l, Workers<T> &workers, std::function<void (void)> resumed = nullptr) {
+        loop = l;
+        backlog.reset(new HandoffBacklog<T>(workers));
+        room.callback = [this, resumed]() {
+            if (backlog->drain() && resumed) {
+                resumed();
             }
-        }
-    };
+        };
+        ev_async_init(&room.async, async_cb);
+        ev_async_start(loop, &room.async);
+        workers.onRoom([this]() {
+            ev_async_send(loop, &room.async);
+        });
+    }
 
-public:
-    MosquittoEngine(const EngineConfig config, const string &host, const int port,
-                    const int keep_alive, const string &client_id, const bool clean_session, const std::string &user, const std::string &pw)
-        : _debugOutput(config.debugOutput())
-        , client(this, host, port, keep_alive, client_id, clean_session)
-        , discoveryLastSent(0)
-        , discoveryPeriod(config.discoveryPeriod/3)
-    {
-        if (user.size()) {
-            client.setUsernamePassword(user, pw);
+    // After the workers are gone
+    void stop() {
+        if (loop) {
+            ev_async_stop(loop, &room.async);
         }
-        client.connect();
     }
 
-    virtual ~MosquittoEngine() {
+    bool active() const {
+        return loop != nullptr;
     }
 
-    virtual Participant *registerParticipant(const Definition &definition) override {
-        Definition d = validateDefinitionFromUser(definition);
-        registrations.emplace_back(this, d);
-        return &registrations[registrations.size() - 1];
+    // Loop thread only
+    void push(T &&item) {
+        backlog->push(std::move(item));
     }
 
-    void send(const ParticipantRegistration *r, const string &portName, const char *data, uint64_t len) {
-        auto port = r->findOutPort(portName);
-
-        if (port == nullptr) {
-            throw domain_error("No such port: " + portName);
-        }
-
-        client.publish(nullptr, port->queue, 0, false, static_cast<int>(len), data);
+    bool backedUp() const {
+        return backlog && backlog->backedUp();
     }
+};
 
-    virtual void launch() override {
-        run = true;
-
-        while (run) {
-            const auto t = millis_monotonic()/1000; 
-            if (connected and (t - discoveryLastSent) > discoveryPeriod) {
-                for(auto &r: registrations) {
-                    sendDiscoveryMessage(r);
-                }
-                discoveryLastSent = t;
-            }
+// Runs functions posted from any thread on the thread running the libev loop
+struct EvLoopQueue {
 
-            client.poll();
+public:
+    struct ev_async async;
+    std::mutex mutex;
+    std::vector<std::function<void (void)>> pending;
+    std::thread::id loopThread;
+    bool running = false;
+
+    // Can be called again when the loop is run again
+    void start(struct ev_loop *loop) {
+        if (!running) {
+            ev_async_init(&async, loop_queue_cb);
+            ev_async_start(loop, &async);
         }
+        loopThread = std::this_thread::get_id();
+        running = true;
     }
 
-protected:
-    string generateQueueName(const Definition &d, const Definition::Port &port) override {
-        return d.role + "." + string_to_upper_copy(port.id);
+    bool onLoopThread() const {
+        return !running || std::this_thread::get_id() == loopThread;
     }
 
-    virtual void on_msg(const string &msg) override {
-        if (!_debugOutput) {
+    // Work run inline is not wrapped in a std::function, which could allocate
+    template<typename F>
+    void post(struct ev_loop *loop, F &&f) {
+        if (onLoopThread()) {
+            f();
             return;
         }
-
-        cout << "mqtt: " << msg << endl;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.emplace_back(std::forward<F>(f));
+        }
+        ev_async_send(loop, &async);
     }
 
-    virtual void on_message(const struct mosquitto_message *message) override {
-        string topic = message->topic;
-        for (auto &r : registrations) {
-            for (auto &p : r.inports) {
-                if (p.queue == topic) {
-                    MosquittoMessage m(message, _debugOutput, p.id);
+private:
+    // Swapped with pending, so both keep their capacity
+    std::vector<std::function<void (void)>> work;
 
-                    r.handler(&m);
-                }
-            }
+    static void loop_queue_cb(struct ev_loop *loop, ev_async *async, int revent) {
+        EvLoopQueue *queue = (EvLoopQueue *)async;
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->work.swap(queue->pending);
+        }
+        for (auto &f : queue->work) {
+            f();
         }
+        queue->work.clear();
     }
+};
 
-    virtual void on_connect(int rc) override {
-        connected = true;
-        for(auto &r: registrations) {
-            for (auto &p : r.inports) {
-                on_msg("Connecting port " + p.id + " to mqtt topic " + p.queue);
-                client.subscribe(nullptr, p.queue, 0);
-            }
-            sendDiscoveryMessage(r);
-        }
-        discoveryLastSent = millis_monotonic()/1000;
+// A batch sent from another thread is copied once and posted to the loop as a whole
+static shared_ptr<vector<string>> copyBatch(const vector<PayloadView> &payloads) {
+    auto bodies = make_shared<vector<string>>();
+    bodies->reserve(payloads.size());
+    for (const auto &p : payloads) {
+        bodies->emplace_back(p.data, p.size);
     }
+    return bodies;
+}
 
-private:
-    void sendDiscoveryMessage(const ParticipantRegistration &r) {
-        const string data = json11::Json(r.discoveryMessage).dump();
-        client.publish(nullptr, "fbp", 0, false, data);
+static vector<PayloadView> viewBatch(const vector<string> &bodies) {
+    vector<PayloadView> views;
+    views.reserve(bodies.size());
+    for (const auto &b : bodies) {
+        views.push_back(PayloadView{b.data(), b.size()});
     }
+    return views;
+}
 
-private:
-    const bool _debugOutput;
-    atomic_bool run;
-    msg_flo_mqtt_client client;
-    vector<ParticipantRegistration> registrations;
-    bool connected;
-    int64_t discoveryLastSent;
-    const int64_t discoveryPeriod;
-};
+// Header with the wall clock send time in microseconds, see EngineConfig::timestampMessages()
+static const std::string amqpSentHeader = "x-msgflo-sent";
+// Content encoding of payloads an outport compressed, see Definition::Port::compression
+static const std::string amqpCompressedEncoding = "x-msgflo-compressed";
 
-shared_ptr<Engine> createEngine(const EngineConfig config) {
+class AmqpEngine final : public Engine, protected AbstractEngine<AmqpEngine> {
 
-    string url = config.url();
+    // A channel of the connection, with what is tracked per channel. Only
+    // used from the loop thread, except SendWindow::depth().
+    struct AmqpChannel {
+        explicit AmqpChannel(size_t confirmWindow)
+            : sendWindow(confirmWindow)
+        {}
 
-    if (url.empty()) {
-        const char* broker = std::getenv("MSGFLO_BROKER");
-        if (broker) {
-            url = broker;
+        bool usable() const {
+            return channel && !failed;
         }
-    }
 
-    if (url.empty()) {
-        throw invalid_argument("Missing msgflo url and MSGFLO_BROKER is not set.");
-    }
+        // Whether a delivery tag of the given generation can still be settled
+        bool owns(uint64_t g) const {
+            return usable() && g == generation;
+        }
 
-    if (string_starts_with(url, "mqtt://")) {
-        string host, username, password;
-        int port = 1883;
-        int keep_alive = 180;
-        string client_id;
-        bool clean_session = true;
+        unique_ptr<AMQP::TcpChannel> channel;
+        // Set for each channel opened. The broker has already requeued the
+        // deliveries of a channel that was lost.
+        uint64_t generation = 0;
+        // Failed on its own, opened again by channelTimer
+        bool failed = false;
+
+        AckCoalescer acks;
+        // Deliveries passed to handlers and not settled yet
+        size_t unsettled = 0;
+        // Kept open after its inport was unregistered, until its deliveries are settled
+        bool retired = false;
+
+        SendWindow sendWindow;
+        uint64_t publishSequence = 0;
+    };
 
-        string s = url.substr(7);
-        auto i_up = s.find('@');
+    // Consumer state for one inport. Only used from the loop thread.
+    struct AmqpInPort {
+        // Kept alive with the port while its messages are in flight
+        shared_ptr<ParticipantRegistration> registration;
+        // The engine's shared channel, or one of its own with EngineConfig::channelPerInport()
+        shared_ptr<AmqpChannel> consumer;
+        string queue;
+        string portId;
+        const Codec *codec;
+        PortCounters *counters;
+        uint16_t prefetch;
+        string consumerTag;
+        // See Definition::Port::priority and weight
+        int priority;
+        int weight;
+        // See EngineConfig::maxDecompressedSize(), and whether payloads not
+        // marked as compressed are decompressed too
+        uint64_t maxInflated;
+        bool inflateAll;
+
+        // Adaptive prefetch measurements, in microseconds
+        double handlerLatency = 0;
+        double roundTrip = 0;
+        int64_t probeSent = 0;
+        uint64_t samples = 0;
+    };
 
-        if (i_up != string::npos) {
-            string up = s.substr(0, i_up);
-            // cout << "up: " << up << endl;
+    struct AmqpMessage final : public AbstractMessage, public PoolAllocated<AmqpMessage> {
+        AmqpMessage(AmqpEngine *engine, const shared_ptr<AmqpInPort> &inport, uint64_t deliveryTag, const AMQP::Message &m)
+            : AbstractMessage(m.body(), m.bodySize(), inport->portId, codecFor(inport, m), maxInflatedFor(inport, m))
+            , _deliveryTag(deliveryTag)
+            , engine(engine)
+            , inport(inport)
+            , received(micros_monotonic())
+            , generation(inport->consumer->generation)
+        {
+        }
 
-            auto i_u = up.find(':');
+        AmqpMessage(AmqpEngine *engine, const shared_ptr<AmqpInPort> &inport, uint64_t deliveryTag, PayloadBuffer &&body,
+                    const Codec *codec, uint64_t maxInflated, int64_t received, uint64_t generation)
+            : AbstractMessage(std::move(body), inport->portId, codec, maxInflated)
+            , _deliveryTag(deliveryTag)
+            , engine(engine)
+            , inport(inport)
+            , received(received)
+            , generation(generation)
+        {
+        }
 
-            if (i_u != string::npos) {
-                username = up.substr(0, i_u);
-                password = up.substr(i_u + 1);
-            } else {
-                username = up;
+        ~AmqpMessage() {
+            if (dropped()) {
+                nack();
             }
-            // cout << "username: " << username << endl;
-            // cout << "password: " << password << endl;
-
-            s = s.substr(i_up + 1);
-            // cout << "s: " << s << endl;
         }
 
-        auto i_q = s.find('?');
-
-        if (i_q != string::npos) {
-            host = s.substr(0, i_q);
-            s = s.substr(i_q + 1);
-            // cout << "s: " << s << endl;
+        uint64_t _deliveryTag;
+        AmqpEngine *engine;
+        shared_ptr<AmqpInPort> inport;
+        int64_t received;
+        // Delivery tags belong to the channel they came on. The broker has
+        // already requeued the deliveries of a channel that was lost.
+        uint64_t generation;
+
+        virtual std::unique_ptr<Message> retain() override {
+            const uint64_t maxInflated = inflateLimit();
+            auto m = new AmqpMessage(engine, inport, _deliveryTag, takePayload(), _codec, maxInflated, received, generation);
+            m->countOn(_counters);
+            return std::unique_ptr<Message>(m);
+        }
 
-            while (!s.empty()) {
-                auto i_amp = s.find('&');
+        // Set by senders with EngineConfig::timestampMessages(), 0 if missing
+        static int64_t sentMicros(const AMQP::Message &m) {
+            if (!m.hasHeaders() || !m.headers().contains(amqpSentHeader)) {
+                return 0;
+            }
+            return static_cast<int64_t>(m.headers().get(amqpSentHeader));
+        }
 
-                string kv;
-                if (i_amp == string::npos) {
-                    kv = s;
-                    s = "";
-                } else {
-                    kv = s.substr(0, i_amp);
+        // A content type set by the sender wins over the one configured for the port
+        static const Codec *codecFor(const shared_ptr<AmqpInPort> &inport, const AMQP::Message &m) {
+            if (m.hasContentType()) {
+                auto codec = findCodec(m.contentType());
+                if (codec) {
+                    return codec;
                 }
-                // cout << "kv: " << kv << endl;
+            }
+            return inport->codec;
+        }
 
-                auto i_eq = kv.find('=');
+        // Payloads the sender marked as compressed, or all with a port expecting them
+        static uint64_t maxInflatedFor(const shared_ptr<AmqpInPort> &inport, const AMQP::Message &m) {
+            const bool marked = m.hasContentEncoding() && m.contentEncoding() == amqpCompressedEncoding;
+            return marked || inport->inflateAll ? inport->maxInflated : 0;
+        }
 
-                string key, value;
-                if (i_eq != string::npos) {
-                    key = kv.substr(0, i_eq);
-                    value = kv.substr(i_eq + 1);
-                } else {
-                    key = kv;
+        // Acks and nacks may come from handler threads, the channel is only used from the loop thread
+        virtual void ack() override {
+            countSettled(true);
+            auto tag = _deliveryTag;
+            auto e = engine;
+            auto p = inport;
+            auto t = received;
+            auto g = generation;
+            engine->loopQueue.post(engine->loop, [e, p, tag, t, g]() {
+                if (!p->consumer->owns(g)) {
+                    return;
                 }
-                // cout << "key: " << key << endl;
+                e->settleAck(*p->consumer, tag);
+                e->messageDone(*p, t);
+                e->settled(p->consumer);
+            });
+        }
 
-                if (key == "keepAlive") {
-                    try {
-                        auto v = stoul(value);
-                        if (v > INT_MAX) {
-                            throw invalid_argument("too big");
-                        }
-                        keep_alive = static_cast<int>(v);
-                    } catch (invalid_argument &e) {
-                        throw invalid_argument("Bad keepAlive argument, must be a number greater than zero.");
-                    } catch (out_of_range &e) {
-                        throw invalid_argument("Bad keepAlive argument, must be a number greater than zero.");
-                    }
-                } else if (key == "clientId") {
-                    client_id = value;
-                } else if (key == "cleanSession") {
-                    clean_session = !(value == "0" || value == "no" || value == "false");
-                } else {
-                    // ignore unknown keys
+        virtual void nack() override {
+            countSettled(false);
+            auto tag = _deliveryTag;
+            auto e = engine;
+            auto p = inport;
+            auto t = received;
+            auto g = generation;
+            engine->loopQueue.post(engine->loop, [e, p, tag, t, g]() {
+                AmqpChannel &c = *p->consumer;
+                if (!c.owns(g)) {
+                    return;
                 }
-
-                if (i_amp == string::npos) {
-                    break;
+                c.channel->reject(tag);
+                if (e->ackBatch > 0) {
+                    c.acks.rejected(tag);
                 }
-                s = s.substr(i_amp + 1);
-                // cout << "s: " << s << endl;
-            }
+                e->messageDone(*p, t);
+                e->settled(p->consumer);
+            });
+        }
+    };
+
+    // A message on its way from the loop thread to a handler thread, or
+    // waiting on the loop thread with EngineConfig::fairScheduling()
+    struct Handoff {
+        AmqpMessage *message;
+        int64_t sent;
+    };
+
+    // The counters stay with the inport when its consumer is set up again
+    static InportShare shareOf(const Handoff &h) {
+        const AmqpInPort &p = *h.message->inport;
+        return InportShare{p.counters, p.priority, p.weight, h.message->payloadSize()};
+    }
+
+    static void handle(Handoff &h) {
+        unique_ptr<AmqpMessage> m(h.message);
+        h.message = nullptr;
+        runHandler(*m->inport->registration, *m->inport->counters, *m, h.sent);
+    }
+
+public:
+    AmqpEngine(const string &url, EngineConfig config)
+        : Engine()
+        , loop(EV_DEFAULT)
+        , address(url)
+        , handler(loop)
+        , discovery(config)
+        , debugOutput(config.debugOutput())
+        , defaultPrefetch(config.prefetch())
+        , adaptivePrefetch(config.adaptivePrefetch())
+        , maxPrefetch(config.maxPrefetch())
+        , ackBatch(static_cast<size_t>(std::max(config.ackBatch(), 0)))
+        , confirms(config.publisherConfirms())
+        , confirmWindow(static_cast<size_t>(std::max(config.confirmWindow(), 1)))
+        , channelPerInport(config.channelPerInport())
+        , timestampMessages(config.timestampMessages())
+        , maxDecompressedSize(config.maxDecompressedSize())
+        , statsTopic(config.statsTopic())
+        , statsPeriod(config.statsPeriod())
+        , corking(config.cork())
+        , cork(static_cast<size_t>(std::max(config.corkBudget(), 1)))
+        , outbound(config)
+        , reconnecting(config.reconnect())
+        , backoff(config.reconnectDelay(), config.maxReconnectDelay())
+        , channelBackoff(config.reconnectDelay(), config.maxReconnectDelay())
+    {
+        // Made once, so stats() can read their send windows from any thread
+        shared = make_shared<AmqpChannel>(confirmWindow);
+        for (int i = 0; i < config.publishChannels(); i++) {
+            publishers.push_back(make_shared<AmqpChannel>(confirmWindow));
+        }
+
+        const size_t handoffCapacity = static_cast<size_t>(std::max(config.handoffCapacity(), 1));
+        if (config.handlerThreads() > 0 && config.fairScheduling()) {
+            workers.reset(new ScheduledWorkers<Handoff>(handoffCapacity, config.handlerThreads(), shareOf, handle));
+        } else if (config.handlerThreads() > 0) {
+            workers.reset(new RingWorkers<Handoff>(handoffCapacity, config.handlerThreads(), handle));
+        } else if (config.fairScheduling()) {
+            scheduling = true;
+            scheduled.start(loop, handoffCapacity, handle);
+        }
+        if (workers) {
+            handoff.start(loop, *workers);
+        }
+
+        ackTimer.callback = [this]() {
+            flushAllAcks();
+        };
+        ev_timer_init(&ackTimer.timer, timeout_cb, config.ackFlushMilliseconds() / 1000.0, 0);
+
+        handler.lost = [this](AMQP::TcpConnection *c, const char *message) {
+            // Errors of a connection being replaced are old news
+            if (c == connection.get()) {
+                connectionLost(message);
+            }
+        };
+        reconnectTimer.callback = [this]() {
+            openConnection();
+        };
+        ev_timer_init(&reconnectTimer.timer, timeout_cb, 0, 0);
+        channelTimer.callback = [this]() {
+            reopenChannels();
+        };
+        ev_timer_init(&channelTimer.timer, timeout_cb, 0, 0);
+
+        // Work posted from other threads waits for the loop, registrations may
+        // still be added on this thread until then
+        loopQueue.start(loop);
+        openConnection();
+    }
+
+    virtual ~AmqpEngine() {
+        // Queued sends fail, and handler threads waiting for room are let go before they are joined
+        outbound.close();
+        // Messages still waiting for the loop are dropped, the broker redelivers them
+        scheduled.stop();
+        Handoff h;
+        while (scheduled.waiting.pop(h)) {
+            delete h.message;
+        }
+        workers.reset();
+        handoff.stop();
+        if (handoff.active()) {
+            for (auto &b : handoff.backlog->waiting()) {
+                delete b.message;
+            }
+        }
+        closeChannels();
+        if (loopQueue.running) {
+            ev_async_stop(loop, &loopQueue.async);
+        }
+    }
+
+    virtual Participant *registerParticipant(const Definition &definition) override {
+        Definition d = validateDefinitionFromUser(definition);
+        auto r = makeRegistration(this, d);
+        loopQueue.post(loop, [this, r]() {
+            addRegistration(r);
+            discovery.add(r->key);
+            if (connected) {
+                setupRegistration(r);
+            }
+        });
+        return r.get();
+    }
+
+    virtual void unregisterParticipant(Participant *participant) override {
+        if (!unregister(this, participant)) {
+            return;
+        }
+        const size_t key = static_cast<ParticipantRegistration *>(participant)->key;
+        loopQueue.post(loop, [this, key]() {
+            discovery.remove(key);
+            // Unacked deliveries stay valid after their consumer is cancelled
+            for (auto &p : inports) {
+                if (p->registration->key != key) {
+                    continue;
+                }
+                if (!p->consumerTag.empty()) {
+                    p->consumer->channel->cancel(p->consumerTag);
+                }
+                if (p->consumer != shared) {
+                    retire(p->consumer);
+                }
+            }
+            inports.erase(std::remove_if(inports.begin(), inports.end(), [key](const shared_ptr<AmqpInPort> &p) {
+                return p->registration->key == key;
+            }), inports.end());
+            removeRegistration(key);
+        });
+    }
+
+    virtual void start() override {
+        if (started) {
+            return;
+        }
+        started = true;
+
+        if (adaptivePrefetch) {
+            prefetchTimer.callback = [this]() {
+                if (not connected) {
+                    return;
+                }
+                for (auto &p : inports) {
+                    adjustPrefetch(p);
+                }
+            };
+            ev_timer_init(&prefetchTimer.timer, timeout_cb, 1, 1);
+            ev_timer_start(loop, &prefetchTimer.timer);
+        }
+
+        if (!statsTopic.empty()) {
+            statsTimer.callback = [this]() {
+                if (not connected) {
+                    return;
+                }
+                const string data = stats().to_json().dump();
+                publish("", statsTopic, "", false, data.data(), data.size(), SendCallback());
+            };
+            ev_timer_init(&statsTimer.timer, timeout_cb, statsPeriod, statsPeriod);
+            ev_timer_start(loop, &statsTimer.timer);
+        }
+
+        if (corking) {
+            corkFlush.callback = [this]() {
+                cork.flush();
+            };
+            ev_prepare_init(&corkFlush.prepare, prepare_cb);
+            ev_prepare_start(loop, &corkFlush.prepare);
+        }
+
+        // AMQP-CPP writes when the socket is writable, which wakes the loop, so
+        // checking once per iteration is enough to follow it
+        if (outbound.enabled()) {
+            outboundDrain.callback = [this]() {
+                if (outbound.queuedMessages() > 0) {
+                    drainOutbound();
+                }
+            };
+            ev_prepare_init(&outboundDrain.prepare, prepare_cb);
+            ev_prepare_start(loop, &outboundDrain.prepare);
+        }
+
+        loopQueue.start(loop);
+    }
+
+    virtual void launch() override {
+        start();
+        ev_run(loop, 0);
+    }
+
+    virtual EngineStats stats() override {
+        EngineStats s = collectStats();
+        s.sendsInFlight = shared->sendWindow.depth();
+        for (const auto &c : publishers) {
+            s.sendsInFlight += c->sendWindow.depth();
+        }
+        s.outboundMessages = outbound.queuedMessages();
+        s.outboundBytes = outbound.queuedBytes();
+        s.outboundDropped = outbound.dropped();
+        s.outboundRefused = outbound.refused();
+        link.snapshot(s);
+        s.messagePool = blockPoolStats(AmqpMessage::pool());
+        return s;
+    }
+
+protected:
+    string generateQueueName(const Definition &d, const Definition::Port &port) override {
+        return d.role + "." + string_to_upper_copy(port.id);
+    }
+
+private:
+    // AMQP-CPP channels go before their connection. Their callbacks hold on to the inports.
+    void closeChannels() {
+        shared->channel.reset();
+        for (auto &c : publishers) {
+            c->channel.reset();
+        }
+        for (auto &p : inports) {
+            p->consumer->channel.reset();
+        }
+        for (auto &c : retired) {
+            c->channel.reset();
+        }
+        retired.clear();
+    }
+
+    // A new connection and channels, replacing the ones that failed if any
+    void openConnection() {
+        closeChannels();
+        // Set up again once the connection is ready
+        inports.clear();
+        ev_timer_stop(loop, &channelTimer.timer);
+        connection.reset();
+        connection.reset(new AMQP::TcpConnection(&handler, address));
+
+        // Without channels of their own, sends go on the shared channel
+        open(*shared, publishers.empty());
+        for (auto &c : publishers) {
+            open(*c, true);
+        }
+
+        shared->channel->onReady([this]() {
+            connected = true;
+            backoff.reset();
+            channelBackoff.reset();
+            const int fd = connection->fileno();
+            if (corking) {
+                cork.attach(fd);
+            }
+            // Declarations and consumers go out together without waiting for
+            // each other, held back until the last of them is written
+            SocketCork burst(std::numeric_limits<size_t>::max());
+            burst.attach(fd);
+            burst.sending(0);
+            for (auto &r : registrations) {
+                setupRegistration(r.second);
+            }
+            burst.flush();
+            startDiscovery();
+            link.connected();
+        });
+    }
+
+    // Opens the channel anew on the current connection. An error on the
+    // shared channel loses the connection, on any other only that channel.
+    void open(AmqpChannel &c, bool publishing) {
+        c.channel.reset(new AMQP::TcpChannel(connection.get()));
+        c.generation = ++channelGeneration;
+        c.failed = false;
+        c.acks = AckCoalescer();
+        c.unsettled = 0;
+        c.publishSequence = 0;
+
+        AmqpChannel *ch = &c;
+        // Publish sequence numbers start at the confirm.select, before anything is published
+        if (confirms && publishing) {
+            c.channel->confirmSelect()
+                .onAck([this, ch](uint64_t tag, bool multiple) {
+                    ch->sendWindow.confirm(tag, multiple, true);
+                    drainSendWindow(*ch);
+                })
+                .onNack([this, ch](uint64_t tag, bool multiple, bool requeue) {
+                    ch->sendWindow.confirm(tag, multiple, false);
+                    drainSendWindow(*ch);
+                });
+        }
+
+        c.channel->onError([this, ch](const char *message) {
+            if (ch == shared.get()) {
+                connectionLost(message);
+            } else {
+                channelFailed(*ch, message);
+            }
+        });
+    }
+
+    // The connection or the shared channel failed. Sends wait in the outbound queue
+    // meanwhile, unconfirmed ones fail as it is unknown whether they arrived.
+    void connectionLost(const char *message) {
+        cerr << "AMQP connection lost: " << message << endl;
+        connected = false;
+        cork.attach(-1);
+        discovery.stop();
+        shared->sendWindow.fail();
+        for (auto &c : publishers) {
+            c->sendWindow.fail();
+        }
+        for (auto &p : inports) {
+            p->consumerTag.clear();
+        }
+        // Without reconnecting the connection is gone for good, so are later sends
+        if (!reconnecting) {
+            outbound.close();
+        }
+        link.lost();
+        // AMQP-CPP must not have its connection destroyed from its callbacks, the timer replaces it
+        if (reconnecting && !ev_is_active(&reconnectTimer.timer)) {
+            ev_timer_set(&reconnectTimer.timer, backoff.next(), 0);
+            ev_timer_start(loop, &reconnectTimer.timer);
+        }
+    }
+
+    // A channel of an inport or a publish channel failed, the rest of the
+    // connection carries on. Its unconfirmed sends fail, and channelTimer
+    // opens it again, as AMQP-CPP must not have it destroyed from its callbacks.
+    void channelFailed(AmqpChannel &c, const char *message) {
+        if (!connected || c.failed) {
+            return;
+        }
+        cerr << "AMQP channel failed: " << message << endl;
+        c.failed = true;
+        c.sendWindow.fail();
+        for (auto &p : inports) {
+            if (p->consumer.get() == &c) {
+                p->consumerTag.clear();
+            }
+        }
+        startChannelTimer(channelBackoff.next());
+    }
+
+    void startChannelTimer(double delay) {
+        if (!ev_is_active(&channelTimer.timer)) {
+            ev_timer_set(&channelTimer.timer, delay, 0);
+            ev_timer_start(loop, &channelTimer.timer);
+        }
+    }
+
+    void reopenChannels() {
+        if (not connected) {
+            return;
+        }
+        for (auto &c : publishers) {
+            if (!c->failed) {
+                continue;
+            }
+            open(*c, true);
+            c->channel->onReady([this]() {
+                channelBackoff.reset();
+            });
+            // In case the exchanges went away with the channel, before their declarations were done
+            for (auto &r : registrations) {
+                for (const auto &port : r.second->outports) {
+                    if (&publisherFor(port.queue) == c.get()) {
+                        setupOutPort(port);
+                    }
+                }
+            }
+        }
+        for (auto &p : inports) {
+            if (p->consumer != shared && p->consumer->failed) {
+                open(*p->consumer, false);
+                consume(p);
+            }
+        }
+        // The broker requeued the deliveries of those that failed
+        retired.erase(std::remove_if(retired.begin(), retired.end(), [this](const shared_ptr<AmqpChannel> &c) {
+            if (!c->failed && c->unsettled > 0) {
+                return false;
+            }
+            flushAcks(*c, true);
+            c->channel.reset();
+            return true;
+        }), retired.end());
+    }
+
+    // Closes the channel of an unregistered inport once its deliveries are settled.
+    // From the timer, as unregistering can happen in a handler called from the channel.
+    void retire(const shared_ptr<AmqpChannel> &c) {
+        c->retired = true;
+        retired.push_back(c);
+        if (c->unsettled == 0) {
+            startChannelTimer(0);
+        }
+    }
+
+    void settled(const shared_ptr<AmqpChannel> &c) {
+        if (c->unsettled > 0) {
+            c->unsettled--;
+        }
+        if (c->retired && c->unsettled == 0) {
+            startChannelTimer(0);
+        }
+    }
+
+    void startDiscovery() {
+        discovery.start(loop, [this](size_t key) {
+            sendDiscoveryMessage(*findRegistration(key));
+        });
+    }
+
+    void sendDiscoveryMessage(const ParticipantRegistration &r) {
+        publish("", "fbp", "", false, r.discoveryPayload.data(), r.discoveryPayload.size(), SendCallback());
+    }
+
+    // The channel sends to an exchange go on, always the same one so they stay in order
+    AmqpChannel &publisherFor(const string &exchange) const {
+        if (publishers.empty()) {
+            return *shared;
+        }
+        return *publishers[std::hash<string>()(exchange) % publishers.size()];
+    }
+
+    // Only called on the loop thread
+    void publish(const string &exchange, const string &routingKey, const string &contentType, bool compressed,
+                 const char *data, uint64_t size, const SendCallback &done) {
+        AmqpChannel &c = publisherFor(exchange);
+        if (!confirms) {
+            AMQP::Envelope env(data, size);
+            setProperties(env, contentType, compressed);
+            cork.sending(size);
+            bool ok = c.channel->publish(exchange, routingKey, env);
+            if (done) {
+                done(ok);
+            }
+            return;
+        }
+
+        if (c.sendWindow.full()) {
+            c.sendWindow.hold(exchange, routingKey, contentType, data, size, done, 0, compressed);
+            return;
+        }
+        publishConfirmed(c, exchange, routingKey, contentType, compressed, data, size, done);
+    }
+
+    void publishConfirmed(AmqpChannel &c, const string &exchange, const string &routingKey, const string &contentType,
+                          bool compressed, const char *data, uint64_t size, const SendCallback &done) {
+        AMQP::Envelope env(data, size);
+        setProperties(env, contentType, compressed);
+        cork.sending(size);
+        if (!c.channel->publish(exchange, routingKey, env)) {
+            if (done) {
+                done(false);
+            }
+            return;
+        }
+        c.sendWindow.sent(++c.publishSequence, done);
+    }
+
+    void setProperties(AMQP::Envelope &env, const string &contentType, bool compressed) {
+        if (!contentType.empty()) {
+            env.setContentType(contentType);
+        }
+        if (compressed) {
+            env.setContentEncoding(amqpCompressedEncoding);
+        }
+        if (timestampMessages) {
+            AMQP::Table headers;
+            headers.set(amqpSentHeader, AMQP::LongLongInt(wallclockMicros()));
+            env.setHeaders(headers);
+        }
+    }
+
+    void drainSendWindow(AmqpChannel &c) {
+        c.sendWindow.drain([this, &c](const SendWindow::HeldSend &s) {
+            publishConfirmed(c, s.destination, s.routingKey, s.contentType, s.compressed, s.body.data(), s.body.size(),
+                             s.done);
+        });
+    }
+
+    // On the channel its sends go on, so the exchange is declared before them
+    void setupOutPort(const Definition::Port &p) {
+        publisherFor(p.queue).channel->declareExchange(p.queue, AMQP::fanout);
+    }
+
+    void setupRegistration(const RegistrationPtr &r) {
+        for (size_t i = 0; i < r->inports.size(); i++) {
+            setupInPort(r, i);
+        }
+        for (const auto &port : r->outports) {
+            setupOutPort(port);
+        }
+    }
+
+    void setupInPort(const RegistrationPtr &r, size_t index) {
+        const auto &port = r->inports[index];
+        auto p = make_shared<AmqpInPort>();
+        p->registration = r;
+        p->consumer = shared;
+        p->queue = port.queue;
+        p->portId = port.id;
+        p->codec = findCodec(port.contentType);
+        p->counters = r->inportCounters[index].get();
+        p->prefetch = static_cast<uint16_t>(std::min(port.prefetch > 0 ? port.prefetch : defaultPrefetch, 65535));
+        p->priority = port.priority;
+        p->weight = port.weight;
+        p->maxInflated = maxDecompressedSize;
+        p->inflateAll = expectsCompressed(port);
+        if (channelPerInport) {
+            p->consumer = make_shared<AmqpChannel>(confirmWindow);
+            open(*p->consumer, false);
+        }
+        inports.push_back(p);
+        consume(p);
+    }
+
+    // On the inport's channel, so an error declaring its queue stays with it
+    void consume(const shared_ptr<AmqpInPort> &p) {
+        p->consumer->channel->declareQueue(p->queue, AMQP::durable);
+        startConsumer(p);
+    }
+
+    // The prefetch given to basic.qos applies to the consumers started after it
+    void startConsumer(const shared_ptr<AmqpInPort> &p) {
+        AMQP::TcpChannel &channel = *p->consumer->channel;
+        channel.setQos(p->prefetch);
+        channel.consume(p->queue)
+            .onSuccess([this, p](const std::string &tag) {
+                channelBackoff.reset();
+                // Unregistered before the consumer was running
+                if (!p->registration->registered) {
+                    p->consumer->channel->cancel(tag);
+                    return;
+                }
+                p->consumerTag = tag;
+            })
+            .onReceived([this, p](const AMQP::Message &message,
+                      uint64_t deliveryTag,
+                      bool redelivered) {
+                AmqpChannel &c = *p->consumer;
+                // Unregistered while the consumer is being cancelled, another consumer can have it
+                if (!p->registration->registered) {
+                    c.channel->reject(deliveryTag, AMQP::requeue);
+                    if (ackBatch > 0) {
+                        c.acks.rejected(deliveryTag);
+                    }
+                    return;
+                }
+                if (redelivered) {
+                    p->counters->redeliveries.fetch_add(1, std::memory_order_relaxed);
+                }
+                c.unsettled++;
+                const int64_t sent = AmqpMessage::sentMicros(message);
+                if (!workers && !scheduling) {
+                    AmqpMessage msg(this, p, deliveryTag, message);
+                    runHandler(*p->registration, *p->counters, msg, sent);
+                    return;
+                }
+
+                // The body is owned by AMQP-CPP and only valid during this callback
+                auto msg = new AmqpMessage(this, p, deliveryTag, PayloadBuffer(message.body(), message.bodySize()),
+                                           AmqpMessage::codecFor(p, message), AmqpMessage::maxInflatedFor(p, message),
+                                           micros_monotonic(), c.generation);
+                Handoff h{msg, sent};
+                if (workers) {
+                    // Never waits for the handlers, the prefetch bounds the backlog
+                    handoff.push(std::move(h));
+                } else {
+                    scheduled.push(shareOf(h), std::move(h));
+                }
+            });
+    }
+
+    void settleAck(AmqpChannel &c, uint64_t tag) {
+        if (ackBatch == 0) {
+            c.channel->ack(tag);
+            return;
+        }
+
+        if (c.acks.ack(tag) >= ackBatch) {
+            flushAcks(c, false);
+        }
+        if (c.acks.unsent() > 0 && !ev_is_active(&ackTimer.timer)) {
+            ev_timer_start(loop, &ackTimer.timer);
+        }
+    }
+
+    // The timer also acks completions after a gap, so a slow message does not
+    // keep the acks of later ones back until the prefetch window is exhausted
+    void flushAcks(AmqpChannel &c, bool all) {
+        if (!c.usable()) {
+            return;
+        }
+        auto tag = c.acks.takeMultiple();
+        if (tag) {
+            c.channel->ack(tag, AMQP::multiple);
+        }
+        if (all) {
+            for (auto t : c.acks.takeOutOfOrder()) {
+                c.channel->ack(t);
+            }
+        }
+    }
+
+    void flushAllAcks() {
+        flushAcks(*shared, true);
+        for (auto &p : inports) {
+            if (p->consumer != shared) {
+                flushAcks(*p->consumer, true);
+            }
+        }
+        for (auto &c : retired) {
+            flushAcks(*c, true);
+        }
+    }
+
+    void messageDone(AmqpInPort &p, int64_t received) {
+        if (!adaptivePrefetch) {
+            return;
+        }
+        const double latency = micros_monotonic() - received;
+        p.handlerLatency = p.samples == 0 ? latency : 0.8 * p.handlerLatency + 0.2 * latency;
+        p.samples++;
+    }
+
+    // Keeps enough messages in flight to cover the broker round trip at the
+    // rate the handlers are completing them (Little's law).
+    void adjustPrefetch(const shared_ptr<AmqpInPort> &port) {
+        AmqpInPort &p = *port;
+        if (p.consumerTag.empty()) {
+            return;
+        }
+
+        // A passive declare of the consumed queue is a cheap round trip
+        AMQP::TcpChannel &channel = *p.consumer->channel;
+        port->probeSent = micros_monotonic();
+        channel.declareQueue(p.queue, AMQP::passive)
+            .onSuccess([port](const std::string &, uint32_t, uint32_t) {
+                const double rtt = micros_monotonic() - port->probeSent;
+                port->roundTrip = port->roundTrip == 0 ? rtt : 0.8 * port->roundTrip + 0.2 * rtt;
+            });
+
+        if (p.samples < 10 || p.handlerLatency <= 0 || p.roundTrip <= 0) {
+            return;
+        }
+
+        const double concurrency = workers ? workers->size() : 1;
+        auto target = static_cast<int>(ceil(concurrency * (p.roundTrip + p.handlerLatency) / p.handlerLatency));
+        target = std::max(1, std::min(target, std::min(maxPrefetch, 65535)));
+
+        // Ignore small changes, restarting the consumer is not free
+        if (std::abs(target - p.prefetch) * 4 < p.prefetch) {
+            return;
+        }
+
+        p.prefetch = static_cast<uint16_t>(target);
+        p.samples = 0;
+
+        // Unacked deliveries stay valid after the consumer is cancelled
+        channel.cancel(p.consumerTag);
+        p.consumerTag.clear();
+        startConsumer(port);
+    }
+
+public:
+
+    // A compressed payload is marked with amqpCompressedEncoding, so receivers know to decompress it
+    void send(const ParticipantRegistration *r, const OutPortState &port, const char *data, uint64_t size, bool compressed,
+              const SendCallback &done) {
+        if (outbound.enabled()) {
+            queueSend(r, port, data, size, compressed, done);
+            return;
+        }
+        if (!loopQueue.onLoopThread()) {
+            auto p = &port;
+            auto body = make_shared<string>(data, size);
+            loopQueue.post(loop, [this, p, body, compressed, done]() {
+                publish(p->port.queue, "", p->contentType, compressed, body->data(), body->size(), done);
+            });
+            return;
+        }
+
+        if (debugOutput) {
+            cout << " Sending on id=" << port.port.id << ", queue=" << port.port.queue << endl;
+        }
+        publish(port.port.queue, "", port.contentType, compressed, data, size, done);
+    }
+
+    void sendBatch(const ParticipantRegistration *r, const OutPortState &port, const vector<PayloadView> &payloads,
+                   const vector<bool> &compressed, const SendCallback &done) {
+        // With the outbound queue each send is queued on its own
+        if (!outbound.enabled() && !loopQueue.onLoopThread()) {
+            auto p = &port;
+            auto bodies = copyBatch(payloads);
+            loopQueue.post(loop, [this, r, p, bodies, compressed, done]() {
+                sendBatch(r, *p, viewBatch(*bodies), compressed, done);
+            });
+            return;
+        }
+
+        const auto each = completeAll(payloads.size(), done);
+        for (size_t i = 0; i < payloads.size(); i++) {
+            send(r, port, payloads[i].data, payloads[i].size, !compressed.empty() && compressed[i], each);
+        }
+    }
+
+private:
+    // Bytes AMQP-CPP may have buffered before sends wait in the outbound queue
+    static const size_t outboundSlack = 256 * 1024;
+
+    // Sends from other threads always go through the queue, which takes the place of posting each of them
+    void queueSend(const ParticipantRegistration *r, const OutPortState &port, const char *data, uint64_t size,
+                   bool compressed, const SendCallback &done) {
+        const bool onLoop = loopQueue.onLoopThread();
+        if (onLoop && outbound.empty() && !congested(port.port.queue)) {
+            publish(port.port.queue, "", port.contentType, compressed, data, size, done);
+            return;
+        }
+        if (outbound.push(OutboundQueue::Item{r->outportStates, &port, string(data, size), done, compressed}, !onLoop)) {
+            scheduleDrain();
+        }
+    }
+
+    // Before a channel is ready AMQP-CPP would buffer every send, so sends
+    // for a publish channel being opened again wait as well
+    bool congested(const string &exchange) const {
+        if (!connected || connection->queued() >= outboundSlack) {
+            return true;
+        }
+        const AmqpChannel &c = publisherFor(exchange);
+        return c.failed || (confirms && c.sendWindow.full());
+    }
+
+    void scheduleDrain() {
+        if (drainPosted.exchange(true)) {
+            return;
+        }
+        loopQueue.post(loop, [this]() {
+            drainPosted = false;
+            drainOutbound();
+        });
+    }
+
+    void drainOutbound() {
+        outbound.drain([this](const OutboundQueue::Item &s) {
+            return !congested(s.port->port.queue);
+        }, [this](const OutboundQueue::Item &s) {
+            publish(s.port->port.queue, "", s.port->contentType, s.compressed, s.body.data(), s.body.size(), s.done);
+        });
+    }
+
+    // Tells the engine when AMQP-CPP gives up on a connection
+    struct Handler final : public AMQP::LibEvHandler {
+        explicit Handler(struct ev_loop *loop)
+            : AMQP::LibEvHandler(loop)
+        {}
+
+        virtual void onError(AMQP::TcpConnection *connection, const char *message) override {
+            if (lost) {
+                lost(connection, message);
+            }
+        }
+
+        std::function<void(AMQP::TcpConnection *, const char *)> lost;
+    };
+
+    struct ev_loop *loop;
+    const AMQP::Address address;
+    Handler handler;
+    unique_ptr<AMQP::TcpConnection> connection;
+    // Declarations, discovery, and the consumers and sends without channels of their own
+    shared_ptr<AmqpChannel> shared;
+    // With EngineConfig::publishChannels()
+    vector<shared_ptr<AmqpChannel>> publishers;
+    // Channels of unregistered inports with deliveries not settled yet
+    vector<shared_ptr<AmqpChannel>> retired;
+    // Bumped for each channel opened
+    uint64_t channelGeneration = 0;
+    EvDiscoveryTimer discovery;
+    EvLoopQueue loopQueue;
+    bool started = false;
+    bool connected = false;
+    const bool debugOutput;
+    const int defaultPrefetch;
+    const bool adaptivePrefetch;
+    const int maxPrefetch;
+    EvTimerWrapper prefetchTimer;
+    vector<shared_ptr<AmqpInPort>> inports;
+    const size_t ackBatch;
+    EvTimerWrapper ackTimer;
+    const bool confirms;
+    const size_t confirmWindow;
+    const bool channelPerInport;
+    const bool timestampMessages;
+    const uint64_t maxDecompressedSize;
+    const string statsTopic;
+    const int statsPeriod;
+    EvTimerWrapper statsTimer;
+    const bool corking;
+    SocketCork cork;
+    EvPrepareWrapper corkFlush;
+    OutboundQueue outbound;
+    EvPrepareWrapper outboundDrain;
+    std::atomic<bool> drainPosted{false};
+    const bool reconnecting;
+    Backoff backoff;
+    EvTimerWrapper reconnectTimer;
+    // Opens failed channels again and closes retired ones
+    Backoff channelBackoff;
+    EvTimerWrapper channelTimer;
+    ConnectionCounters link;
+    // Without handler threads, with EngineConfig::fairScheduling()
+    bool scheduling = false;
+    EvScheduledDeliveries<Handoff> scheduled;
+    // With handler threads
+    EvHandoff<Handoff> handoff;
+    // Declared last so handler threads are joined before the channel goes away
+    unique_ptr<Workers<Handoff>> workers;
+};
+
+// What MosquittoEngine needs from mqtt_client, so the personality can be picked at runtime
+class MqttClient {
+public:
+    virtual ~MqttClient() = default;
+
+    // True when libmosquitto does the network I/O on a thread of its own
+    virtual bool threaded() const = 0;
+    virtual int setUsernamePassword(const string &user, const string &pass) = 0;
+    virtual void max_inflight_messages_set(unsigned int max) = 0;
+    virtual int unacked_messages() = 0;
+    virtual void reconnect_delay_set(unsigned int delay, unsigned int delay_max, bool exponential) = 0;
+    virtual int reconnect() = 0;
+    virtual void connect() = 0;
+    virtual void subscribe(int *mid, const string &topic, int qos) = 0;
+    virtual void unsubscribe(int *mid, const string &topic) = 0;
+    virtual void publish(int *mid, const string &topic, int qos, bool retain, const string &s) = 0;
+    virtual void publish(int *mid, const string &topic, int qos, bool retain, int payload_len, const void *payload) = 0;
+    virtual int socket() = 0;
+    virtual bool want_write() = 0;
+    virtual int loop_read() = 0;
+    virtual int loop_write() = 0;
+    virtual int loop_misc() = 0;
+};
+
+template<trygvis::mqtt_support::mqtt_client_personality personality>
+class MqttClientT final : public MqttClient {
+public:
+    MqttClientT(mqtt_event_listener *listener, const string &host, const int port,
+                const int keep_alive, const string &client_id, const bool clean_session)
+        : client(listener, host, port, keep_alive, client_id, clean_session)
+    {
+    }
+
+    virtual bool threaded() const override {
+        return personality == trygvis::mqtt_support::mqtt_client_personality::threaded;
+    }
+
+    virtual int setUsernamePassword(const string &user, const string &pass) override {
+        return client.setUsernamePassword(user, pass);
+    }
+
+    virtual void max_inflight_messages_set(unsigned int max) override {
+        client.max_inflight_messages_set(max);
+    }
+
+    virtual int unacked_messages() override {
+        return client.unacked_messages();
+    }
+
+    virtual void reconnect_delay_set(unsigned int delay, unsigned int delay_max, bool exponential) override {
+        client.reconnect_delay_set(delay, delay_max, exponential);
+    }
+
+    virtual int reconnect() override {
+        return client.reconnect();
+    }
+
+    virtual void connect() override {
+        client.connect();
+    }
+
+    virtual void subscribe(int *mid, const string &topic, int qos) override {
+        client.subscribe(mid, topic, qos);
+    }
+
+    virtual void unsubscribe(int *mid, const string &topic) override {
+        client.unsubscribe(mid, topic);
+    }
+
+    virtual void publish(int *mid, const string &topic, int qos, bool retain, const string &s) override {
+        client.publish(mid, topic, qos, retain, s);
+    }
+
+    virtual void publish(int *mid, const string &topic, int qos, bool retain, int payload_len, const void *payload) override {
+        client.publish(mid, topic, qos, retain, payload_len, payload);
+    }
+
+    virtual int socket() override {
+        return client.socket();
+    }
+
+    virtual bool want_write() override {
+        return client.want_write();
+    }
+
+    virtual int loop_read() override {
+        return client.loop_read();
+    }
+
+    virtual int loop_write() override {
+        return client.loop_write();
+    }
+
+    virtual int loop_misc() override {
+        return client.loop_misc();
+    }
+
+private:
+    mqtt_client<personality> client;
+};
+
+static MqttClient *createMqttClient(bool threaded, mqtt_event_listener *listener, const string &host, const int port,
+                                    const int keep_alive, const string &client_id, const bool clean_session) {
+    using trygvis::mqtt_support::mqtt_client_personality;
+    if (threaded) {
+        return new MqttClientT<mqtt_client_personality::threaded>(listener, host, port, keep_alive, client_id, clean_session);
+    }
+    return new MqttClientT<mqtt_client_personality::evented>(listener, host, port, keep_alive, client_id, clean_session);
+}
+
+class MosquittoEngine final : public Engine, protected mqtt_event_listener, protected AbstractEngine<MosquittoEngine> {
+
+    struct InPortTarget {
+        shared_ptr<ParticipantRegistration> registration;
+        size_t port;
+        const Codec *codec;
+        PortCounters *counters;
+        // QoS 1 and 2 messages count against the in-flight window until settled
+        bool tracked;
+        // MQTT cannot mark compressed payloads, so only ports expecting them decompress
+        uint64_t maxInflated;
+    };
+    using InPortIndex = TopicIndex<InPortTarget>;
+
+    // Largest remaining length of an MQTT packet
+    static const uint64_t mqttMaxPacket = 268435455;
+
+    // A message on its way from the network thread to a handler
+    struct Delivery {
+        InPortTarget target;
+        PayloadBuffer payload;
+        int mid;
+    };
+
+    static InportShare shareOf(const Delivery &d) {
+        const auto &port = d.target.registration->inports[d.target.port];
+        return InportShare{d.target.counters, port.priority, port.weight, d.payload.size()};
+    }
+
+    // libmosquitto acknowledges QoS 1 and 2 deliveries to the broker before
+    // handing them over, so ack() and nack() cannot change what the broker
+    // sees. They release the message's slot in the in-flight window instead,
+    // which is what lets the broker send more.
+    struct MosquittoMessage final : public AbstractMessage, public PoolAllocated<MosquittoMessage> {
+        MosquittoMessage(MosquittoEngine *e, const struct mosquitto_message *m, bool tracked, const std::string &p, const Codec *codec,
+                         uint64_t maxInflated)
+            : AbstractMessage(static_cast<char *>(m->payload), static_cast<uint64_t>(m->payloadlen), p, codec, maxInflated)
+            , _engine(e)
+            , _mid(m->mid)
+            , _tracked(tracked)
+        {
+
+        }
+
+        MosquittoMessage(MosquittoEngine *e, PayloadBuffer &&payload, int mid, bool tracked, const std::string &p, const Codec *codec,
+                         uint64_t maxInflated)
+            : AbstractMessage(std::move(payload), p, codec, maxInflated)
+            , _engine(e)
+            , _mid(mid)
+            , _tracked(tracked)
+        {
+
+        }
+
+        ~MosquittoMessage() {
+            if (dropped()) {
+                nack();
+            }
+        }
+
+        MosquittoEngine *_engine;
+        int _mid;
+        bool _tracked;
+
+        // libmosquitto frees the payload after the callback, so a borrowed payload is copied
+        virtual std::unique_ptr<Message> retain() override {
+            const uint64_t maxInflated = inflateLimit();
+            auto m = new MosquittoMessage(_engine, takePayload(), _mid, _tracked, _port, _codec, maxInflated);
+            m->countOn(_counters);
+            _tracked = false;
+            return std::unique_ptr<Message>(m);
+        }
+
+        virtual void ack() override {
+            countSettled(true);
+            settle();
+        }
+
+        // MQTT has no redelivery, the message is dropped
+        virtual void nack() override {
+            countSettled(false);
+            if (_engine->_debugOutput) {
+                cerr << "MosquittoMessage.nack(): dropping message " << _mid << " on port " << _port << endl;
+            }
+            settle();
+        }
+
+    private:
+        void settle() {
+            if (_tracked) {
+                _tracked = false;
+                _engine->settle();
+            }
+        }
+    };
+
+public:
+    MosquittoEngine(const EngineConfig config, const string &host, const int port,
+                    const int keep_alive, const string &client_id, const bool clean_session, const std::string &user, const std::string &pw)
+        : _debugOutput(config.debugOutput())
+        , loop(EV_DEFAULT)
+        , connected(false)
+        , discovery(config)
+        , confirms(config.publisherConfirms())
+        , sendWindow(static_cast<size_t>(std::max(config.confirmWindow(), 1)))
+        , inportIndex(make_shared<InPortIndex>())
+        , maxInflight(std::max(config.maxInflight(), 0))
+        , confirmedSends(confirms)
+        , unsettled(0)
+        , inflightWait(keep_alive > 0 ? keep_alive * 500 : 1000)
+        , maxDecompressedSize(config.maxDecompressedSize())
+        , statsTopic(config.statsTopic())
+        , statsPeriod(config.statsPeriod())
+        , corking(config.cork() && !config.networkThread())
+        , cork(static_cast<size_t>(std::max(config.corkBudget(), 1)))
+        , outbound(config)
+        , reconnecting(config.reconnect())
+        , backoff(config.reconnectDelay(), config.maxReconnectDelay())
+    {
+        const size_t handoffCapacity = static_cast<size_t>(std::max(config.handoffCapacity(), 1));
+        const auto handle = [this](Delivery &d) {
+            deliver(d);
+        };
+        if (config.handlerThreads() > 0 && config.fairScheduling()) {
+            workers.reset(new ScheduledWorkers<Delivery>(handoffCapacity, config.handlerThreads(), shareOf, handle));
+        } else if (config.handlerThreads() > 0) {
+            workers.reset(new RingWorkers<Delivery>(handoffCapacity, config.handlerThreads(), handle));
         } else {
-            host = s;
+            if (config.fairScheduling()) {
+                scheduling = true;
+                scheduled.start(loop, handoffCapacity, handle);
+            }
+            if (config.networkThread()) {
+                loopDeliveries.reset(new MpmcRing<Delivery>(handoffCapacity));
+                deliveryAsync.callback = [this]() {
+                    Delivery d;
+                    while (loopDeliveries->tryPop(d)) {
+                        if (scheduling) {
+                            scheduled.push(shareOf(d), std::move(d));
+                        } else {
+                            deliver(d);
+                        }
+                    }
+                };
+                ev_async_init(&deliveryAsync.async, async_cb);
+                ev_async_start(loop, &deliveryAsync.async);
+            }
+        }
+        if (workers && !config.networkThread()) {
+            handoff.start(loop, *workers, [this]() {
+                resumeReading();
+            });
+        }
+        // Work posted from other threads waits for the loop, registrations may
+        // still be added on this thread until then
+        loopQueue.start(loop);
+
+        client.reset(createMqttClient(config.networkThread(), this, host, port, keep_alive, client_id, clean_session));
+        if (user.size()) {
+            client->setUsernamePassword(user, pw);
+        }
+        client->max_inflight_messages_set(static_cast<unsigned int>(maxInflight));
+        reconnectTimer.callback = [this]() {
+            const int rc = client->reconnect();
+            if (rc != MOSQ_ERR_SUCCESS) {
+                on_msg("mosquitto_reconnect: " + error_to_string(rc));
+                connectionLost();
+            }
+        };
+        ev_timer_init(&reconnectTimer.timer, timeout_cb, 0, 0);
+        if (reconnecting && client->threaded()) {
+            client->reconnect_delay_set(static_cast<unsigned int>(std::max(1.0, std::ceil(config.reconnectDelay()))),
+                                        static_cast<unsigned int>(std::max(1.0, std::ceil(config.maxReconnectDelay()))), true);
+        }
+        try {
+            client->connect();
+        } catch (mqtt_error &e) {
+            // Started without a broker, keep trying
+            if (!reconnecting) {
+                throw;
+            }
+            on_msg(string("Could not connect: ") + e.what());
+            connectionLost();
+        }
+    }
+
+    virtual ~MosquittoEngine() {
+        // Stop the network thread and the handlers before the state they use goes away
+        reconnecting = false;
+        outbound.close();
+        closeInflight();
+        client.reset();
+        workers.reset();
+        scheduled.stop();
+        handoff.stop();
+        if (loopQueue.running) {
+            ev_async_stop(loop, &loopQueue.async);
+        }
+    }
+
+    virtual Participant *registerParticipant(const Definition &definition) override {
+        Definition d = validateDefinitionFromUser(definition);
+        auto r = makeRegistration(this, d);
+        loopQueue.post(loop, [this, r]() {
+            addRegistration(r);
+            updateIndex([this, &r](InPortIndex &index) {
+                for (size_t i = 0; i < r->inports.size(); i++) {
+                    auto &port = r->inports[i];
+                    index.add(port.queue, InPortTarget{r, i, findCodec(port.contentType),
+                                                       r->inportCounters[i].get(), port.qos > 0,
+                                                       expectsCompressed(port) ? maxDecompressedSize : 0});
+                }
+            });
+            for (auto &port : r->outports) {
+                confirmedSends = confirmedSends || port.qos > 0;
+            }
+            discovery.add(r->key);
+            if (connected) {
+                subscribe(*r);
+            }
+        });
+        return r.get();
+    }
+
+    virtual void unregisterParticipant(Participant *participant) override {
+        if (!unregister(this, participant)) {
+            return;
+        }
+        const size_t key = static_cast<ParticipantRegistration *>(participant)->key;
+        loopQueue.post(loop, [this, key]() {
+            discovery.remove(key);
+            updateIndex([key](InPortIndex &index) {
+                index.removeIf([key](const InPortTarget &t) {
+                    return t.registration->key == key;
+                });
+            });
+            auto r = registrations.at(key);
+            removeRegistration(key);
+            if (connected) {
+                unsubscribe(*r);
+            }
+        });
+    }
+
+    // MQTT has nowhere to mark a payload as compressed, see InPortTarget::maxInflated
+    void send(const ParticipantRegistration *r, const OutPortState &port, const char *data, uint64_t len, bool compressed,
+              const SendCallback &done) {
+        // A PUBLISH packet holds at most 256 MiB, with the topic and packet id
+        if (len + port.port.queue.size() + 4 > mqttMaxPacket) {
+            cerr << "MQTT message of " << len << " bytes on " << port.port.queue
+                 << " is too large, use Participant::sendStream()" << endl;
+            if (done) {
+                done(false);
+            }
+            return;
+        }
+        const int qos = qosFor(port);
+        if (outbound.enabled()) {
+            queueSend(r, port, qos, data, len, done);
+            return;
+        }
+
+        // The send window is loop thread state, and without the network thread
+        // libmosquitto writes from the publishing thread
+        if ((qos > 0 || !client->threaded()) && !loopQueue.onLoopThread()) {
+            auto p = &port;
+            auto body = make_shared<string>(data, len);
+            loopQueue.post(loop, [this, r, p, body, compressed, done]() {
+                send(r, *p, body->data(), body->size(), compressed, done);
+            });
+            return;
+        }
+        publish(port.port.queue, qos, data, len, done);
+    }
+
+    void sendBatch(const ParticipantRegistration *r, const OutPortState &port, const vector<PayloadView> &payloads,
+                   const vector<bool> &compressed, const SendCallback &done) {
+        const int qos = qosFor(port);
+        // With the outbound queue each send is queued on its own
+        if (!outbound.enabled() && (qos > 0 || !client->threaded()) && !loopQueue.onLoopThread()) {
+            auto p = &port;
+            auto bodies = copyBatch(payloads);
+            loopQueue.post(loop, [this, r, p, bodies, compressed, done]() {
+                sendBatch(r, *p, viewBatch(*bodies), compressed, done);
+            });
+            return;
+        }
+
+        const auto each = completeAll(payloads.size(), done);
+        for (const auto &payload : payloads) {
+            send(r, port, payload.data, payload.size, false, each);
+        }
+    }
+
+    // With the network thread only discovery and posted work run on the loop
+    virtual void start() override {
+        if (started) {
+            return;
+        }
+        started = true;
+        loopQueue.start(loop);
+
+        if (!statsTopic.empty()) {
+            statsTimer.callback = [this]() {
+                if (not connected) {
+                    return;
+                }
+                const string data = stats().to_json().dump();
+                publish(statsTopic, 0, data.data(), data.size(), SendCallback());
+            };
+            ev_timer_init(&statsTimer.timer, timeout_cb, statsPeriod, statsPeriod);
+            ev_timer_start(loop, &statsTimer.timer);
+        }
+
+        if (client->threaded()) {
+            return;
+        }
+
+        miscTimer.callback = [this]() {
+            client->loop_misc();
+        };
+        ev_timer_init(&miscTimer.timer, timeout_cb, 1, 1);
+        ev_timer_start(loop, &miscTimer.timer);
+
+        readWatcher.callback = [this]() {
+            readPackets();
+        };
+        writeWatcher.callback = [this]() {
+            // The subscriptions made after connecting go out together
+            SocketCork burst(std::numeric_limits<size_t>::max());
+            if (resubscribing) {
+                resubscribing = false;
+                burst.attach(watchedSocket);
+                burst.sending(0);
+            }
+            cork.sending(0);
+            checkLoopResult("mosquitto_loop_write", client->loop_write());
+            burst.flush();
+            if (!client->want_write()) {
+                ev_io_stop(loop, &writeWatcher.io);
+            }
+        };
+        // Publishes made by handlers and timers are queued by libmosquitto, watch
+        // for writability only while something is queued
+        writeInterest.callback = [this]() {
+            // Until reconnecting, the client may still have the failed socket
+            if (!ev_is_active(&reconnectTimer.timer)) {
+                watchSocket();
+            }
+            if (outbound.queuedMessages() > 0) {
+                drainOutbound();
+            }
+            cork.flush();
+            if (client->want_write() && !ev_is_active(&writeWatcher.io)) {
+                ev_io_start(loop, &writeWatcher.io);
+            }
+        };
+        ev_prepare_init(&writeInterest.prepare, prepare_cb);
+        ev_prepare_start(loop, &writeInterest.prepare);
+
+        watchSocket();
+    }
+
+    // A loop error stops the loop, for every engine on it, and is thrown here
+    // if this engine is the one running it
+    virtual void launch() override {
+        start();
+        ev_run(loop, 0);
+
+        if (!loopError.empty()) {
+            throw mqtt_error(loopError, loopErrorCode);
+        }
+    }
+
+    virtual EngineStats stats() override {
+        EngineStats s = collectStats();
+        s.sendsInFlight = sendWindow.depth();
+        s.outboundMessages = outbound.queuedMessages();
+        s.outboundBytes = outbound.queuedBytes();
+        s.outboundDropped = outbound.dropped();
+        s.outboundRefused = outbound.refused();
+        link.snapshot(s);
+        s.messagePool = blockPoolStats(MosquittoMessage::pool());
+        return s;
+    }
+
+private:
+    int qosFor(const OutPortState &port) const {
+        return port.port.qos > 0 ? port.port.qos : (confirms ? 1 : 0);
+    }
+
+    // On the loop thread, or on any thread for QoS 0 with the network thread
+    void publish(const string &topic, int qos, const char *data, uint64_t len, const SendCallback &done) {
+        if (qos == 0) {
+            cork.sending(len);
+            try {
+                client->publish(nullptr, topic, 0, false, static_cast<int>(len), data);
+            } catch (mqtt_error &e) {
+                publishFailed(e, done);
+                return;
+            }
+            if (done) {
+                done(true);
+            }
+            return;
+        }
+
+        if (sendWindow.full()) {
+            sendWindow.hold(topic, "", "", data, len, done, qos);
+            return;
+        }
+        publishConfirmed(topic, qos, data, len, done);
+    }
+
+    // Sends from other threads always go through the queue, so only the loop
+    // thread looks at the connection state and sends keep their order
+    void queueSend(const ParticipantRegistration *r, const OutPortState &port, int qos, const char *data, uint64_t len,
+                   const SendCallback &done) {
+        const bool onLoop = loopQueue.onLoopThread();
+        if (onLoop && outbound.empty() && !congested(qos)) {
+            publish(port.port.queue, qos, data, len, done);
+            return;
+        }
+        if (outbound.push(OutboundQueue::Item{r->outportStates, &port, string(data, len), done, false}, !onLoop)) {
+            scheduleDrain();
+        }
+    }
+
+    // libmosquitto counts the messages it has not written yet, and QoS 1 and 2
+    // ones until the broker confirms them
+    bool congested(int qos) {
+        return !connected || client->unacked_messages() >= outboundSlack + static_cast<int>(sendWindow.inFlight()) ||
+               (qos > 0 && sendWindow.full());
+    }
+
+    void scheduleDrain() {
+        if (drainPosted.exchange(true)) {
+            return;
+        }
+        loopQueue.post(loop, [this]() {
+            drainPosted = false;
+            drainOutbound();
+        });
+    }
+
+    void drainOutbound() {
+        outbound.drain([this](const OutboundQueue::Item &s) {
+            return !congested(qosFor(*s.port));
+        }, [this](const OutboundQueue::Item &s) {
+            publish(s.port->port.queue, qosFor(*s.port), s.body.data(), s.body.size(), s.done);
+        });
+    }
+
+    // Follows the client's socket, which changes when it reconnects
+    void watchSocket() {
+        const int fd = client->socket();
+        if (fd == watchedSocket) {
+            return;
+        }
+        ev_io_stop(loop, &readWatcher.io);
+        ev_io_stop(loop, &writeWatcher.io);
+        watchedSocket = fd;
+        cork.attach(corking ? fd : -1);
+        if (fd < 0) {
+            return;
+        }
+        ev_io_init(&readWatcher.io, io_cb, fd, EV_READ);
+        ev_io_init(&writeWatcher.io, io_cb, fd, EV_WRITE);
+        if (!readPaused) {
+            ev_io_start(loop, &readWatcher.io);
+        }
+    }
+
+    bool inflightFull() const {
+        return maxInflight > 0 && unsettled.load() >= maxInflight;
+    }
+
+    // A tracked message was acked or nacked, on any thread
+    void settle() {
+        if (client->threaded()) {
+            {
+                std::lock_guard<std::mutex> lock(inflightMutex);
+                unsettled--;
+            }
+            inflightCv.notify_one();
+            return;
+        }
+        unsettled--;
+        loopQueue.post(loop, [this]() {
+            resumeReading();
+        });
+    }
+
+    // Reading stops while the inflight window is full or the handler threads
+    // have a backlog, it would only add to what is waiting
+    bool readBlocked() const {
+        return inflightFull() || handoff.backedUp();
+    }
+
+    void resumeReading() {
+        if (readPaused && !readBlocked()) {
+            readPaused = false;
+            if (watchedSocket >= 0) {
+                ev_io_start(loop, &readWatcher.io);
+            }
+        }
+    }
+
+    // Counts a tracked message against the window. The network thread waits
+    // for room, which holds back the broker like a paused read watcher does.
+    // It also sends the keepalive pings, so it goes on over the window after
+    // half the keepalive interval, and at once when the engine goes away.
+    void track(const InPortTarget &t) {
+        if (!t.tracked) {
+            return;
+        }
+        if (client->threaded() && maxInflight > 0) {
+            std::unique_lock<std::mutex> lock(inflightMutex);
+            inflightCv.wait_for(lock, inflightWait, [this]() { return inflightClosed || !inflightFull(); });
+        }
+        unsettled++;
+    }
+
+    // Lets the network thread go on, so it can be joined
+    void closeInflight() {
+        {
+            std::lock_guard<std::mutex> lock(inflightMutex);
+            inflightClosed = true;
+        }
+        inflightCv.notify_all();
+    }
+
+    // libmosquitto reads one packet per call, keep going while data is buffered
+    // in the kernel instead of waiting for another loop iteration per packet
+    void readPackets() {
+        for (int i = 0; i < maxPacketsPerRead; i++) {
+            if (readBlocked()) {
+                // Settling a message or the handlers making room starts reading again
+                readPaused = true;
+                ev_io_stop(loop, &readWatcher.io);
+                return;
+            }
+            int rc = client->loop_read();
+            if (!checkLoopResult("mosquitto_loop_read", rc)) {
+                return;
+            }
+            int available = 0;
+            const int fd = client->socket();
+            if (fd < 0 || ioctl(fd, FIONREAD, &available) != 0 || available <= 0) {
+                return;
+            }
+        }
+    }
+
+    // Sends wait in the outbound queue until the connection is back. Unconfirmed
+    // ones fail, as it is unknown whether they arrived. Without the network
+    // thread, the failed socket is dropped and reconnecting is up to the engine.
+    void connectionLost() {
+        connected = false;
+        discovery.stop();
+        sendWindow.fail();
+        // libmosquitto's network thread always reconnects, without it and without
+        // reconnecting the connection is gone for good, so are later sends
+        if (!reconnecting && !client->threaded()) {
+            outbound.close();
+        }
+        link.lost();
+        if (client->threaded() || !reconnecting || ev_is_active(&reconnectTimer.timer)) {
+            return;
+        }
+        if (watchedSocket >= 0) {
+            ev_io_stop(loop, &readWatcher.io);
+            ev_io_stop(loop, &writeWatcher.io);
+            watchedSocket = -1;
+        }
+        cork.attach(-1);
+        resubscribing = false;
+        ev_timer_set(&reconnectTimer.timer, backoff.next(), 0);
+        ev_timer_start(loop, &reconnectTimer.timer);
+    }
+
+    // Errors cannot be thrown through libev, so stop the loop and throw from
+    // launch(), unless it is the connection that failed and it is reconnected
+    bool checkLoopResult(const string &function, int rc) {
+        if (rc == MOSQ_ERR_SUCCESS) {
+            return true;
+        }
+        if (reconnecting && rc != MOSQ_ERR_NOMEM && rc != MOSQ_ERR_INVAL) {
+            on_msg(function + ": " + error_to_string(rc));
+            connectionLost();
+            return false;
+        }
+        loopError = function + ": " + error_to_string(rc);
+        loopErrorCode = rc;
+        ev_break(loop, EVBREAK_ALL);
+        return false;
+    }
+
+protected:
+    string generateQueueName(const Definition &d, const Definition::Port &port) override {
+        return d.role + "." + string_to_upper_copy(port.id);
+    }
+
+    virtual bool msg_enabled() const override {
+        return _debugOutput;
+    }
+
+    virtual void on_msg(const string &msg) override {
+        if (!_debugOutput) {
+            return;
+        }
+
+        cout << "mqtt: " << msg << endl;
+    }
+
+    virtual void on_message(const struct mosquitto_message *message) override {
+        const auto index = std::atomic_load(&inportIndex);
+        index->match(message->topic, [this, message](const InPortTarget &t) {
+            if (!t.registration->registered) {
+                return;
+            }
+            track(t);
+            if (!workers && !loopDeliveries && !scheduling) {
+                auto &r = *t.registration;
+                MosquittoMessage m(this, message, t.tracked, r.inports[t.port].id, t.codec, t.maxInflated);
+
+                runHandler(r, *t.counters, m);
+                return;
+            }
+
+            // libmosquitto frees the payload when the callback returns
+            Delivery d{t, PayloadBuffer(static_cast<const char *>(message->payload), static_cast<size_t>(message->payloadlen)), message->mid};
+            // The loop thread must not wait for the handlers, the network thread may
+            if (handoff.active()) {
+                handoff.push(std::move(d));
+                return;
+            }
+            if (workers) {
+                workers->push(std::move(d));
+                return;
+            }
+            if (!loopDeliveries) {
+                scheduled.push(shareOf(d), std::move(d));
+                return;
+            }
+            while (!loopDeliveries->tryPush(std::move(d))) {
+                std::this_thread::yield();
+            }
+            ev_async_send(loop, &deliveryAsync.async);
+        });
+    }
+
+    // QoS 1 and 2 publishes complete when the broker's PUBACK or PUBCOMP arrives
+    virtual void on_publish(int mid) override {
+        // With the network thread nothing else tells the loop that libmosquitto has caught up
+        if (client->threaded() && outbound.queuedMessages() > 0) {
+            scheduleDrain();
+        }
+        if (!confirmedSends) {
+            return;
+        }
+        loopQueue.post(loop, [this, mid]() {
+            sendWindow.confirm(static_cast<uint64_t>(mid), false, true);
+            sendWindow.drain([this](const SendWindow::HeldSend &s) {
+                publishConfirmed(s.destination, s.qos, s.body.data(), s.body.size(), s.done);
+            });
+        });
+    }
+
+    virtual void on_disconnect(bool was_connecting, bool was_connected, int rc) override {
+        loopQueue.post(loop, [this]() {
+            connectionLost();
+        });
+    }
+
+    virtual void on_connect(int rc) override {
+        loopQueue.post(loop, [this, rc]() {
+            if (rc != MOSQ_ERR_SUCCESS) {
+                connectionLost();
+                return;
+            }
+            connected = true;
+            backoff.reset();
+            // Subscribing does not wait for the broker's replies, and without
+            // the network thread the writes are corked into one burst
+            resubscribing = !client->threaded();
+            for (auto &r : registrations) {
+                subscribe(*r.second);
+            }
+            discovery.start(loop, [this](size_t key) {
+                sendDiscoveryMessage(*findRegistration(key));
+            });
+            link.connected();
+            drainOutbound();
+        });
+    }
+
+private:
+    void deliver(Delivery &d) {
+        auto &r = *d.target.registration;
+        if (!r.registered) {
+            // MQTT has no redelivery, the message is dropped
+            if (d.target.tracked) {
+                settle();
+            }
+            return;
+        }
+        MosquittoMessage m(this, std::move(d.payload), d.mid, d.target.tracked, r.inports[d.target.port].id, d.target.codec,
+                           d.target.maxInflated);
+
+        runHandler(r, *d.target.counters, m);
+    }
+
+    void subscribe(const ParticipantRegistration &r) {
+        for (auto &p : r.inports) {
+            on_msg("Connecting port " + p.id + " to mqtt topic " + p.queue);
+            client->subscribe(nullptr, p.queue, p.qos);
+        }
+    }
+
+    // Topics other participants are still subscribed to are kept
+    void unsubscribe(const ParticipantRegistration &removed) {
+        for (auto &p : removed.inports) {
+            bool shared = false;
+            for (auto &r : registrations) {
+                for (auto &other : r.second->inports) {
+                    shared = shared || other.queue == p.queue;
+                }
+            }
+            if (!shared) {
+                on_msg("Disconnecting port " + p.id + " from mqtt topic " + p.queue);
+                client->unsubscribe(nullptr, p.queue);
+            }
+        }
+    }
+
+    // The network thread matches topics without locking, so with it the
+    // index is replaced by an updated copy instead of changed in place
+    template<typename F>
+    void updateIndex(F f) {
+        if (!client->threaded()) {
+            f(*inportIndex);
+            return;
+        }
+        auto copy = make_shared<InPortIndex>(*inportIndex);
+        f(*copy);
+        std::atomic_store(&inportIndex, std::move(copy));
+    }
+
+    void sendDiscoveryMessage(const ParticipantRegistration &r) {
+        publish("fbp", 0, r.discoveryPayload.data(), r.discoveryPayload.size(), SendCallback());
+    }
+
+    void publishConfirmed(const string &topic, int qos, const char *data, uint64_t len, const SendCallback &done) {
+        int mid = 0;
+        try {
+            cork.sending(len);
+            client->publish(&mid, topic, qos, false, static_cast<int>(len), data);
+        } catch (mqtt_error &e) {
+            publishFailed(e, done);
+            return;
+        }
+        sendWindow.sent(static_cast<uint64_t>(mid), done);
+    }
+
+    // Sends run inside libev callbacks, which errors cannot be thrown through.
+    // The send fails, and on the loop thread a failed connection is handled
+    // as for reads. Elsewhere the network thread finds it and reconnects.
+    void publishFailed(const mqtt_error &e, const SendCallback &done) {
+        if (done) {
+            done(false);
+        }
+        if (loopQueue.onLoopThread()) {
+            checkLoopResult("mosquitto_publish", e.error);
+        }
+    }
+
+private:
+    static const int maxPacketsPerRead = 100;
+    // Messages libmosquitto may have queued, beyond those waiting for confirmation, before sends wait in the outbound queue
+    static const int outboundSlack = 64;
+
+    const bool _debugOutput;
+    struct ev_loop *loop;
+    unique_ptr<MqttClient> client;
+    bool connected;
+    EvDiscoveryTimer discovery;
+    EvTimerWrapper miscTimer;
+    EvIoWrapper readWatcher;
+    EvIoWrapper writeWatcher;
+    EvPrepareWrapper writeInterest;
+    int watchedSocket = -1;
+    string loopError;
+    int loopErrorCode = 0;
+    const bool confirms;
+    SendWindow sendWindow;
+    shared_ptr<InPortIndex> inportIndex;
+    const int maxInflight;
+    // Whether any send waits for the broker, publisherConfirms() or an outport with QoS > 0
+    bool confirmedSends;
+    // Received QoS 1 and 2 messages not yet acked or nacked
+    atomic<int> unsettled;
+    bool readPaused = false;
+    std::mutex inflightMutex;
+    std::condition_variable inflightCv;
+    // Longest the network thread waits for room in the window, well within the keepalive
+    const std::chrono::milliseconds inflightWait;
+    bool inflightClosed = false;
+    const uint64_t maxDecompressedSize;
+    const string statsTopic;
+    const int statsPeriod;
+    EvTimerWrapper statsTimer;
+    const bool corking;
+    SocketCork cork;
+    OutboundQueue outbound;
+    std::atomic<bool> drainPosted{false};
+    // Cleared when the engine goes away
+    bool reconnecting;
+    Backoff backoff;
+    EvTimerWrapper reconnectTimer;
+    ConnectionCounters link;
+    // Set after connecting, the next write is corked
+    bool resubscribing = false;
+    EvLoopQueue loopQueue;
+    bool started = false;
+    // Where the network thread hands messages over: handler threads if there
+    // are any, otherwise the loop thread
+    unique_ptr<Workers<Delivery>> workers;
+    // With handler threads but without the network thread
+    EvHandoff<Delivery> handoff;
+    unique_ptr<MpmcRing<Delivery>> loopDeliveries;
+    EvAsyncWrapper deliveryAsync;
+    // Without handler threads, with EngineConfig::fairScheduling()
+    bool scheduling = false;
+    EvScheduledDeliveries<Delivery> scheduled;
+};
+
+class InprocEngine;
+
+struct InprocDelivery {
+    shared_ptr<ParticipantRegistrationT<InprocEngine>> registration;
+    size_t port;
+    const Codec *codec;
+    PortCounters *counters;
+    shared_ptr<const string> payload;
+    int64_t sent;
+    // See AbstractMessage, 0 leaves the payload as it is
+    uint64_t maxInflated;
+};
+
+// Where senders on any thread leave deliveries for an InprocEngine's loop.
+// The broker's routes share it with the engine, so a sender still holding
+// routes from before the engine went away finds it closed, and its
+// deliveries are dropped.
+class InprocInbox {
+public:
+    InprocInbox(struct ev_loop *loop, std::function<void (void)> ready)
+        : loop(loop)
+    {
+        async.callback = std::move(ready);
+        ev_async_init(&async.async, async_cb);
+        ev_async_start(loop, &async.async);
+    }
+
+    InprocInbox(const InprocInbox &) = delete;
+    InprocInbox &operator=(const InprocInbox &) = delete;
+
+    void post(InprocDelivery &&d) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed) {
+            return;
+        }
+        deliveries.push_back(std::move(d));
+        ev_async_send(loop, &async.async);
+    }
+
+    // Loop thread only, `into` is empty and keeps its capacity
+    void take(vector<InprocDelivery> &into) {
+        std::lock_guard<std::mutex> lock(mutex);
+        into.swap(deliveries);
+    }
+
+    // Once it returns, no sender touches the engine's loop
+    void close() {
+        vector<InprocDelivery> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            ev_async_stop(loop, &async.async);
+            dropped.swap(deliveries);
+        }
+    }
+
+private:
+    struct ev_loop *const loop;
+    EvAsyncWrapper async;
+    std::mutex mutex;
+    vector<InprocDelivery> deliveries;
+    bool closed = false;
+};
+
+// Routes messages between the InprocEngines of one process. Every queue bound to
+// a topic gets each message sent to it, and the consumers of a queue take
+// turns, as on a broker. Queues are named as AMQP names them, so the instances
+// of a role share one per inport.
+class InprocBroker {
+public:
+    struct Subscriber {
+        shared_ptr<InprocInbox> inbox;
+        shared_ptr<ParticipantRegistrationT<InprocEngine>> registration;
+        size_t port;
+        const Codec *codec;
+        PortCounters *counters;
+        // See EngineConfig::maxDecompressedSize(), and whether payloads not
+        // marked as compressed are decompressed too
+        uint64_t maxInflated;
+        bool inflateAll;
+    };
+
+    // The process-wide broker for an inproc:// URL, engines created with the same URL share it
+    static shared_ptr<InprocBroker> named(const string &name) {
+        static std::mutex registryMutex;
+        static map<string, weak_ptr<InprocBroker>> registry;
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto &entry = registry[name];
+        auto broker = entry.lock();
+        if (!broker) {
+            broker = make_shared<InprocBroker>();
+            entry = broker;
+        }
+        return broker;
+    }
+
+    InprocBroker()
+        : routes(make_shared<const Routes>())
+    {}
+
+    void subscribe(const string &topic, const string &queue, const Subscriber &s) {
+        update([&](Routes &r) {
+            auto &groups = r[topic];
+            for (auto &g : groups) {
+                if (g.queue == queue) {
+                    g.subscribers.push_back(s);
+                    return;
+                }
+            }
+            groups.push_back(Group{queue, {s}, make_shared<atomic<size_t>>(0)});
+        });
+    }
+
+    void unsubscribe(const InprocInbox *inbox) {
+        unsubscribeIf([inbox](const Subscriber &s) {
+            return s.inbox.get() == inbox;
+        });
+    }
+
+    void unsubscribe(const ParticipantRegistrationT<InprocEngine> *registration) {
+        unsubscribeIf([registration](const Subscriber &s) {
+            return s.registration.get() == registration;
+        });
+    }
+
+    // Calls f(subscriber) once for every queue bound to the topic
+    template<typename F>
+    void route(const string &topic, F f) const {
+        const auto r = std::atomic_load(&routes);
+        auto it = r->find(topic);
+        if (it == r->end()) {
+            return;
+        }
+        for (const auto &g : it->second) {
+            const size_t turn = g.next->fetch_add(1, std::memory_order_relaxed);
+            f(g.subscribers[turn % g.subscribers.size()]);
+        }
+    }
+
+private:
+    struct Group {
+        string queue;
+        vector<Subscriber> subscribers;
+        // Shared with the copies made by update(), so turns carry over
+        shared_ptr<atomic<size_t>> next;
+    };
+    using Routes = unordered_map<string, vector<Group>>;
+
+    template<typename P>
+    void unsubscribeIf(P pred) {
+        update([&pred](Routes &r) {
+            for (auto &topic : r) {
+                auto &groups = topic.second;
+                for (auto &g : groups) {
+                    g.subscribers.erase(std::remove_if(g.subscribers.begin(), g.subscribers.end(), pred),
+                                        g.subscribers.end());
+                }
+                groups.erase(std::remove_if(groups.begin(), groups.end(),
+                    [](const Group &g) { return g.subscribers.empty(); }), groups.end());
+            }
+        });
+    }
+
+    // Sends read the routes without locking, changes replace them with an updated copy
+    template<typename F>
+    void update(F f) {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        auto copy = make_shared<Routes>(*std::atomic_load(&routes));
+        f(*copy);
+        std::atomic_store(&routes, shared_ptr<const Routes>(std::move(copy)));
+    }
+
+    std::mutex updateMutex;
+    shared_ptr<const Routes> routes;
+};
+
+// Delivers messages between participants in the same process, without a
+// broker. Sends are queued to the receiving engine's loop, so handlers never
+// run inside send(). Topics are the port queues, named as for AMQP and MQTT.
+class InprocEngine final : public Engine, protected AbstractEngine<InprocEngine> {
+
+    // Fanout receivers share one copy of the payload
+    struct InprocMessage final : public AbstractMessage, public PoolAllocated<InprocMessage> {
+        InprocMessage(shared_ptr<const string> payload, const std::string &p, const Codec *codec, uint64_t maxInflated)
+            : AbstractMessage(payload->data(), payload->size(), p, codec, maxInflated)
+            , _payload(std::move(payload))
+        {
+
+        }
+
+        ~InprocMessage() {
+            if (dropped()) {
+                nack();
+            }
+        }
+
+        shared_ptr<const string> _payload;
+
+        // The payload is already shared, so retaining does not copy it
+        virtual std::unique_ptr<Message> retain() override {
+            auto m = new InprocMessage(_payload, _port, _codec, _maxInflated);
+            m->countOn(_counters);
+            return std::unique_ptr<Message>(m);
+        }
+
+        virtual void ack() override {
+            countSettled(true);
+        }
+
+        // Nothing redelivers in process, the message is dropped
+        virtual void nack() override {
+            countSettled(false);
+        }
+    };
+
+    using Delivery = InprocDelivery;
+
+    static InportShare shareOf(const Delivery &d) {
+        const auto &port = d.registration->inports[d.port];
+        return InportShare{d.counters, port.priority, port.weight, d.payload->size()};
+    }
+
+public:
+    InprocEngine(const EngineConfig &config, const string &name)
+        : loop(EV_DEFAULT)
+        , broker(InprocBroker::named(name))
+        , debugOutput(config.debugOutput())
+        , discovery(config)
+        , statsTopic(config.statsTopic())
+        , maxDecompressedSize(config.maxDecompressedSize())
+    {
+        const auto handle = [this](Delivery &d) {
+            deliver(d);
+        };
+        const size_t handoffCapacity = static_cast<size_t>(std::max(config.handoffCapacity(), 1));
+        if (config.handlerThreads() > 0 && config.fairScheduling()) {
+            workers.reset(new ScheduledWorkers<Delivery>(handoffCapacity, config.handlerThreads(), shareOf, handle));
+        } else if (config.handlerThreads() > 0) {
+            workers.reset(new RingWorkers<Delivery>(handoffCapacity, config.handlerThreads(), handle));
+        } else if (config.fairScheduling()) {
+            scheduling = true;
+            scheduled.start(loop, handoffCapacity, handle);
+        }
+        if (workers) {
+            handoff.start(loop, *workers);
+        }
+        inbox = make_shared<InprocInbox>(loop, [this]() {
+            deliverInbox();
+        });
+
+        statsTimer.callback = [this]() {
+            const string data = stats().to_json().dump();
+            publish(statsTopic, data.data(), data.size());
+        };
+        ev_timer_init(&statsTimer.timer, timeout_cb, config.statsPeriod(), config.statsPeriod());
+        // As for the other engines, work posted from other threads waits for the loop
+        loopQueue.start(loop);
+    }
+
+    virtual ~InprocEngine() {
+        broker->unsubscribe(inbox.get());
+        inbox->close();
+        workers.reset();
+        handoff.stop();
+        scheduled.stop();
+        if (loopQueue.running) {
+            ev_async_stop(loop, &loopQueue.async);
+        }
+        discovery.stop();
+        ev_timer_stop(loop, &statsTimer.timer);
+    }
+
+    virtual Participant *registerParticipant(const Definition &definition) override {
+        Definition d = validateDefinitionFromUser(definition);
+        auto r = makeRegistration(this, d);
+        loopQueue.post(loop, [this, r, d]() {
+            addRegistration(r);
+            for (size_t i = 0; i < r->inports.size(); i++) {
+                auto &port = r->inports[i];
+                broker->subscribe(port.queue, generateQueueName(d, port),
+                                  InprocBroker::Subscriber{inbox, r, i, findCodec(port.contentType),
+                                                           r->inportCounters[i].get(),
+                                                           maxDecompressedSize,
+                                                           expectsCompressed(port)});
+            }
+            discovery.add(r->key);
+        });
+        return r.get();
+    }
+
+    virtual void unregisterParticipant(Participant *participant) override {
+        if (!unregister(this, participant)) {
+            return;
+        }
+        auto r = static_cast<ParticipantRegistration *>(participant);
+        loopQueue.post(loop, [this, r]() {
+            broker->unsubscribe(r);
+            discovery.remove(r->key);
+            removeRegistration(r->key);
+        });
+    }
+
+    void send(const ParticipantRegistration *r, const OutPortState &port, const char *data, uint64_t len, bool compressed,
+              const SendCallback &done) {
+        if (debugOutput) {
+            cout << "inproc: Sending " << len << " bytes to " << port.port.queue << endl;
+        }
+        publish(port.port.queue, data, len, compressed);
+        if (done) {
+            done(true);
+        }
+    }
+
+    // Nothing to coalesce in process, every message is its own delivery
+    void sendBatch(const ParticipantRegistration *r, const OutPortState &port, const vector<PayloadView> &payloads,
+                   const vector<bool> &compressed, const SendCallback &done) {
+        for (size_t i = 0; i < payloads.size(); i++) {
+            send(r, port, payloads[i].data, payloads[i].size, !compressed.empty() && compressed[i], SendCallback());
+        }
+        if (done) {
+            done(true);
+        }
+    }
+
+    virtual void start() override {
+        if (started) {
+            return;
+        }
+        started = true;
+        loopQueue.start(loop);
+        discovery.start(loop, [this](size_t key) {
+            sendDiscoveryMessage(*findRegistration(key));
+        });
+        if (!statsTopic.empty()) {
+            ev_timer_start(loop, &statsTimer.timer);
+        }
+    }
+
+    virtual void launch() override {
+        start();
+        ev_run(loop, 0);
+    }
+
+    // There is no connection to lose
+    virtual EngineStats stats() override {
+        EngineStats s = collectStats();
+        s.connected = true;
+        s.messagePool = blockPoolStats(InprocMessage::pool());
+        return s;
+    }
+
+protected:
+    string generateQueueName(const Definition &d, const Definition::Port &port) override {
+        return d.role + "." + string_to_upper_copy(port.id);
+    }
+
+private:
+    // Payloads the sender compressed are marked as such, as AMQP does
+    void publish(const string &topic, const char *data, uint64_t len, bool compressed = false) {
+        shared_ptr<const string> payload;
+        int64_t sent = 0;
+        broker->route(topic, [&](const InprocBroker::Subscriber &s) {
+            if (!payload) {
+                payload = make_shared<const string>(data, len);
+                sent = wallclockMicros();
+            }
+            s.inbox->post(Delivery{s.registration, s.port, s.codec, s.counters, payload, sent,
+                                   compressed || s.inflateAll ? s.maxInflated : 0});
+        });
+    }
+
+    void deliverInbox() {
+        inbox->take(delivering);
+        for (auto &d : delivering) {
+            if (workers) {
+                handoff.push(std::move(d));
+            } else if (scheduling) {
+                scheduled.push(shareOf(d), std::move(d));
+            } else {
+                deliver(d);
+            }
+        }
+        delivering.clear();
+    }
+
+    void deliver(Delivery &d) {
+        auto &r = *d.registration;
+        // Nothing redelivers in process, messages to an unregistered participant are dropped
+        if (!r.registered) {
+            return;
+        }
+        InprocMessage m(std::move(d.payload), r.inports[d.port].id, d.codec, d.maxInflated);
+
+        runHandler(r, *d.counters, m, d.sent);
+    }
+
+    void sendDiscoveryMessage(const ParticipantRegistration &r) {
+        publish("fbp", r.discoveryPayload.data(), r.discoveryPayload.size());
+    }
+
+private:
+    struct ev_loop *loop;
+    const shared_ptr<InprocBroker> broker;
+    const bool debugOutput;
+    EvDiscoveryTimer discovery;
+    const string statsTopic;
+    const uint64_t maxDecompressedSize;
+    EvTimerWrapper statsTimer;
+    EvLoopQueue loopQueue;
+    bool started = false;
+    shared_ptr<InprocInbox> inbox;
+    // Only used on the loop thread, kept to reuse its capacity
+    vector<Delivery> delivering;
+    // Without handler threads, with EngineConfig::fairScheduling()
+    bool scheduling = false;
+    EvScheduledDeliveries<Delivery> scheduled;
+    EvHandoff<Delivery> handoff;
+    // Declared last so handler threads are joined first
+    unique_ptr<Workers<Delivery>> workers;
+};
+
+shared_ptr<Engine> createEngine(const EngineConfig config) {
+
+    string url = config.url();
+
+    if (url.empty()) {
+        const char* broker = std::getenv("MSGFLO_BROKER");
+        if (broker) {
+            url = broker;
         }
+    }
+
+    if (url.empty()) {
+        throw invalid_argument("Missing msgflo url and MSGFLO_BROKER is not set.");
+    }
+
+    if (string_starts_with(url, "mqtt://")) {
+        const MqttUrl u = parseMqttUrl(url);
 
         if (config.debugOutput()) {
-            cout << "host: " << host << endl;
-            cout << "client_id: " << client_id << endl;
-            cout << "keep_alive: " << keep_alive << endl;
-            cout << "clean_session: " << clean_session << endl;
+            cout << "host: " << u.host << endl;
+            cout << "client_id: " << u.clientId << endl;
+            cout << "keep_alive: " << u.keepAlive << endl;
+            cout << "clean_session: " << u.cleanSession << endl;
         }
-        return make_shared<MosquittoEngine>(config, host, port, keep_alive, client_id, clean_session, username, password);
+        return make_shared<MosquittoEngine>(config, u.host, u.port, u.keepAlive, u.clientId, u.cleanSession, u.username, u.password);
     } else if (string_starts_with(url, "amqp://")) {
         return make_shared<AmqpEngine>(url, config);
+    } else if (string_starts_with(url, "inproc://")) {
+        return make_shared<InprocEngine>(config, url.substr(9));
     }
 
     throw std::runtime_error("Unsupported URL scheme: " + url);
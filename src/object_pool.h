@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace msgflo {
+
+// Fixed-size blocks carved out of chunks that are never moved or freed
+// before the pool, handed out and taken back through a free list.
+// Safe to use from any thread.
+class BlockPool {
+public:
+    BlockPool(size_t blockSize, size_t blocksPerChunk = 64)
+        : blockSize(roundUp(std::max(blockSize, sizeof(FreeBlock))))
+        , blocksPerChunk(std::max<size_t>(blocksPerChunk, 1))
+    {}
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    ~BlockPool() {
+        for (auto chunk : chunks) {
+            ::operator delete(chunk);
+        }
+    }
+
+    // How often the pool was used and how much of it, in blocks
+    struct Counters {
+        uint64_t allocations = 0;
+        // Allocations served without growing the pool
+        uint64_t hits = 0;
+        size_t inUse = 0;
+        size_t peakInUse = 0;
+        size_t capacity = 0;
+    };
+
+    void *allocate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        allocations++;
+        if (!freeList) {
+            grow();
+        } else {
+            hits++;
+        }
+        FreeBlock *b = freeList;
+        freeList = b->next;
+        used++;
+        peak = std::max(peak, used);
+        return b;
+    }
+
+    void deallocate(void *p) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto b = static_cast<FreeBlock *>(p);
+        b->next = freeList;
+        freeList = b;
+        used--;
+    }
+
+    size_t size() const {
+        return blockSize;
+    }
+
+    size_t inUse() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    size_t capacity() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return chunks.size() * blocksPerChunk;
+    }
+
+    Counters counters() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Counters c;
+        c.allocations = allocations;
+        c.hits = hits;
+        c.inUse = used;
+        c.peakInUse = peak;
+        c.capacity = chunks.size() * blocksPerChunk;
+        return c;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    static size_t roundUp(size_t size) {
+        const size_t align = alignof(std::max_align_t);
+        return (size + align - 1) / align * align;
+    }
+
+    void grow() {
+        // operator new returns memory aligned for any type, so every block is too
+        char *chunk = static_cast<char *>(::operator new(blockSize * blocksPerChunk));
+        chunks.push_back(chunk);
+        for (size_t i = blocksPerChunk; i > 0; i--) {
+            auto b = reinterpret_cast<FreeBlock *>(chunk + (i - 1) * blockSize);
+            b->next = freeList;
+            freeList = b;
+        }
+    }
+
+    const size_t blockSize;
+    const size_t blocksPerChunk;
+    mutable std::mutex mutex;
+    std::vector<char *> chunks;
+    FreeBlock *freeList = nullptr;
+    size_t used = 0;
+    size_t peak = 0;
+    uint64_t allocations = 0;
+    uint64_t hits = 0;
+};
+
+// Allocator taking single objects from a BlockPool, for std::allocate_shared.
+// The object and its reference count share one block, and the pool stays
+// alive until the last object allocated from it is gone.
+template<typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    explicit PoolAllocator(std::shared_ptr<BlockPool> pool)
+        : pool(std::move(pool))
+    {}
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &other)
+        : pool(other.pool)
+    {}
+
+    T *allocate(size_t n) {
+        if (n == 1 && sizeof(T) <= pool->size()) {
+            return static_cast<T *>(pool->allocate());
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n == 1 && sizeof(T) <= pool->size()) {
+            pool->deallocate(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U> &other) const {
+        return pool == other.pool;
+    }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U> &other) const {
+        return pool != other.pool;
+    }
+
+private:
+    template<typename U> friend class PoolAllocator;
+
+    std::shared_ptr<BlockPool> pool;
+};
+
+// Makes shared objects of type T out of a BlockPool. Freed objects go back
+// to the pool on whichever thread drops the last reference, and the memory
+// is reused by the next make().
+template<typename T>
+class ObjectPool {
+public:
+    explicit ObjectPool(size_t objectsPerChunk = 64)
+        // Room for the reference counts allocate_shared puts next to the object
+        : pool(std::make_shared<BlockPool>(sizeof(T) + 6 * sizeof(void *), objectsPerChunk))
+    {}
+
+    template<typename... Args>
+    std::shared_ptr<T> make(Args&&... args) {
+        return std::allocate_shared<T>(PoolAllocator<T>(pool), std::forward<Args>(args)...);
+    }
+
+    size_t inUse() const {
+        return pool->inUse();
+    }
+
+    size_t capacity() const {
+        return pool->capacity();
+    }
+
+private:
+    std::shared_ptr<BlockPool> pool;
+};
+
+// Gives T an operator new and delete taking its objects from one BlockPool
+// shared by all of them, so objects made with new and deleted through a
+// pointer to a base class with a virtual destructor are recycled too. The
+// pool is never destroyed, objects may be freed during static destruction.
+template<typename T>
+struct PoolAllocated {
+    static void *operator new(size_t size) {
+        if (size <= pool().size()) {
+            return pool().allocate();
+        }
+        return ::operator new(size);
+    }
+
+    static void operator delete(void *p, size_t size) {
+        if (size <= pool().size()) {
+            pool().deallocate(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    static BlockPool &pool() {
+        static BlockPool *blocks = new BlockPool(sizeof(T));
+        return *blocks;
+    }
+};
+
+} // namespace msgflo
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "msgflo.h"
+
+namespace msgflo {
+
+struct OutPortState;
+
+// Sends waiting for the client library to take them, bounded in messages and
+// bytes. What happens to a send that does not fit is up to the policy: wait
+// for room, fail it, or fail the oldest queued sends to make room. Crossing
+// the high watermark and then the low one calls the watermark callback with
+// true and false, so producers can slow down before the limit is reached.
+//
+// Pushed to from any thread, drained on the loop thread. Closed when the
+// engine goes away, which fails what is queued and what is pushed later.
+class OutboundQueue {
+public:
+    struct Item {
+        // Keeps the port alive while the send is queued
+        std::shared_ptr<const std::vector<OutPortState>> states;
+        const OutPortState *port;
+        std::string body;
+        SendCallback done;
+        // Marked as compressed for the receivers, see Definition::Port::compression
+        bool compressed;
+    };
+
+    OutboundQueue(size_t maxMessages, uint64_t maxBytes, OverflowPolicy policy,
+                  double highWatermark = 0.8, double lowWatermark = 0.5,
+                  std::function<void(bool)> watermark = std::function<void(bool)>())
+        : maxMessages(maxMessages)
+        , maxBytes(maxBytes)
+        , policy(policy)
+        , high(highWatermark)
+        , low(std::min(lowWatermark, highWatermark))
+        , watermark(std::move(watermark))
+    {}
+
+    explicit OutboundQueue(const EngineConfig &config)
+        : OutboundQueue(static_cast<size_t>(std::max(config.outboundMessages(), 0)),
+                        static_cast<uint64_t>(std::max<int64_t>(config.outboundBytes(), 0)),
+                        config.overflowPolicy(), config.highWatermark(), config.lowWatermark(),
+                        config.watermarkCallback())
+    {}
+
+    // Without limits the engines send as before and nothing is queued
+    bool enabled() const {
+        return maxMessages > 0 || maxBytes > 0;
+    }
+
+    // Also false while a drain is publishing what it took, so sends made
+    // meanwhile do not overtake them
+    bool empty() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.empty() && draining == 0;
+    }
+
+    // Returns whether the send was queued, otherwise it has been failed.
+    // Waiting is only done if `mayWait`, the loop thread must not wait for itself.
+    bool push(Item &&item, bool mayWait) {
+        std::vector<SendCallback> failed;
+        bool queued = true;
+        bool crossed = false, above = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (closed) {
+                lock.unlock();
+                if (item.done) {
+                    item.done(false);
+                }
+                return false;
+            }
+            if (!fits(item.body.size())) {
+                if (policy == OverflowPolicy::DropOldest) {
+                    while (!items.empty() && !fits(item.body.size())) {
+                        failed.push_back(std::move(items.front().done));
+                        take();
+                        droppedCount++;
+                    }
+                } else if (policy == OverflowPolicy::Block && mayWait) {
+                    waiters++;
+                    room.wait(lock, [this, &item]() { return closed || fits(item.body.size()); });
+                    waiters--;
+                    if (closed) {
+                        // close() waits for this, the queue may be gone once the lock is released
+                        left.notify_all();
+                        lock.unlock();
+                        if (item.done) {
+                            item.done(false);
+                        }
+                        return false;
+                    }
+                } else {
+                    refusedCount++;
+                    queued = false;
+                }
+            }
+            if (queued) {
+                bytes += item.body.size();
+                items.push_back(std::move(item));
+                publishDepth();
+            } else {
+                failed.push_back(std::move(item.done));
+            }
+            crossed = updateWatermark(above);
+        }
+
+        notify(crossed, above);
+        for (auto &d : failed) {
+            if (d) {
+                d(false);
+            }
+        }
+        return queued;
+    }
+
+    // Hands queued sends to publish() in order, while canSend(item) allows it
+    template<typename CanSend, typename Publish>
+    void drain(CanSend canSend, Publish publish) {
+        for (;;) {
+            Item item;
+            bool crossed = false, above = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (items.empty() || !canSend(static_cast<const Item &>(items.front()))) {
+                    return;
+                }
+                item = std::move(items.front());
+                take();
+                draining++;
+                crossed = updateWatermark(above);
+            }
+            room.notify_all();
+            notify(crossed, above);
+
+            Draining d(*this);
+            publish(item);
+        }
+    }
+
+    // Fails everything queued, for when the connection is gone for good
+    void fail() {
+        std::deque<Item> failed;
+        bool crossed = false, above = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed.swap(items);
+            bytes = 0;
+            publishDepth();
+            crossed = updateWatermark(above);
+        }
+        room.notify_all();
+        notify(crossed, above);
+        for (auto &i : failed) {
+            if (i.done) {
+                i.done(false);
+            }
+        }
+    }
+
+    // Fails everything queued, and from now on every push. Returns once the
+    // sends that were waiting for room have failed, so the queue can go away.
+    void close() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            closed = true;
+            room.notify_all();
+            left.wait(lock, [this]() { return waiters == 0; });
+        }
+        fail();
+    }
+
+    // Safe to call from any thread without the lock
+    uint64_t queuedMessages() const {
+        return depthMessages.load(std::memory_order_relaxed);
+    }
+
+    uint64_t queuedBytes() const {
+        return depthBytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const {
+        return droppedCount.load(std::memory_order_relaxed);
+    }
+
+    uint64_t refused() const {
+        return refusedCount.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Counts a send taken by drain() until it has been published, or publishing threw
+    struct Draining {
+        explicit Draining(OutboundQueue &q)
+            : q(q)
+        {}
+
+        ~Draining() {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.draining--;
+        }
+
+        OutboundQueue &q;
+    };
+
+    // An empty queue takes any send, or one larger than the byte limit would never go
+    bool fits(uint64_t size) const {
+        if (items.empty()) {
+            return true;
+        }
+        return (maxMessages == 0 || items.size() < maxMessages) && (maxBytes == 0 || bytes + size <= maxBytes);
+    }
+
+    void take() {
+        bytes -= items.front().body.size();
+        items.pop_front();
+        publishDepth();
+    }
+
+    void publishDepth() {
+        depthMessages.store(items.size(), std::memory_order_relaxed);
+        depthBytes.store(bytes, std::memory_order_relaxed);
+    }
+
+    // Fullness between 0 and 1, of whichever limit is closer
+    double level() const {
+        double l = 0;
+        if (maxMessages > 0) {
+            l = std::max(l, static_cast<double>(items.size()) / maxMessages);
+        }
+        if (maxBytes > 0) {
+            l = std::max(l, static_cast<double>(bytes) / maxBytes);
+        }
+        return l;
+    }
+
+    bool updateWatermark(bool &above) {
+        const double l = level();
+        if (!aboveHigh && l >= high) {
+            aboveHigh = true;
+        } else if (aboveHigh && l <= low) {
+            aboveHigh = false;
+        } else {
+            return false;
+        }
+        above = aboveHigh;
+        return true;
+    }
+
+    // Called without the lock, so the callback can send
+    void notify(bool crossed, bool above) {
+        if (crossed && watermark) {
+            watermark(above);
+        }
+    }
+
+    const size_t maxMessages;
+    const uint64_t maxBytes;
+    const OverflowPolicy policy;
+    const double high;
+    const double low;
+    const std::function<void(bool)> watermark;
+
+    mutable std::mutex mutex;
+    std::condition_variable room;
+    // Signalled by pushers giving up their wait for room when closed
+    std::condition_variable left;
+    size_t waiters = 0;
+    bool closed = false;
+    std::deque<Item> items;
+    uint64_t bytes = 0;
+    size_t draining = 0;
+    bool aboveHigh = false;
+    std::atomic<uint64_t> depthMessages{0};
+    std::atomic<uint64_t> depthBytes{0};
+    std::atomic<uint64_t> droppedCount{0};
+    std::atomic<uint64_t> refusedCount{0};
+};
+
+} // namespace msgflo
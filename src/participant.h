@@ -0,0 +1,308 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "msgflo.h"
+#include "codec.h"
+#include "compression.h"
+#include "send_buffer.h"
+#include "stats.h"
+
+namespace msgflo {
+
+class DiscoveryMessage {
+public:
+    DiscoveryMessage(const Definition &def)
+        : definition(def) {
+    }
+
+    json11::Json to_json() const {
+        using namespace json11;
+
+        return Json::object {
+                {"protocol",  "discovery"},
+                {"command",  "participant"},
+                {"payload", definition.to_json() },
+        };
+    }
+
+private:
+    Definition definition;
+};
+
+// One completion for `count` sends, called with true when all of them succeeded.
+// The sends may complete on different threads, e.g. a refused one inline on
+// the sender's thread while the others are confirmed on the loop thread.
+inline SendCallback completeAll(size_t count, const SendCallback &done) {
+    if (!done) {
+        return SendCallback();
+    }
+    if (count == 0) {
+        done(true);
+        return SendCallback();
+    }
+    struct Batch {
+        Batch(size_t count, const SendCallback &done)
+            : remaining(count)
+            , ok(true)
+            , done(done)
+        {}
+
+        std::atomic<size_t> remaining;
+        std::atomic<bool> ok;
+        SendCallback done;
+    };
+    auto batch = std::make_shared<Batch>(count, done);
+    return [batch](bool ok) {
+        if (!ok) {
+            batch->ok.store(false, std::memory_order_relaxed);
+        }
+        // The last one sees the failures stored before the others counted down
+        if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            batch->done(batch->ok.load(std::memory_order_relaxed));
+        }
+    };
+}
+
+inline void defaultMessageHandler(msgflo::Message *msg) {
+    std::cout << "Warning: No message handler defined for msgflo::Participant" << std::endl;
+}
+
+// What an OutPort handle points to, everything a send needs resolved up front
+struct OutPortState {
+    Definition::Port port;
+    const Codec *codec;
+    // Put on AMQP messages, empty for ports without a configured content type
+    std::string contentType;
+    std::shared_ptr<PortCounters> counters;
+    // nullptr for ports sending payloads uncompressed
+    std::shared_ptr<const Compressor> compressor;
+};
+
+template<typename Engine_t>
+struct ParticipantRegistrationT : public Participant {
+    using string = std::string;
+
+    Engine_t *engine;
+    // The engine's key for the registration, see AbstractEngine::registrations
+    const size_t key;
+    const std::vector<Definition::Port> inports;
+    const std::vector<Definition::Port> outports;
+    // Shared so OutPort handles stay valid when the registration is copied
+    std::shared_ptr<const std::vector<OutPortState>> outportStates;
+    // Same order as inports
+    std::vector<std::shared_ptr<PortCounters>> inportCounters;
+    const string id;
+    MessageHandler handler;
+    // Used instead of handler when set
+    AsyncMessageHandler asyncHandler;
+    const DiscoveryMessage discoveryMessage;
+    // discoveryMessage as sent, serialized once
+    const string discoveryPayload;
+    // Cleared by unregisterParticipant(). Messages still on their way to the
+    // handler are dropped, the registration itself lives on until they are gone.
+    std::atomic<bool> registered;
+
+    ParticipantRegistrationT(Engine_t *engine, size_t key, const Definition &definition)
+        : engine(engine)
+        , key(key)
+        , inports(definition.inports)
+        , outports(definition.outports)
+        , outportStates(resolveOutPorts(definition.outports))
+        , id(generateId(definition))
+        , handler(defaultMessageHandler)
+        , discoveryMessage(definition)
+        , discoveryPayload(discoveryMessage.to_json().dump())
+        , registered(true)
+    {
+        for (size_t i = 0; i < inports.size(); i++) {
+            inportCounters.push_back(std::make_shared<PortCounters>());
+            checkDecompression(inports[i]);
+            registerDictionary(inports[i]);
+        }
+    }
+
+    virtual void onMessage(const MessageHandler &h) override {
+        handler = h;
+        asyncHandler = nullptr;
+    }
+
+    virtual void onMessageAsync(const AsyncMessageHandler &h) override {
+        asyncHandler = h;
+    }
+
+    virtual OutPort outPort(const string &port) override {
+        return OutPort(&findOutPortState(port));
+    }
+
+    virtual void send(const string &port, const json11::Json &json) override {
+        send(OutPort(&findOutPortState(port)), json, SendCallback());
+    }
+
+    virtual void send(const string &port, const string &string) override {
+        send(port, string.c_str(), string.size());
+    }
+
+    virtual void send(const string &port, const char *data, uint64_t len) override {
+        dispatch(findOutPortState(port), data, len, SendCallback());
+    }
+
+    virtual void send(const string &port, const json11::Json &json, const SendCallback &done) override {
+        send(OutPort(&findOutPortState(port)), json, done);
+    }
+
+    virtual void send(const string &port, const string &string, const SendCallback &done) override {
+        send(port, string.c_str(), string.size(), done);
+    }
+
+    virtual void send(const string &port, const char *data, uint64_t len, const SendCallback &done) override {
+        dispatch(findOutPortState(port), data, len, done);
+    }
+
+    virtual void send(const OutPort &port, const json11::Json &json) override {
+        send(port, json, SendCallback());
+    }
+
+    virtual void send(const OutPort &port, const string &string) override {
+        send(port, string.c_str(), string.size(), SendCallback());
+    }
+
+    virtual void send(const OutPort &port, const char *data, uint64_t len) override {
+        send(port, data, len, SendCallback());
+    }
+
+    virtual void send(const OutPort &port, const json11::Json &json, const SendCallback &done) override {
+        const auto &state = checkOutPort(port);
+        SendBuffer buffer;
+        state.codec->encode(json, buffer.str());
+        dispatch(state, buffer.str().data(), buffer.str().size(), done);
+    }
+
+    virtual void send(const OutPort &port, const string &string, const SendCallback &done) override {
+        send(port, string.c_str(), string.size(), done);
+    }
+
+    virtual void send(const OutPort &port, const char *data, uint64_t len, const SendCallback &done) override {
+        dispatch(checkOutPort(port), data, len, done);
+    }
+
+    using Participant::sendBatch;
+
+    virtual void sendBatch(const string &port, const std::vector<PayloadView> &payloads, const SendCallback &done) override {
+        dispatchBatch(findOutPortState(port), payloads, done);
+    }
+
+    virtual void sendBatch(const OutPort &port, const std::vector<PayloadView> &payloads, const SendCallback &done) override {
+        dispatchBatch(checkOutPort(port), payloads, done);
+    }
+
+    // Adds the participant's ports to an engine's stats
+    void collectStats(std::vector<PortStats> &ports) const {
+        for (size_t i = 0; i < inports.size(); i++) {
+            ports.push_back(inportCounters[i]->snapshot(id, inports[i], true));
+        }
+        for (const auto &s : *outportStates) {
+            ports.push_back(s.counters->snapshot(id, s.port, false));
+        }
+    }
+
+    const Definition::Port *findOutPort(const string &id) const {
+        for (auto &p: outports) {
+            if (p.id == id) {
+                return &p;
+            }
+        }
+        return nullptr;
+    }
+
+    const OutPortState &findOutPortState(const string &id) const {
+        for (auto &s: *outportStates) {
+            if (s.port.id == id) {
+                return s;
+            }
+        }
+        throw std::domain_error("Unknown out port: " + id);
+    }
+
+    const OutPortState &checkOutPort(const OutPort &port) const {
+        const auto state = port.state();
+        if (state == nullptr || state < outportStates->data() || state >= outportStates->data() + outportStates->size()) {
+            throw std::domain_error("OutPort does not belong to participant " + id);
+        }
+        return *state;
+    }
+
+    static std::shared_ptr<const std::vector<OutPortState>> resolveOutPorts(const std::vector<Definition::Port> &ports) {
+        auto states = std::make_shared<std::vector<OutPortState>>();
+        for (const auto &p : ports) {
+            const Codec *codec = findCodec(p.contentType);
+            states->push_back(OutPortState{p, codec, p.contentType.empty() ? string() : codec->contentType(),
+                                           std::make_shared<PortCounters>(), makeCompressor(p)});
+        }
+        return states;
+    }
+
+    static bool compresses(const OutPortState &state, uint64_t len) {
+        return state.compressor && len > 0 && len >= state.port.compressionThreshold;
+    }
+
+    // Engines are told which payloads went out compressed, so AMQP and inproc
+    // can mark them for the receivers
+    void dispatch(const OutPortState &state, const char *data, uint64_t len, const SendCallback &done) {
+        if (compresses(state, len)) {
+            CompressBuffer buffer;
+            if (state.compressor->compress(data, len, buffer.str())) {
+                state.counters->count(len, buffer.str().size());
+                engine->send(this, state, buffer.str().data(), buffer.str().size(), true, done);
+                return;
+            }
+        }
+        state.counters->count(len, len);
+        engine->send(this, state, data, len, false, done);
+    }
+
+    void dispatchBatch(const OutPortState &state, const std::vector<PayloadView> &payloads, const SendCallback &done) {
+        uint64_t bytes = 0;
+        for (const auto &p : payloads) {
+            bytes += p.size;
+        }
+        state.counters->messages.fetch_add(payloads.size(), std::memory_order_relaxed);
+        state.counters->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (!state.compressor) {
+            state.counters->wireBytes.fetch_add(bytes, std::memory_order_relaxed);
+            engine->sendBatch(this, state, payloads, std::vector<bool>(), done);
+            return;
+        }
+
+        // The engines copy the payloads before sendBatch() returns
+        std::vector<std::string> compressed(payloads.size());
+        std::vector<PayloadView> wire;
+        std::vector<bool> marked(payloads.size());
+        wire.reserve(payloads.size());
+        uint64_t wireBytes = 0;
+        for (size_t i = 0; i < payloads.size(); i++) {
+            const PayloadView &p = payloads[i];
+            if (compresses(state, p.size) && state.compressor->compress(p.data, p.size, compressed[i])) {
+                wire.push_back(PayloadView{compressed[i].data(), compressed[i].size()});
+                marked[i] = true;
+            } else {
+                wire.push_back(p);
+            }
+            wireBytes += wire.back().size;
+        }
+        state.counters->wireBytes.fetch_add(wireBytes, std::memory_order_relaxed);
+        engine->sendBatch(this, state, wire, marked, done);
+    }
+
+    static string generateId(const Definition &d) {
+        return d.role + std::to_string(rand());
+    }
+};
+
+} // namespace msgflo
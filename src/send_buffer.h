@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+
+namespace msgflo {
+
+// Per-thread buffer for encoding outgoing messages. Its capacity is kept from
+// one send to the next, so steady-state sends do not allocate. A send made
+// while the buffer is in use on the same thread, e.g. from a completion
+// callback, gets a buffer of its own. Each Use is a separate buffer, so a
+// payload encoded in one can be compressed into another.
+template<typename Use>
+class BasicSendBuffer {
+public:
+    BasicSendBuffer()
+        : nested(inUse())
+        , buffer(nested ? local : shared())
+    {
+        inUse() = true;
+        buffer.clear();
+    }
+
+    ~BasicSendBuffer() {
+        if (nested) {
+            return;
+        }
+        inUse() = false;
+        // Do not hold on to the memory of an occasional huge message
+        if (buffer.capacity() > maxRetained) {
+            std::string().swap(buffer);
+        }
+    }
+
+    BasicSendBuffer(const BasicSendBuffer &) = delete;
+    BasicSendBuffer &operator=(const BasicSendBuffer &) = delete;
+
+    std::string &str() {
+        return buffer;
+    }
+
+private:
+    static const size_t maxRetained = 1024 * 1024;
+
+    static std::string &shared() {
+        static thread_local std::string s;
+        return s;
+    }
+
+    static bool &inUse() {
+        static thread_local bool b = false;
+        return b;
+    }
+
+    const bool nested;
+    std::string local;
+    std::string &buffer;
+};
+
+struct EncodeUse;
+struct CompressUse;
+
+using SendBuffer = BasicSendBuffer<EncodeUse>;
+using CompressBuffer = BasicSendBuffer<CompressUse>;
+
+} // namespace msgflo
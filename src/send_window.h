@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "msgflo.h"
+
+namespace msgflo {
+
+// Bookkeeping for sends waiting for a broker confirmation. At most `window`
+// sends are unconfirmed; sends beyond that are held, with a copy of their
+// payload, until confirmations make room.
+class SendWindow {
+public:
+    struct HeldSend {
+        std::string destination;
+        std::string routingKey;
+        std::string contentType;
+        std::string body;
+        SendCallback done;
+        // MQTT only
+        int qos;
+        // AMQP only, see Definition::Port::compression
+        bool compressed;
+    };
+
+    explicit SendWindow(size_t window)
+        : window(window > 0 ? window : 1)
+    {}
+
+    // Held sends go first, so sends are published in the order they were made
+    bool full() const {
+        return unconfirmed.size() >= window || !held.empty();
+    }
+
+    size_t inFlight() const {
+        return unconfirmed.size();
+    }
+
+    // Unconfirmed and held sends. Unlike the rest, safe to call from any thread.
+    size_t depth() const {
+        return sizes.load(std::memory_order_relaxed);
+    }
+
+    void hold(const std::string &destination, const std::string &routingKey, const std::string &contentType,
+              const char *data, uint64_t len, const SendCallback &done, int qos = 0, bool compressed = false) {
+        held.push_back(HeldSend{destination, routingKey, contentType, std::string(data, len), done, qos, compressed});
+        updateDepth();
+    }
+
+    void sent(uint64_t id, const SendCallback &done) {
+        unconfirmed[id] = done;
+        updateDepth();
+    }
+
+    // Completes the send with the given id, or with `multiple` every send up to it
+    void confirm(uint64_t id, bool multiple, bool ok) {
+        std::vector<SendCallback> done;
+        if (multiple) {
+            auto end = unconfirmed.upper_bound(id);
+            for (auto it = unconfirmed.begin(); it != end; ++it) {
+                done.push_back(std::move(it->second));
+            }
+            unconfirmed.erase(unconfirmed.begin(), end);
+        } else {
+            auto it = unconfirmed.find(id);
+            if (it == unconfirmed.end()) {
+                return;
+            }
+            done.push_back(std::move(it->second));
+            unconfirmed.erase(it);
+        }
+        updateDepth();
+
+        // Callbacks may send again, so they are called after the bookkeeping is done
+        for (auto &d : done) {
+            if (d) {
+                d(ok);
+            }
+        }
+    }
+
+    // Hands held sends to publish() while the window has room
+    template<typename Publish>
+    void drain(Publish publish) {
+        while (!held.empty() && unconfirmed.size() < window) {
+            HeldSend s = std::move(held.front());
+            held.pop_front();
+            updateDepth();
+            publish(s);
+        }
+    }
+
+    // Fails everything, for when the connection is lost
+    void fail() {
+        std::vector<SendCallback> done;
+        for (auto &u : unconfirmed) {
+            done.push_back(std::move(u.second));
+        }
+        for (auto &h : held) {
+            done.push_back(std::move(h.done));
+        }
+        unconfirmed.clear();
+        held.clear();
+        updateDepth();
+
+        for (auto &d : done) {
+            if (d) {
+                d(false);
+            }
+        }
+    }
+
+private:
+    void updateDepth() {
+        sizes.store(unconfirmed.size() + held.size(), std::memory_order_relaxed);
+    }
+
+    const size_t window;
+    std::atomic<size_t> sizes{0};
+    std::map<uint64_t, SendCallback> unconfirmed;
+    std::deque<HeldSend> held;
+};
+
+} // namespace msgflo
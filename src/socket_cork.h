@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace msgflo {
+
+// Holds back partial TCP segments while a loop iteration makes its sends, so
+// many small messages leave the socket in few full segments instead of one
+// packet each. The client libraries own the socket and write each message on
+// its own, so this is done in the kernel with TCP_CORK (TCP_NOPUSH on BSDs)
+// rather than by gathering the writes. Corked on the first send of an
+// iteration, pushed out when the loop is about to wait or after `budget`
+// bytes. Only used from the loop thread.
+class SocketCork {
+public:
+    explicit SocketCork(size_t budget)
+        : budget(budget)
+    {}
+
+    // The client's socket, which changes when it reconnects. A negative fd turns corking off.
+    void attach(int socket) {
+        if (socket == fd) {
+            return;
+        }
+        fd = socket;
+        corked = false;
+        pending = 0;
+    }
+
+    // Called with the size of each message before it is written
+    void sending(size_t bytes) {
+        if (fd < 0) {
+            return;
+        }
+        if (!corked) {
+            corked = set(1);
+        }
+        pending += bytes;
+        if (pending >= budget) {
+            // Clearing the option sends what is held back, then hold back again
+            set(0);
+            corked = set(1);
+            pending = 0;
+        }
+    }
+
+    // Sends whatever is held back
+    void flush() {
+        if (!corked) {
+            return;
+        }
+        set(0);
+        corked = false;
+        pending = 0;
+    }
+
+private:
+    bool set(int on) {
+#if defined(TCP_CORK)
+        return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+#elif defined(TCP_NOPUSH)
+        return setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on)) == 0;
+#else
+        return false;
+#endif
+    }
+
+    const size_t budget;
+    int fd = -1;
+    bool corked = false;
+    size_t pending = 0;
+};
+
+} // namespace msgflo
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "msgflo.h"
+
+namespace msgflo {
+
+inline int64_t monotonicMicros() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// For latencies between processes, which share the wall clock but not the monotonic one
+inline int64_t wallclockMicros() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram of microsecond values, in the style of HdrHistogram:
+// every power of two is split into 16 linear buckets, so percentiles are
+// within 1/16 of the real value. Recording is a few relaxed atomic adds and
+// safe from any thread.
+class Histogram {
+public:
+    Histogram() {
+        for (auto &b : buckets) {
+            b.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+
+    void record(int64_t micros) {
+        const uint64_t v = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+        buckets[index(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t m = largest.load(std::memory_order_relaxed);
+        while (v > m && !largest.compare_exchange_weak(m, v, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Not an atomic snapshot, values recorded meanwhile may be partly included
+    LatencyStats summary() const {
+        LatencyStats s;
+        s.count = total.load(std::memory_order_relaxed);
+        s.max = largest.load(std::memory_order_relaxed);
+        if (s.count == 0) {
+            return s;
+        }
+        s.mean = static_cast<double>(sum.load(std::memory_order_relaxed)) / s.count;
+        s.p50 = percentile(s.count, 0.5);
+        s.p90 = percentile(s.count, 0.9);
+        s.p99 = percentile(s.count, 0.99);
+        s.p999 = percentile(s.count, 0.999);
+        return s;
+    }
+
+private:
+    static const int subBits = 4;
+    static const uint64_t subBuckets = 1 << subBits;
+    // Values from 2^36 us, about 19 hours, share the last bucket
+    static const int maxExponent = 36;
+    static const size_t bucketCount = (maxExponent - subBits + 1) * subBuckets;
+
+    static size_t index(uint64_t v) {
+        if (v < subBuckets) {
+            return static_cast<size_t>(v);
+        }
+        int exponent = 63 - __builtin_clzll(v);
+        if (exponent >= maxExponent) {
+            return bucketCount - 1;
+        }
+        const int shift = exponent - subBits;
+        return static_cast<size_t>((shift + 1) * subBuckets + ((v >> shift) & (subBuckets - 1)));
+    }
+
+    // The highest value that falls into bucket i
+    static uint64_t upperBound(size_t i) {
+        if (i < subBuckets) {
+            return i;
+        }
+        const int shift = static_cast<int>(i / subBuckets) - 1;
+        const uint64_t sub = i % subBuckets;
+        return ((subBuckets + sub + 1) << shift) - 1;
+    }
+
+    uint64_t percentile(uint64_t count, double p) const {
+        const uint64_t rank = static_cast<uint64_t>(p * count + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank && seen > 0) {
+                return std::min(upperBound(i), largest.load(std::memory_order_relaxed));
+            }
+        }
+        return largest.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> buckets[bucketCount];
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> largest{0};
+};
+
+// Counters of one port, updated from the loop and handler threads
+struct PortCounters {
+    std::atomic<uint64_t> messages{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> wireBytes{0};
+    std::atomic<uint64_t> acks{0};
+    std::atomic<uint64_t> nacks{0};
+    std::atomic<uint64_t> redeliveries{0};
+    Histogram handlerDuration;
+    Histogram latency;
+
+    // len is the payload as given to send() or the handler, wireLen as on the
+    // broker, which is less for compressed payloads
+    void count(uint64_t len, uint64_t wireLen) {
+        messages.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(len, std::memory_order_relaxed);
+        wireBytes.fetch_add(wireLen, std::memory_order_relaxed);
+    }
+
+    PortStats snapshot(const std::string &participant, const Definition::Port &port, bool inport) const {
+        PortStats s;
+        s.participant = participant;
+        s.port = port.id;
+        s.queue = port.queue;
+        s.inport = inport;
+        s.messages = messages.load(std::memory_order_relaxed);
+        s.bytes = bytes.load(std::memory_order_relaxed);
+        s.wireBytes = wireBytes.load(std::memory_order_relaxed);
+        s.acks = acks.load(std::memory_order_relaxed);
+        s.nacks = nacks.load(std::memory_order_relaxed);
+        s.redeliveries = redeliveries.load(std::memory_order_relaxed);
+        const uint64_t settled = s.acks + s.nacks;
+        s.inFlight = inport && s.messages > settled ? s.messages - settled : 0;
+        s.handlerDuration = handlerDuration.summary();
+        s.latency = latency.summary();
+        return s;
+    }
+};
+
+// Losses of an engine's broker connection and the time it took to recover from them
+struct ConnectionCounters {
+    std::atomic<bool> up{false};
+    std::atomic<uint64_t> reconnects{0};
+    Histogram recovery;
+    // When the connection that was up went down, 0 while up. Loop thread only.
+    int64_t lostAt = 0;
+
+    // The connection is back and the participants are set up again
+    void connected() {
+        if (lostAt) {
+            recovery.record(monotonicMicros() - lostAt);
+            reconnects.fetch_add(1, std::memory_order_relaxed);
+            lostAt = 0;
+        }
+        up = true;
+    }
+
+    // Failed attempts to reconnect do not restart the clock
+    void lost() {
+        if (up.exchange(false) && lostAt == 0) {
+            lostAt = monotonicMicros();
+        }
+    }
+
+    void snapshot(EngineStats &s) const {
+        s.connected = up.load(std::memory_order_relaxed);
+        s.reconnects = reconnects.load(std::memory_order_relaxed);
+        s.recovery = recovery.summary();
+    }
+};
+
+} // namespace msgflo
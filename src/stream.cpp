@@ -0,0 +1,409 @@
+#include "msgflo.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream_frame.h"
+
+using namespace std;
+
+namespace msgflo {
+
+const uint64_t StreamChunk::unknownSize;
+
+namespace {
+
+uint64_t newTransferId() {
+    static thread_local mt19937_64 random(random_device{}());
+    return random();
+}
+
+// The sending side of one stream. Chunks are taken from the source and sent
+// until `window` of them are in flight, and again whenever one completes,
+// which may happen on the loop thread or within send() itself. Only the
+// thread that set `pumping` touches the source, the offset and the buffer.
+class StreamSender : public enable_shared_from_this<StreamSender> {
+public:
+    StreamSender(Participant *participant, const OutPort &port, uint64_t size, const StreamSource &source,
+                 const SendCallback &done, const StreamOptions &options)
+        : transfer(newTransferId())
+        , participant(participant)
+        , port(port)
+        , total(size)
+        , chunkSize(max<uint64_t>(options.chunkSize, 1))
+        , window(max<size_t>(options.window, 1))
+        , source(source)
+        , done(done)
+    {}
+
+    const uint64_t transfer;
+
+    void pump() {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            if (pumping) {
+                return;
+            }
+            pumping = true;
+        }
+        for (;;) {
+            {
+                lock_guard<std::mutex> lock(mutex);
+                if (failed || ended || inFlight >= window) {
+                    pumping = false;
+                    break;
+                }
+                inFlight++;
+            }
+            sendNext();
+        }
+        finishIfDone();
+    }
+
+private:
+    void sendNext() {
+        const uint64_t most = total == StreamChunk::unknownSize ? chunkSize : min(chunkSize, total - offset);
+        PayloadView piece{nullptr, 0};
+        if (most > 0) {
+            piece = source(offset, most);
+            piece.size = min(piece.size, most);
+        }
+
+        StreamFrame frame;
+        frame.transfer = transfer;
+        frame.offset = offset;
+        frame.total = total;
+        frame.last = piece.size == 0 || (total != StreamChunk::unknownSize && offset + piece.size >= total);
+        buffer.resize(StreamFrame::headerSize + piece.size);
+        frame.write(&buffer[0]);
+        if (piece.size > 0) {
+            memcpy(&buffer[StreamFrame::headerSize], piece.data, piece.size);
+        }
+        offset += piece.size;
+        if (frame.last) {
+            lock_guard<std::mutex> lock(mutex);
+            ended = true;
+        }
+
+        // Every engine copies the payload before send() returns, so the buffer is reused
+        auto self = shared_from_this();
+        auto completed = make_shared<bool>(false);
+        try {
+            participant->send(port, buffer.data(), buffer.size(), [self, completed](bool ok) {
+                self->chunkDone(*completed, ok);
+            });
+        } catch (std::exception &e) {
+            cerr << "Stream " << transfer << " failed: " << e.what() << endl;
+            chunkDone(*completed, false);
+        }
+        if (frame.last) {
+            // Nothing reads it any more, which for sendFile() unmaps the file
+            source = nullptr;
+        }
+    }
+
+    // Engines that fail a send can also throw, the chunk is only counted once
+    void chunkDone(bool &completed, bool ok) {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            if (completed) {
+                return;
+            }
+            completed = true;
+            inFlight--;
+            failed = failed || !ok;
+        }
+        pump();
+    }
+
+    void finishIfDone() {
+        SendCallback callback;
+        bool ok;
+        {
+            lock_guard<std::mutex> lock(mutex);
+            if (finished || pumping || inFlight > 0 || !(ended || failed)) {
+                return;
+            }
+            finished = true;
+            ok = !failed;
+            callback.swap(done);
+        }
+        if (callback) {
+            callback(ok);
+        }
+    }
+
+    Participant *participant;
+    const OutPort port;
+    const uint64_t total;
+    const uint64_t chunkSize;
+    const size_t window;
+    StreamSource source;
+    SendCallback done;
+    uint64_t offset = 0;
+    string buffer;
+
+    std::mutex mutex;
+    size_t inFlight = 0;
+    bool pumping = false;
+    bool ended = false;
+    bool failed = false;
+    bool finished = false;
+};
+
+// A read-only mapping of a whole file
+struct FileMapping {
+    explicit FileMapping(const string &path) {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw runtime_error("Could not open " + path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            const int err = errno;
+            close(fd);
+            throw runtime_error("Could not stat " + path + ": " + strerror(err));
+        }
+        size = static_cast<uint64_t>(st.st_size);
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                const int err = errno;
+                close(fd);
+                throw runtime_error("Could not map " + path + ": " + strerror(err));
+            }
+            data = static_cast<const char *>(p);
+            madvise(const_cast<char *>(data), size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    ~FileMapping() {
+        if (data) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+
+    FileMapping(const FileMapping &) = delete;
+    FileMapping &operator=(const FileMapping &) = delete;
+
+    // Pages before `offset` have been sent. Dropping them keeps a large file
+    // from adding to the process' resident memory as it goes out.
+    void sentUpTo(uint64_t offset) {
+        static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        const uint64_t upTo = offset / page * page;
+        if (upTo > dropped) {
+            madvise(const_cast<char *>(data) + dropped, upTo - dropped, MADV_DONTNEED);
+            dropped = upTo;
+        }
+    }
+
+    const char *data = nullptr;
+    uint64_t size = 0;
+    uint64_t dropped = 0;
+};
+
+} // namespace
+
+bool Message::chunk(StreamChunk &chunk) {
+    const PayloadView v = view();
+    StreamFrame frame;
+    if (!frame.read(v.data, v.size)) {
+        return false;
+    }
+    chunk.transfer = frame.transfer;
+    chunk.offset = frame.offset;
+    chunk.total = frame.total;
+    chunk.last = frame.last;
+    chunk.data = PayloadView{v.data + StreamFrame::headerSize, v.size - StreamFrame::headerSize};
+    return true;
+}
+
+uint64_t Participant::sendStream(const OutPort &port, uint64_t size, const StreamSource &source,
+                                 const SendCallback &done, const StreamOptions &options) {
+    auto sender = make_shared<StreamSender>(this, port, size, source, done, options);
+    sender->pump();
+    return sender->transfer;
+}
+
+uint64_t Participant::sendStream(const OutPort &port, const char *data, uint64_t len,
+                                 const SendCallback &done, const StreamOptions &options) {
+    return sendStream(port, len, [data, len](uint64_t offset, uint64_t most) {
+        return PayloadView{data + offset, min(most, len - offset)};
+    }, done, options);
+}
+
+uint64_t Participant::sendFile(const OutPort &port, const string &path,
+                               const SendCallback &done, const StreamOptions &options) {
+    auto file = make_shared<FileMapping>(path);
+    return sendStream(port, file->size, [file](uint64_t offset, uint64_t most) {
+        file->sentUpTo(offset);
+        return PayloadView{file->data + offset, min(most, file->size - offset)};
+    }, done, options);
+}
+
+class StreamReader::Transfers {
+public:
+    Transfers(const DataHandler &data, const FailHandler &failed, size_t maxPending, size_t maxTransfers)
+        : data(data)
+        , failed(failed)
+        , maxPending(max<size_t>(maxPending, 1))
+        , maxTransfers(max<size_t>(maxTransfers, 1))
+    {}
+
+    // `owned` is the message if the caller gave it up, otherwise it is retained when held
+    void take(Message *msg, unique_ptr<Message> owned, const StreamChunk &c) {
+        lock_guard<std::mutex> lock(mutex);
+        const auto r = recent.find(c.transfer);
+        if (r != recent.end()) {
+            // A redelivery of a completed transfer, or the rest of one given up on
+            if (r->second) {
+                msg->nack();
+            } else {
+                msg->ack();
+            }
+            return;
+        }
+
+        Transfer &t = active[c.transfer];
+        t.lastActive = ++clock;
+        if (c.offset < t.next) {
+            msg->ack();
+            return;
+        }
+        if (c.offset > t.next) {
+            t.held[c.offset] = owned ? std::move(owned) : msg->retain();
+            if (t.held.size() > maxPending) {
+                giveUp(c.transfer);
+            }
+            evictStale(c.transfer);
+            return;
+        }
+
+        bool last = deliver(t, c, *msg);
+        while (!last && !t.held.empty() && t.held.begin()->first == t.next) {
+            unique_ptr<Message> next = std::move(t.held.begin()->second);
+            t.held.erase(t.held.begin());
+            StreamChunk nc;
+            next->chunk(nc);
+            last = deliver(t, nc, *next);
+        }
+        if (last) {
+            for (auto &h : t.held) {
+                h.second->nack();
+            }
+            active.erase(c.transfer);
+            remember(c.transfer, false);
+        }
+        evictStale(c.transfer);
+    }
+
+    size_t size() const {
+        lock_guard<std::mutex> lock(mutex);
+        return active.size();
+    }
+
+private:
+    struct Transfer {
+        uint64_t next = 0;
+        uint64_t lastActive = 0;
+        map<uint64_t, unique_ptr<Message>> held;
+    };
+
+    bool deliver(Transfer &t, const StreamChunk &c, Message &msg) {
+        data(c.transfer, c.data.data, c.data.size, c.last);
+        msg.ack();
+        t.next = c.offset + c.data.size;
+        return c.last;
+    }
+
+    void giveUp(uint64_t transfer) {
+        auto t = active.find(transfer);
+        for (auto &h : t->second.held) {
+            h.second->nack();
+        }
+        active.erase(t);
+        remember(transfer, true);
+        if (failed) {
+            failed(transfer);
+        }
+    }
+
+    // Gives up on the transfer that has waited longest for a chunk when there are too many
+    void evictStale(uint64_t current) {
+        while (active.size() > maxTransfers) {
+            auto oldest = active.end();
+            for (auto i = active.begin(); i != active.end(); ++i) {
+                if (i->first != current && (oldest == active.end() || i->second.lastActive < oldest->second.lastActive)) {
+                    oldest = i;
+                }
+            }
+            giveUp(oldest->first);
+        }
+    }
+
+    // Ended transfers are remembered for a while, true for those given up on
+    void remember(uint64_t transfer, bool gaveUp) {
+        recent[transfer] = gaveUp;
+        recentOrder.push_back(transfer);
+        if (recentOrder.size() > 4 * maxTransfers) {
+            recent.erase(recentOrder.front());
+            recentOrder.pop_front();
+        }
+    }
+
+    const DataHandler data;
+    const FailHandler failed;
+    const size_t maxPending;
+    const size_t maxTransfers;
+
+    mutable std::mutex mutex;
+    unordered_map<uint64_t, Transfer> active;
+    unordered_map<uint64_t, bool> recent;
+    deque<uint64_t> recentOrder;
+    uint64_t clock = 0;
+};
+
+StreamReader::StreamReader(const DataHandler &data, const FailHandler &failed, size_t maxPending, size_t maxTransfers)
+    : transfers(new Transfers(data, failed, maxPending, maxTransfers))
+{}
+
+StreamReader::~StreamReader() = default;
+
+bool StreamReader::read(Message *msg) {
+    StreamChunk c;
+    if (!msg->chunk(c)) {
+        return false;
+    }
+    transfers->take(msg, nullptr, c);
+    return true;
+}
+
+bool StreamReader::read(unique_ptr<Message> &msg) {
+    StreamChunk c;
+    if (!msg->chunk(c)) {
+        return false;
+    }
+    unique_ptr<Message> owned = std::move(msg);
+    Message *m = owned.get();
+    transfers->take(m, std::move(owned), c);
+    return true;
+}
+
+size_t StreamReader::activeTransfers() const {
+    return transfers->size();
+}
+
+} // namespace msgflo
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace msgflo {
+
+// The header in front of the data of every chunk message of a stream, 32
+// bytes in network byte order:
+//
+//   0  magic "\0mfs"
+//   4  version, 1
+//   5  flags, lastChunk
+//   6  reserved, 0
+//   8  transfer id
+//  16  offset of the data in the stream
+//  24  size of the stream, or StreamChunk::unknownSize
+//
+// The leading NUL keeps it from being mistaken for JSON or text payloads.
+struct StreamFrame {
+    static const size_t headerSize = 32;
+    static const uint8_t version = 1;
+    static const uint8_t lastChunk = 1;
+
+    uint64_t transfer = 0;
+    uint64_t offset = 0;
+    uint64_t total = 0;
+    bool last = false;
+
+    void write(char *out) const {
+        static const char magic[4] = {'\0', 'm', 'f', 's'};
+        std::memcpy(out, magic, sizeof(magic));
+        out[4] = static_cast<char>(version);
+        out[5] = static_cast<char>(last ? lastChunk : 0);
+        out[6] = 0;
+        out[7] = 0;
+        put(out + 8, transfer);
+        put(out + 16, offset);
+        put(out + 24, total);
+    }
+
+    // False if the payload does not start with a header this version understands
+    bool read(const char *data, uint64_t len) {
+        if (len < headerSize || data[0] != '\0' || data[1] != 'm' || data[2] != 'f' || data[3] != 's' ||
+                static_cast<uint8_t>(data[4]) != version) {
+            return false;
+        }
+        last = (static_cast<uint8_t>(data[5]) & lastChunk) != 0;
+        transfer = get(data + 8);
+        offset = get(data + 16);
+        total = get(data + 24);
+        return true;
+    }
+
+private:
+    static void put(char *out, uint64_t v) {
+        for (int i = 7; i >= 0; i--) {
+            out[i] = static_cast<char>(v & 0xff);
+            v >>= 8;
+        }
+    }
+
+    static uint64_t get(const char *in) {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i++) {
+            v = (v << 8) | static_cast<uint8_t>(in[i]);
+        }
+        return v;
+    }
+};
+
+} // namespace msgflo
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace msgflo {
+
+// Finds the subscriptions matching an MQTT topic. Filters without wildcards are
+// kept in a hash map, filters with `+` or `#` in a trie of topic levels, so the
+// cost of a lookup depends on the topic and the matches, not on the number of
+// subscriptions.
+template<typename Target>
+class TopicIndex {
+public:
+    void add(const std::string &filter, const Target &target) {
+        if (filter.find_first_of("+#") == std::string::npos) {
+            exact[filter].push_back(target);
+            return;
+        }
+
+        Node *node = &root;
+        const auto levels = split(filter);
+        for (size_t i = 0; i < levels.size(); i++) {
+            const auto &level = levels[i];
+            if (level == "#") {
+                node->multiLevel.push_back(target);
+                wildcards++;
+                return;
+            }
+            std::unique_ptr<Node> &child = level == "+" ? node->singleLevel : node->children[level];
+            if (!child) {
+                child.reset(new Node);
+            }
+            node = child.get();
+        }
+        node->targets.push_back(target);
+        wildcards++;
+    }
+
+    // Removes the subscriptions whose target matches the predicate
+    template<typename P>
+    void removeIf(P pred) {
+        for (auto it = exact.begin(); it != exact.end();) {
+            erase(it->second, pred);
+            it = it->second.empty() ? exact.erase(it) : std::next(it);
+        }
+        if (wildcards > 0) {
+            wildcards -= removeLevels(root, pred);
+        }
+    }
+
+    void clear() {
+        exact.clear();
+        root = Node();
+        wildcards = 0;
+    }
+
+    // Calls f(target) for every subscription matching the topic
+    template<typename F>
+    void match(const std::string &topic, F f) const {
+        auto it = exact.find(topic);
+        if (it != exact.end()) {
+            for (const auto &t : it->second) {
+                f(t);
+            }
+        }
+
+        if (wildcards == 0) {
+            return;
+        }
+        const auto levels = split(topic);
+        matchLevels(root, levels, 0, f);
+    }
+
+    static std::vector<std::string> split(const std::string &topic) {
+        std::vector<std::string> levels;
+        size_t start = 0;
+        while (true) {
+            auto end = topic.find('/', start);
+            if (end == std::string::npos) {
+                levels.push_back(topic.substr(start));
+                return levels;
+            }
+            levels.push_back(topic.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        Node(Node &&) = default;
+        Node &operator=(Node &&) = default;
+
+        Node(const Node &other)
+            : singleLevel(other.singleLevel ? new Node(*other.singleLevel) : nullptr)
+            , multiLevel(other.multiLevel)
+            , targets(other.targets)
+        {
+            for (const auto &child : other.children) {
+                children[child.first].reset(new Node(*child.second));
+            }
+        }
+
+        std::unordered_map<std::string, std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> singleLevel;
+        // Filters ending in `#` here, matching this level and everything below
+        std::vector<Target> multiLevel;
+        std::vector<Target> targets;
+    };
+
+    template<typename P>
+    static size_t erase(std::vector<Target> &targets, P &pred) {
+        const size_t before = targets.size();
+        targets.erase(std::remove_if(targets.begin(), targets.end(), pred), targets.end());
+        return before - targets.size();
+    }
+
+    // Empty nodes are left in place, they are few and may be used again
+    template<typename P>
+    static size_t removeLevels(Node &node, P &pred) {
+        size_t removed = erase(node.multiLevel, pred) + erase(node.targets, pred);
+        for (auto &child : node.children) {
+            removed += removeLevels(*child.second, pred);
+        }
+        if (node.singleLevel) {
+            removed += removeLevels(*node.singleLevel, pred);
+        }
+        return removed;
+    }
+
+    template<typename F>
+    static void matchLevels(const Node &node, const std::vector<std::string> &levels, size_t i, F &f) {
+        // Topics starting with $ are not matched by wildcards on the first level
+        const bool wildcardsAllowed = i > 0 || levels[0].empty() || levels[0][0] != '$';
+
+        if (wildcardsAllowed) {
+            for (const auto &t : node.multiLevel) {
+                f(t);
+            }
+        }
+
+        if (i == levels.size()) {
+            for (const auto &t : node.targets) {
+                f(t);
+            }
+            return;
+        }
+
+        auto it = node.children.find(levels[i]);
+        if (it != node.children.end()) {
+            matchLevels(*it->second, levels, i + 1, f);
+        }
+        if (node.singleLevel && wildcardsAllowed) {
+            matchLevels(*node.singleLevel, levels, i + 1, f);
+        }
+    }
+
+    std::unordered_map<std::string, std::vector<Target>> exact;
+    Node root;
+    size_t wildcards = 0;
+};
+
+} // namespace msgflo
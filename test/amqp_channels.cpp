@@ -0,0 +1,245 @@
+// Runs the AMQP engine against the fake AMQP-CPP in fake_amqpcpp/, with
+// EngineConfig::channelPerInport() and publishChannels(): a channel of its
+// own for each inport, exchanges and their sends staying on one publish
+// channel, acks coalesced per channel, a failed inport channel opened and
+// consumed again without touching the others, deliveries of the failed
+// channel not acked on the new one, sends for a failed publish channel
+// waiting until it is open again, a retired inport channel closed once its
+// deliveries are settled, and reconnecting without doubling the consumers.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ev.h>
+
+#include "amqpcpp.h"
+#include "msgflo.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+static const int outports = 8;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// Lets the engine's timers fire, the fake connections do no I/O
+static void runFor(double seconds) {
+    ev_timer timeout;
+    ev_timer_init(&timeout, [](struct ev_loop *loop, ev_timer *, int) {
+        ev_break(loop, EVBREAK_ALL);
+    }, seconds, 0);
+    ev_timer_start(EV_DEFAULT, &timeout);
+    ev_run(EV_DEFAULT, 0);
+    ev_timer_stop(EV_DEFAULT, &timeout);
+}
+
+// The open channel of the connection consuming the queue, if any
+static shared_ptr<AMQP::ChannelLog> consuming(const AMQP::ConnectionLog &c, const string &queue) {
+    for (const auto &ch : c.channels) {
+        if (ch->open && !ch->consumers.empty() && ch->consumers.back().queue == queue) {
+            return ch;
+        }
+    }
+    return nullptr;
+}
+
+static size_t consumers(const AMQP::ConnectionLog &c) {
+    size_t n = 0;
+    for (const auto &ch : c.channels) {
+        n += ch->open ? ch->consumers.size() : 0;
+    }
+    return n;
+}
+
+// The open channels of the connection the exchange was declared on
+static vector<shared_ptr<AMQP::ChannelLog>> declaring(const AMQP::ConnectionLog &c, const string &exchange) {
+    vector<shared_ptr<AMQP::ChannelLog>> found;
+    for (const auto &ch : c.channels) {
+        for (const auto &e : ch->exchanges) {
+            if (ch->open && e == exchange) {
+                found.push_back(ch);
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+static vector<string> sent(const AMQP::ChannelLog &c, const string &exchange) {
+    vector<string> bodies;
+    for (const auto &p : c.published) {
+        if (p.exchange == exchange) {
+            bodies.push_back(p.body);
+        }
+    }
+    return bodies;
+}
+
+static void deliver(AMQP::ChannelLog &c, uint64_t tag, const string &body) {
+    c.consumers.back().received(AMQP::Message(body), tag, false);
+}
+
+static bool acked(const AMQP::ChannelLog &c, const vector<AMQP::ChannelLog::Ack> &expected) {
+    if (c.acks.size() != expected.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (c.acks[i].tag != expected[i].tag || c.acks[i].multiple != expected[i].multiple) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    // The ack flush timer stays out of the way, acks go out once two are pending
+    auto engine = createEngine(EngineConfig().url("amqp://localhost").debugOutput(false)
+                               .channelPerInport(true).publishChannels(2).ackBatch(2, 60 * 1000)
+                               .reconnect(true, 0.001, 0.001));
+
+    Definition d;
+    d.role = "worker";
+    d.component = "AmqpChannelsTest";
+    d.inports = {{"a", "object", "work.a"}, {"b", "object", "work.b"}};
+    d.outports.clear();
+    for (int i = 0; i < outports; i++) {
+        d.outports.push_back({"out" + to_string(i), "object", "results." + to_string(i)});
+    }
+    auto participant = engine->registerParticipant(d);
+    vector<unique_ptr<Message>> held;
+    participant->onMessageAsync([&](unique_ptr<Message> msg) {
+        held.push_back(std::move(msg));
+    });
+    engine->start();
+
+    auto &connections = AMQP::connections();
+    check(connections.size() == 1, "engine made " + to_string(connections.size()) + " connections");
+    auto conn = connections.back();
+    // The shared channel and two publish channels
+    check(conn->channels.size() == 3, "opened " + to_string(conn->channels.size()) + " channels before the connection was ready");
+    auto shared = conn->channels[0];
+    shared->ready();
+
+    auto a = consuming(*conn, "work.a");
+    auto b = consuming(*conn, "work.b");
+    check(a && b && a != b && a != shared && b != shared, "inports are not consumed on channels of their own");
+    check(shared->consumers.empty() && shared->queues.empty(), "inport queues are declared on the shared channel");
+    check(a && a->queues == vector<string>{"work.a"} && b && b->queues == vector<string>{"work.b"},
+          "inport queues are not declared on their own channels");
+    if (!a || !b) {
+        return EXIT_FAILURE;
+    }
+    a->consumers.back().success("ctag-a");
+    b->consumers.back().success("ctag-b");
+
+    // Each exchange is declared on one publish channel, and its sends follow it there in order
+    for (int i = 0; i < outports; i++) {
+        const string exchange = "results." + to_string(i);
+        const auto on = declaring(*conn, exchange);
+        check(on.size() == 1 && on[0] != shared && on[0] != a && on[0] != b,
+              exchange + " is declared on " + to_string(on.size()) + " publish channels");
+        participant->send("out" + to_string(i), string("first"));
+        participant->send("out" + to_string(i), string("second"));
+        check(on.size() == 1 && sent(*on[0], exchange) == vector<string>{"first", "second"},
+              "sends to " + exchange + " are not on the channel it was declared on");
+    }
+
+    // Delivery tags and acks are per channel
+    for (uint64_t tag = 1; tag <= 4; tag++) {
+        deliver(*a, tag, "{}");
+    }
+    deliver(*b, 1, "{}");
+    deliver(*b, 2, "{}");
+    check(held.size() == 6, "handler got " + to_string(held.size()) + " messages");
+    for (auto &m : held) {
+        m->ack();
+    }
+    held.clear();
+    check(acked(*a, {{2, true}, {4, true}}) && acked(*b, {{2, true}}) && shared->acks.empty(),
+          "acks are not coalesced per channel");
+
+    // A failed inport channel is opened and consumed again, the rest carry on
+    deliver(*a, 5, "{}");
+    a->error("PRECONDITION_FAILED");
+    runFor(0.05);
+    auto reopened = consuming(*conn, "work.a");
+    check(connections.size() == 1 && !a->open && reopened && reopened != a,
+          "the failed inport channel was not opened again on the same connection");
+    check(b->open && b->consumers.size() == 1 && shared->open, "other channels were touched by an inport channel error");
+    if (!reopened) {
+        return EXIT_FAILURE;
+    }
+    check(reopened->queues == vector<string>{"work.a"}, "the reopened channel did not declare its queue");
+    reopened->consumers.back().success("ctag-a2");
+
+    // The broker requeued the held delivery, its tag means nothing on the new channel
+    held.front()->ack();
+    held.clear();
+    deliver(*reopened, 1, "{}");
+    deliver(*reopened, 2, "{}");
+    for (auto &m : held) {
+        m->ack();
+    }
+    held.clear();
+    check(acked(*reopened, {{2, true}}) && a->acks.size() == 2,
+          "a delivery of the failed channel was acked on the new one");
+
+    // Sends for a failed publish channel wait until it is open again
+    const string exchange = "results.0";
+    auto publisher = declaring(*conn, exchange).front();
+    publisher->error("NOT_FOUND");
+    const size_t before = publisher->published.size();
+    participant->send("out0", string("waiting"));
+    check(publisher->published.size() == before, "a send went on a failed publish channel");
+    runFor(0.05);
+    const auto replacement = declaring(*conn, exchange);
+    check(!publisher->open && replacement.size() == 1 && replacement[0] != publisher,
+          "the failed publish channel was not opened again with its exchanges");
+    check(replacement.size() == 1 && sent(*replacement[0], exchange) == vector<string>{"waiting"},
+          "the waiting send did not go on the reopened publish channel");
+
+    // A retired inport channel stays open until its deliveries are settled
+    deliver(*b, 3, "{}");
+    engine->unregisterParticipant(participant);
+    runFor(0.01);
+    check(b->cancelled == vector<string>{"ctag-b"}, "the consumer of an unregistered inport was not cancelled");
+    check(b->open, "the channel of an unregistered inport was closed with a delivery unsettled");
+    held.front()->ack();
+    held.clear();
+    runFor(0.01);
+    check(!b->open && acked(*b, {{2, true}, {3, true}}),
+          "the channel of an unregistered inport was not closed after acking its last delivery");
+
+    // Reconnecting sets the inports up once on the new connection
+    participant = engine->registerParticipant(d);
+    participant->onMessage([](Message *msg) {
+        msg->ack();
+    });
+    conn->handler->onError(conn->connection, "connection reset");
+    runFor(0.05);
+    check(connections.size() == 2 && !conn->open, "the lost connection was not replaced");
+    conn = connections.back();
+    conn->channels[0]->ready();
+    check(consumers(*conn) == 2, "consuming " + to_string(consumers(*conn)) + " times after reconnecting");
+    auto again = consuming(*conn, "work.b");
+    check(again && again != conn->channels[0], "an inport is not consumed on a channel of its own after reconnecting");
+    if (again) {
+        deliver(*again, 1, "{}");
+        deliver(*again, 2, "{}");
+        check(acked(*again, {{2, true}}), "acks did not go on the new connection's channel");
+    }
+
+    if (failures == 0) {
+        cout << "amqp_channels: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,43 @@
+// Checks the reconnect backoff: delays double up to the maximum, are spread
+// between half and all of it, and start over after a reset.
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "backoff.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+int main() {
+    Backoff b(0.1, 5, 7);
+    double ceiling = 0.1;
+    for (int i = 0; i < 100; i++) {
+        const double d = b.next();
+        check(d >= ceiling / 2 && d <= ceiling, "attempt " + to_string(i) + " waits " + to_string(d) + "s");
+        ceiling = std::min(ceiling * 2, 5.0);
+    }
+    check(b.attempts() == 62, "attempts are not capped");
+
+    b.reset();
+    check(b.attempts() == 0 && b.next() <= 0.1, "reset did not start over");
+
+    // Clients that lost the broker together spread their first attempts
+    Backoff c(1, 1, 1), d(1, 1, 2);
+    check(c.next() != d.next(), "differently seeded backoffs wait the same");
+
+    if (failures == 0) {
+        cout << "backoff: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
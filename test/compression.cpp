@@ -0,0 +1,268 @@
+// Checks compressed outports without a broker: payloads above the threshold
+// go out compressed with lz4 and zstd, with and without a dictionary, the
+// rest as they are, and received messages read the same either way.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "abstract_message.h"
+#include "participant.h"
+
+using namespace std;
+using namespace msgflo;
+
+static const uint64_t maxInflated = EngineConfig().maxDecompressedSize();
+
+// As received from a sender marking its compressed payloads, unless `max` is 0
+struct WireMessage final : public AbstractMessage {
+    WireMessage(const char *data, uint64_t len, uint64_t max = maxInflated)
+        : AbstractMessage(data, len, "in", &jsonCodec(), max)
+    {}
+
+    WireMessage(PayloadBuffer &&payload, uint64_t max)
+        : AbstractMessage(std::move(payload), "in", &jsonCodec(), max)
+    {}
+
+    virtual unique_ptr<Message> retain() override {
+        const uint64_t max = inflateLimit();
+        return unique_ptr<Message>(new WireMessage(takePayload(), max));
+    }
+
+    virtual void ack() override {}
+    virtual void nack() override {}
+};
+
+// Keeps what would have gone to the broker
+struct CaptureEngine {
+    vector<string> sent;
+    // Whether each was marked as compressed
+    vector<bool> marked;
+
+    void send(const ParticipantRegistrationT<CaptureEngine> *r, const OutPortState &port,
+              const char *data, uint64_t len, bool compressed, const SendCallback &done) {
+        sent.push_back(string(data, len));
+        marked.push_back(compressed);
+    }
+
+    void sendBatch(const ParticipantRegistrationT<CaptureEngine> *r, const OutPortState &port,
+                   const vector<PayloadView> &payloads, const vector<bool> &compressed, const SendCallback &done) {
+        for (size_t i = 0; i < payloads.size(); i++) {
+            sent.push_back(payloads[i].str());
+            marked.push_back(!compressed.empty() && compressed[i]);
+        }
+    }
+};
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// JSON as sensors send it
+static string readings(int count) {
+    string s = "{\"samples\":[";
+    for (int i = 0; i < count; i++) {
+        s += (i > 0 ? "," : "");
+        s += "{\"sensor\":\"temperature-" + to_string(i % 4) + "\",\"value\":" + to_string(20 + i * 0.25) + ",\"unit\":\"C\"}";
+    }
+    return s + "]}";
+}
+
+// Whether reading the payload fails, without it having been decompressed
+static bool refused(const string &wire, uint64_t max = maxInflated) {
+    WireMessage m(wire.data(), wire.size(), max);
+    try {
+        m.asString();
+    } catch (domain_error &) {
+        return m.payloadSize() == wire.size();
+    }
+    return false;
+}
+
+// The payload with its header claiming another size before compression
+static string claiming(string wire, uint64_t size) {
+    for (int i = 23; i >= 16; i--) {
+        wire[i] = static_cast<char>(size & 0xff);
+        size >>= 8;
+    }
+    return wire;
+}
+
+static Definition definition(const string &algorithm, const string &dictionary = "") {
+    Definition def;
+    def.role = "compressor";
+    Definition::Port out("out", "object", "compressor.OUT");
+    out.compression = algorithm;
+    out.compressionThreshold = 256;
+    out.compressionDictionary = dictionary;
+    def.outports = {out};
+    return def;
+}
+
+static void roundTrip(const string &algorithm, const string &dictionary) {
+    const string name = algorithm + (dictionary.empty() ? "" : " with dictionary");
+    CaptureEngine engine;
+    ParticipantRegistrationT<CaptureEngine> participant(&engine, 0, definition(algorithm, dictionary));
+    const string body = readings(50);
+    string err;
+    const json11::Json large = json11::Json::parse(body, err);
+
+    participant.send("out", body);
+    participant.send("out", string("{\"small\":true}"));
+    check(engine.sent.size() == 2, name + ": sent " + to_string(engine.sent.size()));
+    check(engine.sent[0].size() < body.size() / 3,
+          name + ": compressed " + to_string(body.size()) + " to " + to_string(engine.sent[0].size()) + " bytes");
+    check(engine.sent[1] == "{\"small\":true}", name + ": payload below the threshold was changed");
+    check(engine.marked[0] && !engine.marked[1], name + ": payloads marked wrongly");
+
+    WireMessage received(engine.sent[0].data(), engine.sent[0].size());
+    check(received.payloadSize() == body.size() && received.wireSize() == engine.sent[0].size(), name + ": sizes differ");
+    check(received.asJson() == large, name + ": JSON differs");
+    check(received.asString() == body, name + ": string differs");
+    const PayloadView v = received.view();
+    check(string(v.data, v.size) == body, name + ": view differs");
+
+    // A retained copy of a borrowed message that was not read yet decompresses on its own
+    WireMessage unread(engine.sent[0].data(), engine.sent[0].size());
+    unique_ptr<Message> retained = unread.retain();
+    check(retained->asString() == body, name + ": retained copy differs");
+    unique_ptr<Message> again = static_cast<WireMessage &>(*retained).retain();
+    check(again->asString() == body, name + ": copy of a decompressed message differs");
+
+    // Counted before compression, and as sent
+    vector<PortStats> stats;
+    participant.collectStats(stats);
+    const PortStats &out = stats.back();
+    check(out.bytes == body.size() + 14 && out.wireBytes == engine.sent[0].size() + 14,
+          name + ": counted " + to_string(out.bytes) + " bytes, " + to_string(out.wireBytes) + " on the wire");
+
+    PortCounters inport;
+    WireMessage handled(engine.sent[0].data(), engine.sent[0].size());
+    ParticipantRegistrationT<CaptureEngine> receiver(&engine, 1, Definition());
+    receiver.onMessage([&](Message *m) {
+        check(m->asJson() == large, name + ": handler got a different payload");
+    });
+    runHandler(receiver, inport, handled);
+    check(inport.bytes == body.size() && inport.wireBytes == engine.sent[0].size(), name + ": inport counted wrong sizes");
+
+    engine.sent.clear();
+    engine.marked.clear();
+    const string second = readings(40);
+    participant.sendBatch("out", vector<PayloadView>{{body.data(), body.size()}, {"[]", 2}, {second.data(), second.size()}},
+                          SendCallback());
+    check(engine.sent.size() == 3 && engine.sent[1] == "[]", name + ": batch differs");
+    check(engine.marked == vector<bool>{true, false, true}, name + ": batch payloads marked wrongly");
+    check(engine.sent[0].size() < body.size() && engine.sent[2].size() < second.size(), name + ": batch was not compressed");
+    check(WireMessage(engine.sent[2].data(), engine.sent[2].size()).asString() == second, name + ": batch payload differs");
+}
+
+int main() {
+    // Random bytes do not compress and go out as they are
+    string noise(4096, '\0');
+    mt19937 random(1);
+    for (auto &c : noise) {
+        c = static_cast<char>(random());
+    }
+
+    // Samples of what the payloads contain, as a raw zstd dictionary
+    string dictionary;
+    for (int i = 0; i < 8; i++) {
+        dictionary += readings(1);
+    }
+
+    int algorithms = 0;
+    for (const string algorithm : {"lz4", "zstd"}) {
+        if (!compressionAvailable(algorithm)) {
+            cout << "compression: built without " << algorithm << endl;
+            continue;
+        }
+        algorithms++;
+        roundTrip(algorithm, "");
+        if (algorithm == "zstd") {
+            roundTrip(algorithm, dictionary);
+        }
+
+        CaptureEngine engine;
+        ParticipantRegistrationT<CaptureEngine> participant(&engine, 0, definition(algorithm));
+        participant.send("out", noise);
+        check(engine.sent.size() == 1 && engine.sent[0] == noise && !engine.marked[0],
+              algorithm + ": incompressible payload was changed");
+
+        // Only decompressed when known to be compressed, and up to what the limit and the compressed bytes allow
+        const string body = readings(50);
+        participant.send("out", body);
+        const string &wire = engine.sent[1];
+        check(WireMessage(wire.data(), wire.size(), 0).asString() == wire, algorithm + ": unmarked payload was decompressed");
+        check(!refused(wire, body.size()) && refused(wire, body.size() - 1), algorithm + ": limit not applied");
+        check(refused(claiming(wire, uint64_t(1) << 62)), algorithm + ": oversized payload was decompressed");
+        check(refused(claiming(wire, 0)), algorithm + ": empty payload was decompressed");
+        if (algorithm == "lz4") {
+            check(refused(claiming(wire, 256 * wire.size())), "lz4: size beyond what the payload expands to was decompressed");
+        } else {
+            check(refused(claiming(wire, body.size() + 1)), "zstd: size differing from the frame's was decompressed");
+        }
+
+        // A payload below the threshold that only looks compressed is not marked
+        const string lookalike = string("\0mfc", 4) + string(60, '\x01');
+        participant.send("out", lookalike.data(), lookalike.size());
+        check(engine.sent.back() == lookalike && !engine.marked.back(), algorithm + ": uncompressed payload was marked");
+    }
+
+    if (compressionAvailable("zstd")) {
+        // A dictionary id the receiver does not know
+        CaptureEngine engine;
+        ParticipantRegistrationT<CaptureEngine> participant(&engine, 0, definition("zstd", dictionary));
+        participant.send("out", readings(50));
+        string wire = engine.sent[0];
+        wire[11] = static_cast<char>(wire[11] ^ 0x5a);
+        WireMessage unknown(wire.data(), wire.size());
+        bool threw = false;
+        try {
+            unknown.asString();
+        } catch (domain_error &) {
+            threw = true;
+        }
+        check(threw, "payload with an unknown dictionary was read");
+    }
+
+    bool threw = false;
+    try {
+        CaptureEngine engine;
+        ParticipantRegistrationT<CaptureEngine> participant(&engine, 0, definition("brotli"));
+    } catch (invalid_argument &) {
+        threw = true;
+    }
+    check(threw, "unknown compression was accepted");
+
+    threw = false;
+    try {
+        Definition def;
+        def.role = "decompressor";
+        Definition::Port in("in", "object", "decompressor.IN");
+        in.compression = "brotli";
+        def.inports = {in};
+        CaptureEngine engine;
+        ParticipantRegistrationT<CaptureEngine> participant(&engine, 0, def);
+    } catch (invalid_argument &) {
+        threw = true;
+    }
+    check(threw, "unknown compression of an inport was accepted");
+
+    // Uncompressed payloads are untouched, even when they happen to be binary
+    WireMessage plain(noise.data(), noise.size());
+    check(plain.payloadSize() == noise.size() && plain.asString() == noise, "uncompressed payload differs");
+
+    if (failures == 0) {
+        cout << "compression: ok (" << algorithms << " algorithms)" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,118 @@
+// Checks the discovery scheduler on a simulated clock: sends stay within the
+// token budget, every participant is resent about once a period, the sends
+// spread over the period, and removed participants are no longer sent.
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "discovery_scheduler.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+// Runs the scheduler like the engine's timer does, until `end`
+static void simulate(DiscoveryScheduler &s, double start, double end, map<size_t, vector<double>> &sends) {
+    double now = start;
+    while (now < end) {
+        const double next = s.run(now, [&](size_t id) {
+            sends[id].push_back(now);
+        });
+        if (next < 0) {
+            return;
+        }
+        now += std::max(next, 1e-6);
+    }
+}
+
+int main() {
+    const size_t participants = 2000;
+    const double period = 20;
+    const double rate = 200;
+    const size_t burst = 20;
+
+    {
+        DiscoveryScheduler s(period, rate, burst, 0.1, 42);
+        for (size_t i = 0; i < participants; i++) {
+            s.add(i, 0);
+        }
+        map<size_t, vector<double>> sends;
+        simulate(s, 0, 10 * period, sends);
+
+        vector<double> all;
+        for (size_t i = 0; i < participants; i++) {
+            const auto &times = sends[i];
+            check(!times.empty() && times.front() <= 0.1 * period + participants / rate,
+                  "participant " + to_string(i) + " was not sent after starting");
+            for (size_t t = 1; t < times.size(); t++) {
+                const double gap = times[t] - times[t - 1];
+                if (gap < 0.9 * period - 0.01 || gap > 1.1 * period + 1) {
+                    check(false, "participant " + to_string(i) + " resent after " + to_string(gap) + "s");
+                    break;
+                }
+            }
+            all.insert(all.end(), times.begin(), times.end());
+        }
+        std::sort(all.begin(), all.end());
+
+        // The token bucket holds in every one second window
+        size_t worstSecond = 0;
+        for (size_t a = 0, b = 0; b < all.size(); b++) {
+            while (all[b] - all[a] >= 1) {
+                a++;
+            }
+            worstSecond = std::max(worstSecond, b - a + 1);
+        }
+        check(worstSecond <= rate + burst, to_string(worstSecond) + " sends in one second");
+
+        // Once the startup has passed, sends are spread out instead of coming in one burst per period
+        size_t worstTenth = 0;
+        for (size_t a = 0, b = 0; b < all.size(); b++) {
+            while (all[b] - all[a] >= 0.1) {
+                a++;
+            }
+            if (all[b] > 3 * period) {
+                worstTenth = std::max(worstTenth, b - a + 1);
+            }
+        }
+        check(worstTenth < participants / 10, to_string(worstTenth) + " sends in 100ms after startup");
+    }
+
+    {
+        DiscoveryScheduler s(period, 0, 1, 0, 1);
+        s.add(1, 0);
+        s.add(2, 0);
+        s.add(3, 0);
+        s.remove(2);
+        map<size_t, vector<double>> sends;
+        simulate(s, 0, 2.5 * period, sends);
+        check(sends[1].size() == 3 && sends[3].size() == 3, "unlimited rate did not send every period");
+        check(sends[2].empty(), "a removed participant was sent");
+
+        // Adding again after removing does not pick up the old schedule
+        s.add(2, 2.5 * period);
+        s.restart(2.5 * period);
+        check(s.size() == 3, "restart changed the participants");
+        sends.clear();
+        simulate(s, 2.5 * period, 2.5 * period + 1, sends);
+        check(sends[1].size() == 1 && sends[2].size() == 1 && sends[3].size() == 1,
+              "restart did not send every participant once");
+    }
+
+    if (failures == 0) {
+        cout << "discovery_scheduler: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
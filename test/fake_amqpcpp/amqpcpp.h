@@ -0,0 +1,330 @@
+// Stands in for AMQP-CPP in test/amqp_channels.cpp. Only the parts the AMQP
+// engine uses are here. Nothing goes over the network: each connection and
+// channel records what it is asked to do, and the test plays the broker by
+// calling the callbacks the engine registered.
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace AMQP {
+
+enum { durable = 1, passive = 2, multiple = 4, requeue = 8 };
+enum ExchangeType { fanout, direct, topic, headers };
+
+struct LongLongInt {
+    LongLongInt(int64_t value)
+        : value(value)
+    {}
+
+    int64_t value;
+};
+
+struct Field {
+    operator int64_t() const {
+        return value;
+    }
+
+    int64_t value = 0;
+};
+
+struct Table {
+    Table &set(const std::string &key, const LongLongInt &v) {
+        fields[key].value = v.value;
+        return *this;
+    }
+
+    bool contains(const std::string &key) const {
+        return fields.count(key) > 0;
+    }
+
+    const Field &get(const std::string &key) const {
+        return fields.at(key);
+    }
+
+    std::map<std::string, Field> fields;
+};
+
+class Envelope {
+public:
+    Envelope(const char *data, uint64_t size)
+        : _body(data, size)
+    {}
+
+    const char *body() const {
+        return _body.data();
+    }
+
+    uint64_t bodySize() const {
+        return _body.size();
+    }
+
+    bool hasContentType() const {
+        return !_contentType.empty();
+    }
+
+    const std::string &contentType() const {
+        return _contentType;
+    }
+
+    void setContentType(const std::string &type) {
+        _contentType = type;
+    }
+
+    bool hasContentEncoding() const {
+        return !_contentEncoding.empty();
+    }
+
+    const std::string &contentEncoding() const {
+        return _contentEncoding;
+    }
+
+    void setContentEncoding(const std::string &encoding) {
+        _contentEncoding = encoding;
+    }
+
+    bool hasHeaders() const {
+        return !_headers.fields.empty();
+    }
+
+    const Table &headers() const {
+        return _headers;
+    }
+
+    void setHeaders(const Table &headers) {
+        _headers = headers;
+    }
+
+private:
+    std::string _body;
+    std::string _contentType;
+    std::string _contentEncoding;
+    Table _headers;
+};
+
+class Message : public Envelope {
+public:
+    explicit Message(const std::string &body)
+        : Envelope(body.data(), body.size())
+    {}
+};
+
+class Address {
+public:
+    Address(const std::string &url)
+        : url(url)
+    {}
+
+    std::string url;
+};
+
+// Keeps the callbacks it is given, none are called unless the test does
+struct Deferred {
+    Deferred &onSuccess(const std::function<void()> &f) {
+        success = f;
+        return *this;
+    }
+
+    std::function<void()> success;
+};
+
+struct DeferredQueue {
+    DeferredQueue &onSuccess(const std::function<void(const std::string &, uint32_t, uint32_t)> &f) {
+        success = f;
+        return *this;
+    }
+
+    std::function<void(const std::string &, uint32_t, uint32_t)> success;
+};
+
+struct DeferredConfirm {
+    DeferredConfirm &onAck(const std::function<void(uint64_t, bool)> &f) {
+        ack = f;
+        return *this;
+    }
+
+    DeferredConfirm &onNack(const std::function<void(uint64_t, bool, bool)> &f) {
+        nack = f;
+        return *this;
+    }
+
+    std::function<void(uint64_t, bool)> ack;
+    std::function<void(uint64_t, bool, bool)> nack;
+};
+
+// A basic.consume, started by calling success() with a consumer tag
+struct DeferredConsumer {
+    DeferredConsumer &onSuccess(const std::function<void(const std::string &)> &f) {
+        success = f;
+        return *this;
+    }
+
+    DeferredConsumer &onReceived(const std::function<void(const Message &, uint64_t, bool)> &f) {
+        received = f;
+        return *this;
+    }
+
+    std::string queue;
+    uint16_t prefetch = 0;
+    std::function<void(const std::string &)> success;
+    std::function<void(const Message &, uint64_t, bool)> received;
+};
+
+class TcpConnection;
+
+class TcpHandler {
+public:
+    virtual ~TcpHandler() {}
+
+    virtual void onError(TcpConnection *connection, const char *message) {}
+};
+
+// Everything a channel was asked to do, kept after the channel is destroyed
+struct ChannelLog {
+    struct Publish {
+        std::string exchange;
+        std::string body;
+    };
+
+    struct Ack {
+        uint64_t tag;
+        bool multiple;
+    };
+
+    bool open = true;
+    std::function<void()> ready;
+    std::function<void(const char *)> error;
+    DeferredConfirm confirms;
+    std::vector<std::string> queues;
+    std::vector<std::string> exchanges;
+    // Deque, so the engine's references to earlier consumers stay valid
+    std::deque<DeferredConsumer> consumers;
+    std::vector<std::string> cancelled;
+    std::vector<Publish> published;
+    std::vector<Ack> acks;
+    std::vector<uint64_t> rejected;
+};
+
+struct ConnectionLog {
+    bool open = true;
+    TcpHandler *handler;
+    TcpConnection *connection;
+    // In the order they were opened
+    std::vector<std::shared_ptr<ChannelLog>> channels;
+};
+
+// All connections made, in order
+inline std::vector<std::shared_ptr<ConnectionLog>> &connections() {
+    static std::vector<std::shared_ptr<ConnectionLog>> all;
+    return all;
+}
+
+class TcpConnection {
+public:
+    TcpConnection(TcpHandler *handler, const Address &address)
+        : log(std::make_shared<ConnectionLog>())
+    {
+        log->handler = handler;
+        log->connection = this;
+        connections().push_back(log);
+    }
+
+    ~TcpConnection() {
+        log->open = false;
+        log->connection = nullptr;
+    }
+
+    int fileno() const {
+        return -1;
+    }
+
+    size_t queued() const {
+        return 0;
+    }
+
+    const std::shared_ptr<ConnectionLog> log;
+};
+
+class TcpChannel {
+public:
+    explicit TcpChannel(TcpConnection *connection)
+        : log(std::make_shared<ChannelLog>())
+    {
+        connection->log->channels.push_back(log);
+    }
+
+    ~TcpChannel() {
+        log->open = false;
+    }
+
+    void onReady(const std::function<void()> &f) {
+        log->ready = f;
+    }
+
+    void onError(const std::function<void(const char *)> &f) {
+        log->error = f;
+    }
+
+    DeferredConfirm &confirmSelect() {
+        return log->confirms;
+    }
+
+    Deferred &setQos(uint16_t prefetch) {
+        qos = prefetch;
+        return deferred;
+    }
+
+    DeferredQueue &declareQueue(const std::string &name, int flags = 0) {
+        if (!(flags & passive)) {
+            log->queues.push_back(name);
+        }
+        return queueDeferred;
+    }
+
+    Deferred &declareExchange(const std::string &name, ExchangeType type = fanout) {
+        log->exchanges.push_back(name);
+        return deferred;
+    }
+
+    DeferredConsumer &consume(const std::string &queue) {
+        log->consumers.emplace_back();
+        log->consumers.back().queue = queue;
+        log->consumers.back().prefetch = qos;
+        return log->consumers.back();
+    }
+
+    Deferred &cancel(const std::string &tag) {
+        log->cancelled.push_back(tag);
+        return deferred;
+    }
+
+    bool publish(const std::string &exchange, const std::string &routingKey, const Envelope &envelope) {
+        log->published.push_back(ChannelLog::Publish{exchange, std::string(envelope.body(), envelope.bodySize())});
+        return true;
+    }
+
+    bool ack(uint64_t tag, int flags = 0) {
+        log->acks.push_back(ChannelLog::Ack{tag, (flags & multiple) != 0});
+        return true;
+    }
+
+    bool reject(uint64_t tag, int flags = 0) {
+        log->rejected.push_back(tag);
+        return true;
+    }
+
+    const std::shared_ptr<ChannelLog> log;
+
+private:
+    uint16_t qos = 0;
+    Deferred deferred;
+    DeferredQueue queueDeferred;
+};
+
+}
@@ -0,0 +1,16 @@
+// See ../amqpcpp.h. The fake connections do no I/O, so the loop is not used.
+
+#pragma once
+
+#include <ev.h>
+
+#include "../amqpcpp.h"
+
+namespace AMQP {
+
+class LibEvHandler : public TcpHandler {
+public:
+    explicit LibEvHandler(struct ev_loop *loop) {}
+};
+
+}
@@ -0,0 +1,117 @@
+// Checks that the loop thread never waits for the handler threads: it hands
+// messages over through a HandoffBacklog while the handlers make sends with
+// OverflowPolicy::Block, which wait for the loop to drain the outbound queue.
+// With a blocking handoff the two would wait for each other forever.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "inport_scheduler.h"
+#include "mpmc_ring.h"
+#include "outbound_queue.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static const int total = 5000;
+// Read per loop iteration, more than the handoff and the outbound queue hold
+static const int burst = 32;
+
+struct Run {
+    OutboundQueue outbound{4, 0, OverflowPolicy::Block};
+    atomic<int> handled{0};
+    atomic<bool> room{false};
+    // Holds the handlers back until the loop has filled the handoff
+    atomic<bool> open{false};
+};
+
+static void handle(Run &run, int n) {
+    while (!run.open) {
+        this_thread::yield();
+    }
+    run.outbound.push(OutboundQueue::Item{nullptr, nullptr, to_string(n), SendCallback()}, true);
+    run.handled++;
+}
+
+// The loop: reads a burst while nothing is backed up, publishes what the
+// handlers sent, and hands the backlog over when the workers have room
+static void loop(const string &name, Run &run, Workers<int> &workers) {
+    HandoffBacklog<int> backlog(workers);
+    workers.onRoom([&run]() {
+        run.room = true;
+    });
+    int read = 0, published = 0, backedUp = 0;
+    while (published < total) {
+        if (run.room.exchange(false)) {
+            backlog.drain();
+        }
+        for (int i = 0; i < burst && read < total && !backlog.backedUp(); i++) {
+            backlog.push(int(read++));
+        }
+        if (backlog.backedUp()) {
+            backedUp++;
+        }
+        run.open = true;
+        run.outbound.drain([](const OutboundQueue::Item &) {
+            return true;
+        }, [&published](OutboundQueue::Item &) {
+            published++;
+        });
+        this_thread::yield();
+    }
+    check(backedUp > 0, name + ": the handoff never filled up");
+    check(!backlog.backedUp(), name + ": messages left in the backlog");
+}
+
+int main() {
+    // A deadlock fails the test instead of hanging it
+    thread([]() {
+        this_thread::sleep_for(chrono::seconds(30));
+        cerr << "FAIL: the loop and the handlers are waiting for each other" << endl;
+        _Exit(EXIT_FAILURE);
+    }).detach();
+
+    {
+        Run run;
+        {
+            RingWorkers<int> workers(4, 2, [&run](int &n) {
+                handle(run, n);
+            });
+            loop("ring", run, workers);
+        }
+        check(run.handled == total, "ring: handled " + to_string(run.handled.load()) + " messages");
+    }
+
+    {
+        Run run;
+        static const int port = 0;
+        {
+            ScheduledWorkers<int> workers(4, 2, [](const int &) {
+                return InportShare{&port, 0, 1, 8};
+            }, [&run](int &n) {
+                handle(run, n);
+            });
+            loop("scheduled", run, workers);
+        }
+        check(run.handled == total, "scheduled: handled " + to_string(run.handled.load()) + " messages");
+    }
+
+    if (failures == 0) {
+        cout << "handoff: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,153 @@
+// Checks the order deliveries leave an InportScheduler in: ports share in
+// proportion to their weight, counted in bytes, a higher priority goes
+// first, a port that was idle does not get to catch up nor is kept, and
+// handler threads fed by a flooded port still get to the other ports'
+// deliveries early.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "inport_scheduler.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+struct Delivery {
+    int port;
+    int n;
+};
+
+int main() {
+    const int data = 0, bulk = 1, control = 2;
+    const int ports[3] = {data, bulk, control};
+    const auto share = [&](int port, int priority, int weight, uint64_t cost) {
+        return InportShare{&ports[port], priority, weight, cost};
+    };
+
+    {
+        // Weights 1 and 3 with payloads of the same size
+        InportScheduler<Delivery> scheduler;
+        for (int i = 0; i < 400; i++) {
+            scheduler.push(share(data, 0, 1, 960), Delivery{data, i});
+            scheduler.push(share(bulk, 0, 3, 960), Delivery{bulk, i});
+        }
+        map<int, int> taken;
+        Delivery d;
+        for (int i = 0; i < 400; i++) {
+            check(scheduler.pop(d), "scheduler ran dry");
+            taken[d.port]++;
+        }
+        check(taken[data] >= 95 && taken[data] <= 105 && taken[bulk] >= 295 && taken[bulk] <= 305,
+              "weights 1 and 3 took " + to_string(taken[data]) + " and " + to_string(taken[bulk]));
+
+        // Each port's deliveries keep their order
+        int last[2] = {-1, -1};
+        bool ordered = true;
+        while (scheduler.pop(d)) {
+            ordered = ordered && d.n > last[d.port];
+            last[d.port] = d.n;
+        }
+        check(ordered && scheduler.empty(), "deliveries of a port were reordered");
+        // Unregistered ports are not kept around, nor their addresses mistaken for new ports'
+        check(scheduler.ports() == 0, "kept " + to_string(scheduler.ports()) + " idle ports");
+    }
+
+    {
+        // Equal weights share bytes, not messages
+        InportScheduler<Delivery> scheduler;
+        for (int i = 0; i < 100; i++) {
+            scheduler.push(share(data, 0, 1, 8192 - InportScheduler<Delivery>::overhead), Delivery{data, i});
+        }
+        for (int i = 0; i < 1000; i++) {
+            scheduler.push(share(bulk, 0, 1, 1024 - InportScheduler<Delivery>::overhead), Delivery{bulk, i});
+        }
+        map<int, int> taken;
+        Delivery d;
+        for (int i = 0; i < 180; i++) {
+            scheduler.pop(d);
+            taken[d.port]++;
+        }
+        check(taken[data] >= 18 && taken[data] <= 22,
+              "8 KiB deliveries took " + to_string(taken[data]) + " turns out of 180");
+    }
+
+    {
+        // A control message arriving behind a flood goes next
+        InportScheduler<Delivery> scheduler;
+        for (int i = 0; i < 1000; i++) {
+            scheduler.push(share(data, 0, 1, 100), Delivery{data, i});
+        }
+        Delivery d;
+        scheduler.pop(d);
+        scheduler.push(share(control, 1, 1, 20), Delivery{control, 0});
+        check(scheduler.pop(d) && d.port == control, "higher priority did not go first");
+
+        // A port idle for a while starts over instead of catching up
+        for (int i = 0; i < 500; i++) {
+            scheduler.pop(d);
+        }
+        scheduler.push(share(bulk, 0, 1, 100), Delivery{bulk, 0});
+        scheduler.push(share(bulk, 0, 1, 100), Delivery{bulk, 1});
+        int before = 0;
+        while (scheduler.pop(d) && d.port != bulk) {
+            before++;
+        }
+        check(before <= 25, to_string(before) + " data deliveries went before a port becoming busy");
+    }
+
+    {
+        // Handler threads under a flood: the control message is among the
+        // next ones taken, not behind the 64 data messages waiting
+        mutex m;
+        vector<int> order;
+        // Taken by the workers when the control message was pushed
+        size_t handledBefore = 0;
+        {
+            ScheduledWorkers<Delivery> workers(64, 2, [&](const Delivery &d) {
+                return share(d.port, d.port == control ? 1 : 0, 1, 500);
+            }, [&](Delivery &d) {
+                {
+                    lock_guard<mutex> lock(m);
+                    order.push_back(d.port);
+                }
+                this_thread::sleep_for(chrono::microseconds(50));
+            });
+            // One producer, as the engines' loop or network thread
+            for (int i = 0; i < 2000; i++) {
+                workers.push(Delivery{data, i});
+                if (i == 1000) {
+                    workers.push(Delivery{control, 0});
+                    lock_guard<mutex> lock(m);
+                    handledBefore = order.size();
+                }
+            }
+        }
+
+        size_t position = 0;
+        while (position < order.size() && order[position] != control) {
+            position++;
+        }
+        check(order.size() == 2001, "workers handled " + to_string(order.size()) + " deliveries");
+        check(position < order.size() && position <= handledBefore + 2,
+              "control message was handled after " + to_string(position - handledBefore) + " more data messages");
+    }
+
+    if (failures == 0) {
+        cout << "inport_scheduler: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
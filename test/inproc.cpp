@@ -0,0 +1,267 @@
+// Runs participants over the inproc:// engine: fanout to every queue bound to
+// a topic, turns between instances of the same role, fanout to two inports of
+// one role on the same topic, shared
+// payloads, engines meeting on the same named broker and sharing one loop,
+// participants registered and unregistered while the loop runs, and an async
+// handler.
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ev.h>
+
+#include "msgflo.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+static const int more = 10;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static Definition definition(const string &role, const string &inQueue, const string &outQueue) {
+    Definition d;
+    d.role = role;
+    d.component = "InprocTest";
+    if (!inQueue.empty()) {
+        d.inports = {{"in", "object", inQueue}};
+    }
+    if (!outQueue.empty()) {
+        d.outports = {{"out", "object", outQueue}};
+    }
+    return d;
+}
+
+int main() {
+    const int messages = 100;
+
+    auto engine = createEngine(EngineConfig().url("inproc://test").debugOutput(false));
+    // A second engine on the same named broker, and one on another broker
+    auto other = createEngine(EngineConfig().url("inproc://test").debugOutput(false));
+    auto elsewhere = createEngine(EngineConfig().url("inproc://elsewhere").debugOutput(false));
+
+    auto source = engine->registerParticipant(definition("source", "", "numbers"));
+    auto sink1 = engine->registerParticipant(definition("sink", "numbers", ""));
+    auto sink2 = engine->registerParticipant(definition("sink", "numbers", ""));
+    auto tap = other->registerParticipant(definition("tap", "numbers", ""));
+    auto stray = elsewhere->registerParticipant(definition("stray", "numbers", ""));
+
+    map<string, int> received;
+    int sum = 0;
+    const char *sinkData = nullptr;
+    const char *tapData = nullptr;
+    unique_ptr<Message> retained;
+
+    auto done = [&]() {
+        return received["sink1"] + received["sink2"] == messages && received["tap"] == messages;
+    };
+
+    sink1->onMessage([&](Message *msg) {
+        received["sink1"]++;
+        sum += msg->asJson()["n"].int_value();
+        msg->ack();
+    });
+    sink2->onMessage([&](Message *msg) {
+        received["sink2"]++;
+        sum += msg->asJson()["n"].int_value();
+        if (received["sink2"] == 1) {
+            sinkData = msg->view().data;
+        }
+        msg->ack();
+    });
+    tap->onMessage([&](Message *msg) {
+        received["tap"]++;
+        if (received["tap"] == 2) {
+            tapData = msg->view().data;
+            retained = msg->retain();
+        }
+        msg->ack();
+        if (done()) {
+            ev_break(EV_DEFAULT, EVBREAK_ALL);
+        }
+    });
+    stray->onMessage([&](Message *msg) {
+        received["stray"]++;
+        msg->ack();
+    });
+
+    // Sent before launch, delivered once the loop runs
+    for (int i = 1; i <= messages; i++) {
+        source->send("out", json11::Json::object {{"n", i}});
+    }
+
+    struct ev_timer timeout;
+    ev_timer_init(&timeout, [](struct ev_loop *loop, ev_timer *, int) {
+        ev_break(loop, EVBREAK_ALL);
+    }, 5, 0);
+    ev_timer_start(EV_DEFAULT, &timeout);
+
+    // All three run on the loop launched by the first
+    other->start();
+    elsewhere->start();
+    engine->launch();
+    ev_timer_stop(EV_DEFAULT, &timeout);
+
+    check(done(), "not every message arrived");
+    check(received["sink1"] == messages / 2 && received["sink2"] == messages / 2,
+          "sinks got " + to_string(received["sink1"]) + " and " + to_string(received["sink2"]) + " messages");
+    check(sum == messages * (messages + 1) / 2, "sinks got the wrong messages");
+    check(received["stray"] == 0, "a broker with another name got messages");
+    check(sinkData != nullptr && sinkData == tapData, "fanout receivers do not share the payload");
+    check(retained && retained->view().data == tapData && retained->asJson()["n"].int_value() == 2,
+          "retained message does not share the payload");
+
+    uint64_t sentMessages = 0, receivedMessages = 0, acks = 0, handled = 0, timed = 0;
+    for (const auto &p : engine->stats().ports) {
+        if (p.inport) {
+            receivedMessages += p.messages;
+            acks += p.acks;
+            handled += p.handlerDuration.count;
+            timed += p.latency.count;
+        } else if (p.port == "out") {
+            sentMessages += p.messages;
+        }
+    }
+    check(sentMessages == messages, "stats count " + to_string(sentMessages) + " sent messages");
+    check(receivedMessages == messages && acks == messages && handled == messages && timed == messages,
+          "stats count " + to_string(receivedMessages) + " received messages and " + to_string(acks) + " acks");
+
+    // Participants come and go while the loop runs
+    engine->unregisterParticipant(sink2);
+    other->unregisterParticipant(tap);
+    Participant *late = nullptr;
+    received.clear();
+    sink1->onMessage([&](Message *msg) {
+        received["sink1"]++;
+        if (!late) {
+            late = engine->registerParticipant(definition("late", "numbers", ""));
+            late->onMessage([&](Message *m) {
+                received["late"]++;
+                m->ack();
+            });
+        }
+        msg->ack();
+        if (received["sink1"] == more) {
+            ev_break(EV_DEFAULT, EVBREAK_ALL);
+        }
+    });
+    // One message per tick, so the participant registered by the first one gets the rest
+    struct Sender {
+        ev_timer timer;
+        Participant *source;
+        int sent;
+    } sender;
+    sender.source = source;
+    sender.sent = 0;
+    ev_timer_init(&sender.timer, [](struct ev_loop *loop, ev_timer *t, int) {
+        auto s = reinterpret_cast<Sender *>(t);
+        s->source->send("out", json11::Json::object {{"n", ++s->sent}});
+        if (s->sent == more) {
+            ev_timer_stop(loop, t);
+        }
+    }, 0.001, 0.001);
+    ev_timer_start(EV_DEFAULT, &sender.timer);
+    ev_timer_start(EV_DEFAULT, &timeout);
+    engine->launch();
+    ev_timer_stop(EV_DEFAULT, &timeout);
+
+    check(received["sink1"] == more, "remaining instance got " + to_string(received["sink1"]) + " messages");
+    check(received["sink2"] == 0 && received["tap"] == 0, "unregistered participants got messages");
+    check(received["late"] > 0 && received["late"] < more,
+          "participant registered at runtime got " + to_string(received["late"]) + " messages");
+    size_t ports = 0;
+    for (const auto &p : engine->stats().ports) {
+        ports += p.inport ? 1 : 0;
+    }
+    // The source's default inport, sink1 and late
+    check(ports == 3, "stats have " + to_string(ports) + " inports after unregistering");
+
+    // An async handler holds on to its messages and completes them out of order
+    auto producer = engine->registerParticipant(definition("producer", "", "jobs"));
+    auto worker = engine->registerParticipant(definition("worker", "jobs", ""));
+    vector<unique_ptr<Message>> pending;
+    worker->onMessageAsync([&](unique_ptr<Message> msg) {
+        pending.push_back(std::move(msg));
+        if (static_cast<int>(pending.size()) == more) {
+            ev_break(EV_DEFAULT, EVBREAK_ALL);
+        }
+    });
+    for (int i = 1; i <= more; i++) {
+        producer->send("out", json11::Json::object {{"n", i}});
+    }
+    ev_timer_start(EV_DEFAULT, &timeout);
+    engine->launch();
+    ev_timer_stop(EV_DEFAULT, &timeout);
+
+    check(static_cast<int>(pending.size()) == more, "async handler got " + to_string(pending.size()) + " messages");
+    sum = 0;
+    for (size_t i = pending.size(); i > 1; i--) {
+        sum += pending[i - 1]->asJson()["n"].int_value();
+        pending[i - 1]->ack();
+    }
+    // Destroyed without completing it
+    pending.clear();
+    check(sum == more * (more + 1) / 2 - 1, "async handler got the wrong messages");
+    for (const auto &p : engine->stats().ports) {
+        if (p.inport && p.queue == "jobs") {
+            check(p.acks == more - 1 && p.nacks == 1 && p.inFlight == 0 && p.handlerDuration.count == more,
+                  "async handler stats count " + to_string(p.acks) + " acks and " + to_string(p.nacks) + " nacks");
+        }
+    }
+
+    // Two inports of one role on the same topic are two queues, both get every message
+    auto pairSource = engine->registerParticipant(definition("pairsource", "", "pair"));
+    Definition pairDefinition = definition("pair", "pair", "");
+    pairDefinition.inports.push_back({"other", "object", "pair"});
+    auto pair = engine->registerParticipant(pairDefinition);
+    received.clear();
+    pair->onMessage([&](Message *msg) {
+        received[msg->port()]++;
+        msg->ack();
+        if (received["in"] + received["other"] == 2 * more) {
+            ev_break(EV_DEFAULT, EVBREAK_ALL);
+        }
+    });
+    for (int i = 1; i <= more; i++) {
+        pairSource->send("out", json11::Json::object {{"n", i}});
+    }
+    ev_timer_start(EV_DEFAULT, &timeout);
+    engine->launch();
+    ev_timer_stop(EV_DEFAULT, &timeout);
+
+    check(received["in"] == more && received["other"] == more,
+          "inports on one topic got " + to_string(received["in"]) + " and " + to_string(received["other"]) + " messages");
+
+    bool threw = false;
+    try {
+        engine->unregisterParticipant(stray);
+    } catch (invalid_argument &) {
+        threw = true;
+    }
+    check(threw, "a participant of another engine was unregistered");
+
+    threw = false;
+    try {
+        Definition bad = definition("bad", "bad.IN", "");
+        bad.inports[0].contentType = "text/x-unknown";
+        engine->registerParticipant(bad);
+    } catch (invalid_argument &) {
+        threw = true;
+    }
+    check(threw, "an unknown content type was accepted");
+
+    if (failures == 0) {
+        cout << "inproc: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
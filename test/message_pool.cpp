@@ -0,0 +1,155 @@
+// Checks that retained messages and their payload copies come from the pools:
+// once warmed up, retaining and releasing messages does not allocate, buffers
+// go back to their size class from any thread, and the statistics add up.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "abstract_message.h"
+#include "message_pool.h"
+
+using namespace std;
+using namespace msgflo;
+
+static bool counting = false;
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void *p = malloc(size);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+struct PooledMessage final : public AbstractMessage, public PoolAllocated<PooledMessage> {
+    PooledMessage(const char *data, uint64_t len)
+        : AbstractMessage(data, len, "in", &jsonCodec())
+    {}
+
+    PooledMessage(PayloadBuffer &&payload, const string &port, const Codec *codec)
+        : AbstractMessage(std::move(payload), port, codec)
+    {}
+
+    virtual unique_ptr<Message> retain() override {
+        return unique_ptr<Message>(new PooledMessage(takePayload(), _port, _codec));
+    }
+
+    virtual void ack() override {}
+    virtual void nack() override {}
+};
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static const char *payloadOf(Message &m) {
+    const char *data;
+    uint64_t len;
+    m.data(&data, &len);
+    return data;
+}
+
+int main() {
+    check(PayloadPool::classFor(1) == 0 && PayloadPool::classFor(64) == 0, "small payloads are not in the first class");
+    check(PayloadPool::classFor(65) == 1 && PayloadPool::classFor(65536) == 10, "payloads are in the wrong class");
+    check(PayloadPool::classFor(65537) == -1, "payloads past 64 KiB are pooled");
+
+    const vector<size_t> sizes = {0, 10, 64, 100, 1000, 4096, 20000, 65536};
+    vector<string> bodies;
+    for (size_t size : sizes) {
+        bodies.push_back(string(size, 'a' + bodies.size()));
+    }
+
+    // Async handlers keep a window of messages, warm the pools up to it
+    const size_t window = 32;
+    vector<unique_ptr<Message>> retained;
+    retained.reserve(window);
+    bool intact = true;
+    auto cycle = [&]() {
+        for (size_t i = 0; i < window; i++) {
+            const string &body = bodies[i % bodies.size()];
+            PooledMessage received(body.data(), body.size());
+            retained.push_back(received.retain());
+        }
+        intact = intact && memcmp(payloadOf(*retained[3]), bodies[3].data(), bodies[3].size()) == 0;
+        retained.clear();
+    };
+    cycle();
+
+    counting = true;
+    for (int i = 0; i < 1000; i++) {
+        cycle();
+    }
+    counting = false;
+    check(intact, "retained payload differs");
+    check(allocations == 0, "steady-state retains allocated " + to_string(allocations) + " times");
+    check(PooledMessage::pool().inUse() == 0, "released messages did not go back to the pool");
+
+    // Retaining a retained message moves the payload instead of copying it
+    PooledMessage received(bodies[4].data(), bodies[4].size());
+    unique_ptr<Message> first = received.retain();
+    const char *copied = payloadOf(*first);
+    unique_ptr<Message> second = first->retain();
+    check(payloadOf(*second) == copied, "retaining an owned payload copied it");
+
+    // Buffers and messages can be released on another thread
+    const PoolStats before = PayloadPool::instance().stats();
+    {
+        vector<PayloadBuffer> buffers;
+        for (const auto &body : bodies) {
+            buffers.push_back(PayloadBuffer(body.data(), body.size()));
+        }
+        thread t([&buffers, &second]() {
+            buffers.clear();
+            second.reset();
+        });
+        t.join();
+    }
+    const PoolStats after = PayloadPool::instance().stats();
+    check(after.bytesInUse + 1024 == before.bytesInUse, "buffers freed on another thread are still in use");
+    check(PooledMessage::pool().inUse() == 1, "a message freed on another thread is still in use");
+    check(after.allocations - before.allocations == bodies.size() - 1, "empty payloads took a buffer");
+    check(after.hits - before.hits == bodies.size() - 1, "warm pools missed");
+
+    // Past the size classes payloads come from the global allocator
+    const string large(100000, 'z');
+    {
+        PayloadBuffer buffer(large.data(), large.size());
+        check(string(buffer.data(), buffer.size()) == large, "large payload differs");
+        const PoolStats s = PayloadPool::instance().stats();
+        check(s.allocations - s.hits == after.allocations - after.hits + 1, "a large payload was not a miss");
+        check(s.peakBytes >= s.bytesInUse && s.bytesInUse >= large.size(), "large payload is not in use");
+    }
+    const PoolStats s = PayloadPool::instance().stats();
+    check(s.bytesInUse == after.bytesInUse, "large payload is still in use");
+    check(s.hitRate() > 0.9, "hit rate is " + to_string(s.hitRate()));
+    check(s.reservedBytes >= s.peakBytes - large.size(), "pool holds less than it handed out");
+
+    const PoolStats m = blockPoolStats(PooledMessage::pool());
+    check(m.bytesInUse == PooledMessage::pool().size(), "message pool has " + to_string(m.bytesInUse) + " bytes in use");
+    check(m.peakBytes == window * PooledMessage::pool().size(), "message pool peaked at " + to_string(m.peakBytes) + " bytes");
+
+    if (failures == 0) {
+        cout << "message_pool: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
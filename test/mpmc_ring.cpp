@@ -0,0 +1,75 @@
+// Checks the bounded ring used to hand MQTT messages to handler threads:
+// ordering and capacity on one thread, and that nothing is lost or delivered
+// twice with several producers and consumers.
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mpmc_ring.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+int main() {
+    MpmcRing<int> ring(3);
+    check(ring.capacity() == 4, "capacity is not rounded up to a power of two");
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4; i++) {
+            check(ring.tryPush(int(i)), "push into a ring with room failed");
+        }
+        int extra = 99;
+        check(!ring.tryPush(std::move(extra)), "push into a full ring succeeded");
+        check(extra == 99, "failed push moved from its argument");
+        for (int i = 0; i < 4; i++) {
+            int v = -1;
+            check(ring.tryPop(v) && v == i, "pop out of order");
+        }
+        int v;
+        check(!ring.tryPop(v) && ring.empty(), "pop from an empty ring succeeded");
+    }
+
+    const int producers = 3;
+    const long perProducer = 20000;
+    atomic<long> sum(0);
+    atomic<long> count(0);
+    {
+        // A small ring so producers regularly find it full and consumers empty
+        RingWorkers<string> workers(16, 4, [&](string &s) {
+            sum += stol(s);
+            count++;
+        });
+        vector<thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&]() {
+                for (long i = 1; i <= perProducer; i++) {
+                    workers.push(to_string(i));
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    check(count == producers * perProducer, "consumed " + to_string(count.load()) + " items");
+    check(sum == producers * perProducer * (perProducer + 1) / 2, "items lost or duplicated");
+
+    if (failures == 0) {
+        cout << "mpmc_ring: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,78 @@
+// Checks that pooled objects share blocks with their reference counts, are
+// recycled once the last reference is gone, and can be freed from any thread.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "object_pool.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+struct Tracked {
+    explicit Tracked(int value, int *destroyed)
+        : value(value)
+        , destroyed(destroyed)
+    {}
+
+    ~Tracked() {
+        (*destroyed)++;
+    }
+
+    int value;
+    int *destroyed;
+    char padding[100];
+};
+
+int main() {
+    int destroyed = 0;
+    ObjectPool<Tracked> pool(4);
+
+    vector<shared_ptr<Tracked>> objects;
+    for (int i = 0; i < 6; i++) {
+        objects.push_back(pool.make(i, &destroyed));
+    }
+    check(pool.inUse() == 6, "objects are not taken from the pool, " + to_string(pool.inUse()) + " in use");
+    check(pool.capacity() == 8, "pool did not grow by whole chunks");
+    check(objects[5]->value == 5, "constructor arguments are not passed on");
+
+    const Tracked *first = objects[0].get();
+    objects.erase(objects.begin());
+    check(destroyed == 1 && pool.inUse() == 5, "dropping the last reference did not free the object");
+    auto reused = pool.make(42, &destroyed);
+    check(reused.get() == first, "a freed block is not reused");
+
+    // The last reference may be dropped on another thread
+    thread t([&objects]() {
+        objects.clear();
+    });
+    t.join();
+    check(destroyed == 6 && pool.inUse() == 1, "objects freed on another thread did not go back to the pool");
+
+    // The pool lives on while objects made from it do
+    shared_ptr<Tracked> survivor;
+    {
+        ObjectPool<Tracked> shortLived;
+        survivor = shortLived.make(7, &destroyed);
+    }
+    check(survivor->value == 7, "object lost its pool");
+    survivor.reset();
+
+    if (failures == 0) {
+        cout << "object_pool: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,147 @@
+// Checks the outbound queue's overflow policies and watermarks: failing sends
+// that do not fit, dropping the oldest, a producer waiting for a drain to
+// make room, the watermark callback firing once per crossing, and closing.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "outbound_queue.h"
+
+using namespace std;
+using namespace msgflo;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static OutboundQueue::Item item(const string &body, const SendCallback &done = SendCallback()) {
+    return OutboundQueue::Item{nullptr, nullptr, body, done};
+}
+
+static vector<string> drainAll(OutboundQueue &q) {
+    vector<string> bodies;
+    q.drain([](const OutboundQueue::Item &) {
+        return true;
+    }, [&](const OutboundQueue::Item &i) {
+        bodies.push_back(i.body);
+    });
+    return bodies;
+}
+
+int main() {
+    {
+        OutboundQueue q(3, 0, OverflowPolicy::Fail);
+        int failed = 0;
+        for (int i = 0; i < 5; i++) {
+            q.push(item(to_string(i), [&](bool ok) {
+                failed += ok ? 0 : 1;
+            }), true);
+        }
+        check(failed == 2 && q.refused() == 2, "Fail refused " + to_string(failed) + " sends");
+        check(drainAll(q) == vector<string>{"0", "1", "2"}, "Fail did not keep the first sends");
+    }
+
+    {
+        OutboundQueue q(0, 10, OverflowPolicy::DropOldest);
+        vector<string> failed;
+        for (const string body : {"aaaa", "bbbb", "cccc", "dddd"}) {
+            q.push(item(body, [&failed, body](bool ok) {
+                if (!ok) {
+                    failed.push_back(body);
+                }
+            }), true);
+        }
+        check(failed == vector<string>{"aaaa", "bbbb"} && q.dropped() == 2, "DropOldest dropped the wrong sends");
+        check(q.queuedBytes() == 8, "queue holds " + to_string(q.queuedBytes()) + " bytes");
+        check(drainAll(q) == vector<string>{"cccc", "dddd"}, "DropOldest did not keep the newest sends");
+
+        // A send larger than the limit still goes when the queue is empty
+        check(q.push(item(string(20, 'x')), true) && q.queuedMessages() == 1, "an oversized send was refused");
+    }
+
+    {
+        OutboundQueue q(2, 0, OverflowPolicy::Block);
+        q.push(item("0"), true);
+        q.push(item("1"), true);
+        check(!q.push(item("loop"), false), "a send that may not wait was queued");
+
+        atomic<bool> pushed(false);
+        thread producer([&]() {
+            q.push(item("2"), true);
+            pushed = true;
+        });
+        this_thread::sleep_for(chrono::milliseconds(50));
+        check(!pushed, "a blocking send did not wait for room");
+
+        vector<string> bodies;
+        q.drain([&](const OutboundQueue::Item &) {
+            return bodies.empty();
+        }, [&](const OutboundQueue::Item &i) {
+            bodies.push_back(i.body);
+        });
+        producer.join();
+        check(pushed && bodies == vector<string>{"0"}, "a drain did not let the blocked send in");
+        check(drainAll(q) == vector<string>{"1", "2"}, "sends were reordered");
+        check(q.empty(), "drained queue is not empty");
+    }
+
+    {
+        vector<bool> calls;
+        OutboundQueue q(10, 0, OverflowPolicy::Fail, 0.8, 0.3, [&](bool above) {
+            calls.push_back(above);
+        });
+        for (int i = 0; i < 10; i++) {
+            q.push(item("x"), true);
+        }
+        int n = 0;
+        q.drain([&](const OutboundQueue::Item &) {
+            return ++n <= 5;
+        }, [](const OutboundQueue::Item &) {});
+        check(calls == vector<bool>{true}, "watermark fired before reaching the low mark");
+        drainAll(q);
+        check(calls == vector<bool>{true, false}, "watermark did not fire once per crossing");
+    }
+
+    {
+        // Closing fails what is queued, lets blocked senders go and refuses later sends
+        unique_ptr<OutboundQueue> q(new OutboundQueue(1, 0, OverflowPolicy::Block));
+        atomic<int> failed(0);
+        const auto count = [&](bool ok) {
+            failed += ok ? 0 : 1;
+        };
+        q->push(item("queued", count), true);
+        atomic<int> refused(0);
+        vector<thread> producers;
+        for (int i = 0; i < 3; i++) {
+            producers.emplace_back([&]() {
+                if (!q->push(item("blocked", count), true)) {
+                    refused++;
+                }
+            });
+        }
+        this_thread::sleep_for(chrono::milliseconds(50));
+        q->close();
+        check(failed == 4 && refused == 3, "closing failed " + to_string(failed.load()) + " sends");
+        check(!q->push(item("late", count), true) && failed == 5, "a send after closing was queued");
+        q.reset();
+        for (auto &p : producers) {
+            p.join();
+        }
+    }
+
+    if (failures == 0) {
+        cout << "outbound_queue: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
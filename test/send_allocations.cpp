@@ -0,0 +1,158 @@
+// Checks that a steady-state send through an OutPort handle does not allocate.
+// The engine is replaced by one that drops the encoded message, so this covers
+// the handle, the codecs and the per-thread send buffer, not the client libraries.
+// Also checks that a batch completes once when its sends complete on several threads.
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "participant.h"
+
+using namespace std;
+using namespace msgflo;
+
+static bool counting = false;
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void *p = malloc(size);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+struct NullEngine {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+
+    void send(const ParticipantRegistrationT<NullEngine> *r, const OutPortState &port,
+              const char *data, uint64_t len, bool compressed, const SendCallback &done) {
+        messages++;
+        bytes += len;
+        if (done) {
+            done(true);
+        }
+    }
+
+    void sendBatch(const ParticipantRegistrationT<NullEngine> *r, const OutPortState &port,
+                   const vector<PayloadView> &payloads, const vector<bool> &compressed, const SendCallback &done) {
+        const auto each = completeAll(payloads.size(), done);
+        for (const auto &p : payloads) {
+            send(r, port, p.data, p.size, false, each);
+        }
+    }
+};
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+int main() {
+    Definition def;
+    def.role = "allocations";
+    def.outports = {
+        {"out", "any", "allocations.OUT"},
+        {"packed", "any", "allocations.PACKED"},
+    };
+    def.outports[1].contentType = "msgpack";
+
+    NullEngine engine;
+    ParticipantRegistrationT<NullEngine> participant(&engine, 0, def);
+
+    const OutPort out = participant.outPort("out");
+    const OutPort packed = participant.outPort("packed");
+    const json11::Json payload = json11::Json::object {
+        {"sensor", "temperature-sensor-with-a-long-name"},
+        {"value", 21.5},
+        {"samples", json11::Json::array { 1, 2, 3, 4, 5, 6, 7, 8 }},
+    };
+    const string raw(200, 'x');
+    const vector<PayloadView> batch(8, PayloadView{raw.data(), raw.size()});
+
+    // The first sends size the per-thread buffer
+    for (int i = 0; i < 10; i++) {
+        participant.send(out, payload);
+        participant.send(packed, payload);
+    }
+
+    counting = true;
+    for (int i = 0; i < 10000; i++) {
+        participant.send(out, payload);
+        participant.send(packed, payload);
+        participant.send(out, raw.data(), raw.size());
+        participant.send(out, raw);
+        participant.sendBatch(out, batch);
+    }
+    counting = false;
+
+    check(allocations == 0, "steady-state sends allocated " + to_string(allocations) + " times");
+    check(engine.messages == 120020, "sent " + to_string(engine.messages) + " messages");
+
+    int completions = 0;
+    bool allOk = false;
+    participant.sendBatch("out", batch, [&](bool ok) {
+        completions++;
+        allOk = ok;
+    });
+    check(completions == 1 && allOk, "a batch completed " + to_string(completions) + " times");
+
+    // Sends of a batch completing on several threads, one of them failing
+    for (int round = 0; round < 100; round++) {
+        atomic<int> calls(0);
+        atomic<bool> result(true);
+        const auto each = completeAll(400, [&](bool ok) {
+            calls++;
+            result = ok;
+        });
+        vector<thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&each, t]() {
+                for (int i = 0; i < 100; i++) {
+                    each(!(t == 3 && i == 50));
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        check(calls == 1 && !result, "a batch completed on several threads " + to_string(calls.load()) + " times");
+    }
+
+    bool threw = false;
+    try {
+        participant.outPort("missing");
+    } catch (domain_error &) {
+        threw = true;
+    }
+    check(threw, "outPort() accepts unknown ports");
+
+    threw = false;
+    try {
+        participant.send(OutPort(), payload);
+    } catch (domain_error &) {
+        threw = true;
+    }
+    check(threw, "send() accepts an unresolved OutPort");
+
+    if (failures == 0) {
+        cout << "send_allocations: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,261 @@
+// Checks streams end to end without a broker: the sender keeps no more than
+// its window of chunks in flight, the reader puts chunks arriving in any order
+// back together and acks them, gives up on transfers it cannot complete, and
+// a file sent from its mapping arrives intact.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "abstract_message.h"
+#include "participant.h"
+
+using namespace std;
+using namespace msgflo;
+
+struct Settled {
+    int acks = 0;
+    int nacks = 0;
+};
+
+struct ChunkMessage final : public AbstractMessage {
+    ChunkMessage(PayloadBuffer &&payload, Settled *settled)
+        : AbstractMessage(std::move(payload), "in", findCodec("raw"))
+        , settled(settled)
+    {}
+
+    virtual unique_ptr<Message> retain() override {
+        return unique_ptr<Message>(new ChunkMessage(takePayload(), settled));
+    }
+
+    virtual void ack() override {
+        settled->acks++;
+    }
+
+    virtual void nack() override {
+        settled->nacks++;
+    }
+
+    Settled *settled;
+};
+
+// Keeps every send as a message and completes them when told to
+struct LoopbackEngine {
+    Settled settled;
+    vector<unique_ptr<Message>> sent;
+    vector<SendCallback> pending;
+    bool completeRightAway = false;
+
+    void send(const ParticipantRegistrationT<LoopbackEngine> *r, const OutPortState &port,
+              const char *data, uint64_t len, bool compressed, const SendCallback &done) {
+        sent.push_back(unique_ptr<Message>(new ChunkMessage(PayloadBuffer(data, len), &settled)));
+        if (completeRightAway) {
+            done(true);
+        } else {
+            pending.push_back(done);
+        }
+    }
+
+    void sendBatch(const ParticipantRegistrationT<LoopbackEngine> *r, const OutPortState &port,
+                   const vector<PayloadView> &payloads, const vector<bool> &compressed, const SendCallback &done) {
+        const auto each = completeAll(payloads.size(), done);
+        for (const auto &p : payloads) {
+            send(r, port, p.data, p.size, false, each);
+        }
+    }
+
+    // Completes the oldest pending send, which may send the next chunk
+    bool completeOne(bool ok = true) {
+        if (pending.empty()) {
+            return false;
+        }
+        SendCallback done = pending.front();
+        pending.erase(pending.begin());
+        done(ok);
+        return true;
+    }
+};
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << endl;
+        failures++;
+    }
+}
+
+static string pattern(size_t size) {
+    string s(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        s[i] = static_cast<char>((i * 131 + i / 7) & 0xff);
+    }
+    return s;
+}
+
+int main() {
+    Definition def;
+    def.role = "streamer";
+    def.outports = {{"out", "any", "streamer.OUT"}};
+    StreamOptions options;
+    options.chunkSize = 64 * 1024;
+    options.window = 4;
+
+    map<uint64_t, string> received;
+    map<uint64_t, bool> complete;
+    StreamReader reader([&](uint64_t transfer, const char *data, uint64_t len, bool last) {
+        received[transfer].append(data, len);
+        complete[transfer] = last;
+    });
+
+    {
+        LoopbackEngine engine;
+        ParticipantRegistrationT<LoopbackEngine> participant(&engine, 0, def);
+        const OutPort out = participant.outPort("out");
+        const string payload = pattern(1000 * 1000);
+
+        bool finished = false, allOk = false;
+        const uint64_t transfer = participant.sendStream(out, payload.data(), payload.size(), [&](bool ok) {
+            finished = true;
+            allOk = ok;
+        }, options);
+        check(engine.sent.size() == 4, "sent " + to_string(engine.sent.size()) + " chunks before any completed");
+
+        // The first chunks can be read before the rest is sent
+        for (auto &m : engine.sent) {
+            check(reader.read(m), "a chunk was not taken");
+        }
+        engine.sent.clear();
+        check(received[transfer] == payload.substr(0, 4 * 64 * 1024), "first chunks did not arrive");
+
+        while (engine.completeOne()) {
+            check(engine.pending.size() <= 4, "more chunks than the window in flight");
+        }
+        check(finished && allOk, "stream did not complete");
+        check(engine.sent.size() == 12, "sent " + to_string(engine.sent.size()) + " more chunks");
+
+        // The rest arrives shuffled, as with handler threads
+        shuffle(engine.sent.begin(), engine.sent.end(), mt19937(1));
+        for (auto &m : engine.sent) {
+            reader.read(m);
+        }
+        check(received[transfer] == payload, "stream was not put back together");
+        check(complete[transfer], "last chunk was not marked");
+        check(engine.settled.acks == 16 && engine.settled.nacks == 0,
+              "reader acked " + to_string(engine.settled.acks) + " chunks and nacked " + to_string(engine.settled.nacks));
+        check(reader.activeTransfers() == 0, "completed transfer is still active");
+    }
+
+    {
+        // Without a known size the stream ends with an empty chunk, and a
+        // handler reading borrowed messages has the held ones retained
+        LoopbackEngine engine;
+        engine.completeRightAway = true;
+        ParticipantRegistrationT<LoopbackEngine> participant(&engine, 0, def);
+        const string piece = pattern(1000);
+        int pieces = 0;
+        const uint64_t transfer = participant.sendStream(participant.outPort("out"), StreamChunk::unknownSize,
+                                                         [&](uint64_t offset, uint64_t most) {
+            return ++pieces <= 3 ? PayloadView{piece.data(), piece.size()} : PayloadView{nullptr, 0};
+        }, SendCallback(), options);
+        check(engine.sent.size() == 4, "unsized stream took " + to_string(engine.sent.size()) + " chunks");
+
+        swap(engine.sent[1], engine.sent[2]);
+        for (auto &m : engine.sent) {
+            StreamChunk c;
+            check(m->chunk(c) && c.transfer == transfer && c.total == StreamChunk::unknownSize, "chunk header is wrong");
+            unique_ptr<Message> delivered = std::move(m);
+            reader.read(delivered.get());
+        }
+        check(received[transfer] == piece + piece + piece && complete[transfer], "unsized stream differs");
+    }
+
+    {
+        // Too many chunks ahead of a missing one
+        vector<uint64_t> failed;
+        StreamReader impatient([&](uint64_t transfer, const char *data, uint64_t len, bool last) {
+            received[transfer].append(data, len);
+        }, [&](uint64_t transfer) {
+            failed.push_back(transfer);
+        }, 8);
+        LoopbackEngine engine;
+        engine.completeRightAway = true;
+        ParticipantRegistrationT<LoopbackEngine> participant(&engine, 0, def);
+        const string payload = pattern(20 * 1024);
+        StreamOptions small;
+        small.chunkSize = 1024;
+        const uint64_t transfer = participant.sendStream(participant.outPort("out"), payload.data(), payload.size(),
+                                                         SendCallback(), small);
+        for (size_t i = 1; i <= 9; i++) {
+            impatient.read(engine.sent[i]);
+        }
+        check(failed == vector<uint64_t>{transfer}, "transfer was not given up on");
+        check(engine.settled.nacks == 9, "nacked " + to_string(engine.settled.nacks) + " held chunks");
+        impatient.read(engine.sent[0]);
+        check(received.count(transfer) == 0 && engine.settled.nacks == 10, "a chunk of a failed transfer was used");
+        check(impatient.activeTransfers() == 0, "failed transfer is still active");
+    }
+
+    {
+        // A failed send stops the stream
+        LoopbackEngine engine;
+        ParticipantRegistrationT<LoopbackEngine> participant(&engine, 0, def);
+        const string payload = pattern(1000 * 1000);
+        int calls = 0;
+        bool allOk = true;
+        participant.sendStream(participant.outPort("out"), payload.data(), payload.size(), [&](bool ok) {
+            calls++;
+            allOk = ok;
+        }, options);
+        engine.completeOne(false);
+        while (engine.completeOne()) {
+        }
+        check(calls == 1 && !allOk, "failed stream completed " + to_string(calls) + " times");
+        check(engine.sent.size() == 4, "chunks were sent after a failure");
+    }
+
+    {
+        char path[] = "/tmp/msgflo-stream-XXXXXX";
+        const int fd = mkstemp(path);
+        const string contents = pattern(300 * 1000 + 17);
+        check(fd >= 0 && write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size()), "could not write file");
+        close(fd);
+
+        LoopbackEngine engine;
+        engine.completeRightAway = true;
+        ParticipantRegistrationT<LoopbackEngine> participant(&engine, 0, def);
+        bool allOk = false;
+        const uint64_t transfer = participant.sendFile(participant.outPort("out"), path, [&](bool ok) {
+            allOk = ok;
+        }, options);
+        unlink(path);
+        for (auto &m : engine.sent) {
+            reader.read(m);
+        }
+        check(allOk && received[transfer] == contents && complete[transfer], "file did not arrive intact");
+
+        bool threw = false;
+        try {
+            participant.sendFile(participant.outPort("out"), path);
+        } catch (runtime_error &) {
+            threw = true;
+        }
+        check(threw, "sending a missing file did not throw");
+    }
+
+    Settled settled;
+    unique_ptr<Message> plain(new ChunkMessage(PayloadBuffer("{\"a\":1}", 7), &settled));
+    check(!reader.read(plain) && plain, "a plain message was taken as a chunk");
+
+    if (failures == 0) {
+        cout << "stream: ok" << endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}